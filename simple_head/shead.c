@@ -17,54 +17,44 @@
 */
 
 #include <string.h>
+#include <stddef.h>
 #include "shead.h"
 
-static void _shead_reverse_bytes(char *bytes, uint32_t len)
-{
-    char *end = bytes + len - 1;
-    while (bytes < end) {
-        char temp = *bytes;
-        *bytes = *end;
-        *end = temp;
-        ++bytes, --end;
-    }
-}
-
-static void _shead_check_bigendian(char *bytes, uint32_t len)
-{
-    union {
-        char b;
-        int n;
-    } u;
-    u.n = 1;
-    if (u.b == 1)
-        _shead_reverse_bytes(bytes, len);
-}
+/* 编码为网络序, 字节序在编译期确定 */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define _shead_net64(x) (x)
+#define _shead_net32(x) (x)
+#else
+#define _shead_net64(x) __builtin_bswap64(x)
+#define _shead_net32(x) __builtin_bswap32(x)
+#endif
+
+/* 编码后的固定布局, 解码时一次拷贝出整个header */
+struct _shead_wire {
+    uint64_t id;
+    uint32_t type;
+    uint32_t magic_num;
+    uint32_t reserved;
+    uint32_t body_len;
+};
+typedef char _shead_wire_size_check[sizeof(struct _shead_wire) == SHEAD_ENCODE_SIZE ? 1 : -1];
 
 int shead_encode(const struct shead *head, char *output, uint32_t len)
 {
     if (len < SHEAD_ENCODE_SIZE)
         return -1;
 
-    uint64_t id = head->id;
-    _shead_check_bigendian((char *)&id, sizeof(id));
-    memcpy(output, &id, sizeof(id));
-
-    uint32_t type = head->type;
-    _shead_check_bigendian((char *)&type, sizeof(type));
-    memcpy(output + 8, &type, sizeof(type));
-
-    uint32_t magic_num = SHEAD_MAGIC_NUM;
-    _shead_check_bigendian((char *)&magic_num, sizeof(magic_num));
-    memcpy(output + 12, &magic_num, sizeof(magic_num));
-
-    uint32_t reserved = head->reserved;
-    _shead_check_bigendian((char *)&reserved, sizeof(reserved));
-    memcpy(output + 16, &reserved, sizeof(reserved));
-
-    uint32_t body_len = head->body_len;
-    _shead_check_bigendian((char *)&body_len, sizeof(body_len));
-    memcpy(output + 20, &body_len, sizeof(body_len));
+    /* 逐字段直接写入output, 避免先拼到栈上再整体拷贝造成的store forwarding停顿 */
+    uint64_t id = _shead_net64(head->id);
+    uint32_t type = _shead_net32(head->type);
+    uint32_t magic_num = _shead_net32(SHEAD_MAGIC_NUM);
+    uint32_t reserved = _shead_net32(head->reserved);
+    uint32_t body_len = _shead_net32(head->body_len);
+    memcpy(output + offsetof(struct _shead_wire, id), &id, sizeof(id));
+    memcpy(output + offsetof(struct _shead_wire, type), &type, sizeof(type));
+    memcpy(output + offsetof(struct _shead_wire, magic_num), &magic_num, sizeof(magic_num));
+    memcpy(output + offsetof(struct _shead_wire, reserved), &reserved, sizeof(reserved));
+    memcpy(output + offsetof(struct _shead_wire, body_len), &body_len, sizeof(body_len));
 
     return 0;
 }
@@ -74,25 +64,120 @@ int shead_decode(struct shead *head, const char *input, uint32_t len)
     if (len < SHEAD_ENCODE_SIZE)
         return -1;
 
-    uint32_t magic_num;
-    memcpy(&magic_num, input + 12, sizeof(magic_num));
-    _shead_check_bigendian((char *)&magic_num, sizeof(magic_num));
-    if (magic_num != SHEAD_MAGIC_NUM)
+    struct _shead_wire wire;
+    memcpy(&wire, input, SHEAD_ENCODE_SIZE);
+    if (wire.magic_num != _shead_net32(SHEAD_MAGIC_NUM))
         return -1;
 
-    head->magic_num = magic_num;
+    head->id = _shead_net64(wire.id);
+    head->type = _shead_net32(wire.type);
+    head->magic_num = SHEAD_MAGIC_NUM;
+    head->reserved = _shead_net32(wire.reserved);
+    head->body_len = _shead_net32(wire.body_len);
 
-    memcpy(&head->id, input, sizeof(head->id));
-    _shead_check_bigendian((char *)&head->id, sizeof(head->id));
+    return 0;
+}
 
-    memcpy(&head->type, input + 8, sizeof(head->type));
-    _shead_check_bigendian((char *)&head->type, sizeof(head->type));
+/* varint: 每字节低7位为数据, 最高位表示之后还有字节 */
+static uint32_t _shead_put_varint(char *output, uint64_t value)
+{
+    uint32_t n = 0;
+    while (value >= 0x80) {
+        output[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    output[n++] = (char)value;
+    return n;
+}
 
-    memcpy(&head->reserved, input + 16, sizeof(head->reserved));
-    _shead_check_bigendian((char *)&head->reserved, sizeof(head->reserved));
+/* 返回读取的字节数, 数据不完整返回0, 超过max_bytes返回-1 */
+static int _shead_get_varint(const char *input, uint32_t len, uint32_t max_bytes, uint64_t *value)
+{
+    uint64_t result = 0;
+    uint32_t n;
+    for (n = 0; n < len; ++n) {
+        if (n == max_bytes)
+            return -1;
+        unsigned char byte = input[n];
+        if (n == 9 && byte > 1)
+            return -1; /* 超出64位 */
+        result |= (uint64_t)(byte & 0x7f) << (7 * n);
+        if (!(byte & 0x80)) {
+            *value = result;
+            return n + 1;
+        }
+    }
+    return n == max_bytes ? -1 : 0;
+}
+
+int shead_encode_compact(const struct shead *head, char *output, uint32_t len)
+{
+    if (len < SHEAD_COMPACT_MAX_SIZE)
+        return -1;
 
-    memcpy(&head->body_len, input + 20, sizeof(head->body_len));
-    _shead_check_bigendian((char *)&head->body_len, sizeof(head->body_len));
+    uint32_t n = 0;
+    output[n++] = (char)SHEAD_COMPACT_MAGIC;
+    n += _shead_put_varint(output + n, head->id);
+    n += _shead_put_varint(output + n, head->type);
+    n += _shead_put_varint(output + n, head->reserved >> 16 | head->reserved << 16);
+    n += _shead_put_varint(output + n, head->body_len);
+    return n;
+}
 
-    return 0;
+int shead_decode_compact(struct shead *head, const char *input, uint32_t len)
+{
+    if (!len)
+        return 0;
+    if ((unsigned char)input[0] != SHEAD_COMPACT_MAGIC)
+        return -1;
+
+    uint64_t fields[4];
+    static const uint32_t max_bytes[4] = {10, 5, 5, 5};
+    uint32_t n = 1, i;
+    for (i = 0; i < 4; ++i) {
+        int bytes = _shead_get_varint(input + n, len - n, max_bytes[i], &fields[i]);
+        if (bytes <= 0)
+            return bytes;
+        if (i && fields[i] > UINT32_MAX)
+            return -1;
+        n += bytes;
+    }
+    head->id = fields[0];
+    head->type = fields[1];
+    head->magic_num = SHEAD_MAGIC_NUM;
+    head->reserved = (uint32_t)(fields[2] << 16 | fields[2] >> 16);
+    head->body_len = fields[3];
+    return n;
+}
+
+int shead_scan(const char *input, uint64_t len, int compact, struct shead_frame *frames, uint32_t max, uint64_t *used)
+{
+    uint64_t offset = 0;
+    uint32_t count = 0;
+    /* 帧的位置依赖前一帧的长度, 只能顺序扫描; 每帧只做一次magic比较和一次解码 */
+    while (count < max && offset < len) {
+        struct shead_frame *frame = &frames[count];
+        uint64_t left = len - offset;
+        int head_len;
+        if (compact && (unsigned char)input[offset] == SHEAD_COMPACT_MAGIC) {
+            head_len = shead_decode_compact(&frame->head, input + offset, left < SHEAD_COMPACT_MAX_SIZE ? left : SHEAD_COMPACT_MAX_SIZE);
+        } else if (left < SHEAD_ENCODE_SIZE) {
+            head_len = 0;
+        } else {
+            head_len = shead_decode(&frame->head, input + offset, SHEAD_ENCODE_SIZE) == 0 ? SHEAD_ENCODE_SIZE : -1;
+        }
+        if (head_len == -1) {
+            if (!count)
+                return -1;
+            break; /* 先交出之前的完整帧, 下次扫描从非法header开始 */
+        }
+        if (!head_len || left - head_len < frame->head.body_len)
+            break; /* header或body不完整 */
+        frame->head_len = head_len;
+        offset += head_len + frame->head.body_len;
+        ++count;
+    }
+    if (used)
+        *used = offset;
+    return count;
 }
@@ -11,6 +11,14 @@ extern "C" {
 #define SHEAD_MAGIC_NUM 0xF2A1C2CC
 /* 序列化head的长度 */
 #define SHEAD_ENCODE_SIZE 24
+/*
+ * 紧凑格式header的首字节, 高4位标识紧凑格式, 低4位为版本.
+ * 定长header的首字节是id的最高字节, 可以取任意值, 所以两种格式无法单凭首字节区分:
+ * 只有双方约定使用紧凑格式的连接才按首字节识别(shead_scan的compact参数), 约定的一方需保证定长header的id最高字节不为该值
+ */
+#define SHEAD_COMPACT_MAGIC 0xC1
+/* 紧凑格式header的最大长度: 首字节 + varint的id(10), type(5), reserved(5), body_len(5) */
+#define SHEAD_COMPACT_MAX_SIZE 26
 
 /* 消息头 */
 struct shead {
@@ -21,6 +29,12 @@ struct shead {
     uint32_t body_len;  /* 包体长度 */
 };
 
+/* shead_scan扫描出的一帧 */
+struct shead_frame {
+    struct shead head; /* 解码后的header */
+    uint32_t head_len; /* header编码后的长度, body紧随其后 */
+};
+
 /**
  * @brief 序列化一个消息头到output中, output需要SHEAD_ENCODE_SIZE大小
  *
@@ -47,6 +61,50 @@ int shead_encode(const struct shead *head, char *output, uint32_t len);
  * @date 2014/08/12 13:25:11
 **/
 int shead_decode(struct shead *head, const char *input, uint32_t len);
+/**
+ * @brief 以紧凑格式序列化一个消息头: 首字节SHEAD_COMPACT_MAGIC, 之后依次为varint编码的id, type,
+ *        reserved(循环右移16位, 使只有高16位的值也很短)和body_len. 小消息的header通常只有6~8字节
+ *
+ * @param [in] head   : const struct shead*
+ * @param [in] output   : char* 需要SHEAD_COMPACT_MAX_SIZE大小
+ * @param [in] len   : uint32_t
+ * @return  int
+ * @retval   失败返回-1, 成功返回编码的长度
+ * @see 
+ * @author liangdong
+ * @date 2014/10/25 16:20:41
+**/
+int shead_encode_compact(const struct shead *head, char *output, uint32_t len);
+/**
+ * @brief 反序列化一个紧凑格式的消息头
+ *
+ * @param [in] head   : struct shead*
+ * @param [in] input   : const char*
+ * @param [in] len   : uint32_t
+ * @return  int
+ * @retval   成功返回header的长度, 数据不完整返回0, 不合法返回-1
+ * @see 
+ * @author liangdong
+ * @date 2014/10/25 16:21:36
+**/
+int shead_decode_compact(struct shead *head, const char *input, uint32_t len);
+/**
+ * @brief 一次扫描出input中所有完整的帧(header + body), 用于批量解析
+ *
+ * @param [in] input   : const char*
+ * @param [in] len   : uint64_t input的长度
+ * @param [in] compact   : int 非0时首字节为SHEAD_COMPACT_MAGIC的帧按紧凑格式解码, 其余按定长格式;
+ *                              为0时只接受定长格式. 只能在约定使用紧凑格式的连接上开启
+ * @param [out] frames   : struct shead_frame* 依次填充各帧的header及其长度
+ * @param [in] max   : uint32_t frames的容量
+ * @param [out] used   : uint64_t* 返回的所有帧的总长度, 可以为NULL
+ * @return  int 完整帧的个数, 最后一帧不完整时不计入
+ * @retval   第一个header不合法返回-1; 后面的header不合法时只返回之前的帧
+ * @see 
+ * @author liangdong
+ * @date 2014/10/25 11:05:20
+**/
+int shead_scan(const char *input, uint64_t len, int compact, struct shead_frame *frames, uint32_t max, uint64_t *used);
 
 #ifdef __cplusplus
 }
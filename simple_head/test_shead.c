@@ -18,6 +18,7 @@
 
 #include "shead.h"
 #include <assert.h>
+#include <string.h>
 
 int main(int argc, char **argv)
 {
@@ -38,5 +39,80 @@ int main(int argc, char **argv)
     assert(decode_head.reserved == head.reserved);
     assert(decode_head.body_len == head.body_len);
 
+    /* 网络序 */
+    assert(encode_head[7] == 555 % 256 && encode_head[6] == 555 / 256 && encode_head[11] == 5);
+
+    /* 批量扫描: 两个完整帧, 第三帧body不完整 */
+    char frames[3 * SHEAD_ENCODE_SIZE + 25];
+    uint32_t lens[3] = {10, 0, 10}, offset = 0, i;
+    for (i = 0; i < 3; ++i) {
+        head.id = i;
+        head.body_len = lens[i];
+        assert(shead_encode(&head, frames + offset, SHEAD_ENCODE_SIZE) == 0);
+        memset(frames + offset + SHEAD_ENCODE_SIZE, 'x', i < 2 ? lens[i] : 5);
+        offset += SHEAD_ENCODE_SIZE + (i < 2 ? lens[i] : 5);
+    }
+    struct shead_frame heads[4];
+    uint64_t used;
+    assert(shead_scan(frames, offset, 0, heads, 4, &used) == 2);
+    assert(used == 2 * SHEAD_ENCODE_SIZE + 10);
+    assert(heads[0].head.id == 0 && heads[0].head.body_len == 10 && heads[0].head_len == SHEAD_ENCODE_SIZE);
+    assert(heads[1].head.id == 1 && heads[1].head.body_len == 0);
+    assert(shead_scan(frames, offset, 0, heads, 1, &used) == 1 && used == SHEAD_ENCODE_SIZE + 10);
+    assert(shead_scan(frames, SHEAD_ENCODE_SIZE - 1, 0, heads, 4, &used) == 0 && used == 0);
+
+    /* 非法header: 在首帧返回-1, 否则只返回之前的帧 */
+    frames[SHEAD_ENCODE_SIZE + 10 + 12] ^= 1;
+    assert(shead_scan(frames, offset, 0, heads, 4, &used) == 1 && used == SHEAD_ENCODE_SIZE + 10);
+    assert(shead_scan(frames + used, offset - used, 0, heads, 4, NULL) == -1);
+
+    /* 紧凑格式: 只带预算的小请求header为7字节 */
+    head.id = 300;
+    head.type = 5;
+    head.reserved = 300 << 16;
+    head.body_len = 10;
+    char compact[SHEAD_COMPACT_MAX_SIZE + 10];
+    int compact_len = shead_encode_compact(&head, compact, sizeof(compact));
+    assert(compact_len == 7);
+    assert(shead_decode_compact(&decode_head, compact, compact_len) == compact_len);
+    assert(decode_head.id == 300 && decode_head.type == 5 && decode_head.reserved == 300 << 16 && decode_head.body_len == 10);
+    for (i = 0; i < compact_len; ++i)
+        assert(shead_decode_compact(&decode_head, compact, i) == 0);
+    head.id = UINT64_MAX;
+    head.type = UINT32_MAX;
+    head.reserved = 0x12345678;
+    head.body_len = UINT32_MAX;
+    assert(shead_encode_compact(&head, compact, sizeof(compact)) == SHEAD_COMPACT_MAX_SIZE);
+    assert(shead_decode_compact(&decode_head, compact, SHEAD_COMPACT_MAX_SIZE) == SHEAD_COMPACT_MAX_SIZE);
+    assert(decode_head.id == UINT64_MAX && decode_head.type == UINT32_MAX);
+    assert(decode_head.reserved == 0x12345678 && decode_head.body_len == UINT32_MAX);
+    compact[0] = 0;
+    assert(shead_decode_compact(&decode_head, compact, SHEAD_COMPACT_MAX_SIZE) == -1);
+
+    /* 两种格式混合扫描 */
+    head.id = 1;
+    head.type = 2;
+    head.reserved = 0;
+    head.body_len = 3;
+    offset = shead_encode_compact(&head, frames, sizeof(frames));
+    memcpy(frames + offset, "abc", 3);
+    offset += 3;
+    assert(shead_encode(&head, frames + offset, SHEAD_ENCODE_SIZE) == 0);
+    memcpy(frames + offset + SHEAD_ENCODE_SIZE, "abc", 3);
+    offset += SHEAD_ENCODE_SIZE + 3;
+    assert(shead_scan(frames, offset, 1, heads, 4, &used) == 2 && used == offset);
+    assert(heads[0].head_len == 5 && heads[1].head_len == SHEAD_ENCODE_SIZE);
+    assert(heads[0].head.body_len == 3 && heads[1].head.body_len == 3);
+    assert(shead_scan(frames, 4, 1, heads, 4, &used) == 0 && used == 0);
+    /* 未约定紧凑格式时只接受定长格式 */
+    assert(shead_scan(frames, offset, 0, heads, 4, &used) == -1);
+
+    /* 定长header的id最高字节与SHEAD_COMPACT_MAGIC相同, 未约定紧凑格式时照常解码 */
+    head.id = (uint64_t)SHEAD_COMPACT_MAGIC << 56 | 7;
+    assert(shead_encode(&head, frames, SHEAD_ENCODE_SIZE) == 0);
+    assert((unsigned char)frames[0] == SHEAD_COMPACT_MAGIC);
+    assert(shead_scan(frames, SHEAD_ENCODE_SIZE + 3, 0, heads, 4, &used) == 1 && used == SHEAD_ENCODE_SIZE + 3);
+    assert(heads[0].head.id == head.id && heads[0].head_len == SHEAD_ENCODE_SIZE);
+
     return 0;
 }
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * shead编解码的性能测试: 对1024个定长header反复encode, decode和shead_scan,
+ * 打印每个header的平均耗时. 与旧实现对比时, 在旧版本的shead.c上编译运行同一程序(旧版本没有scan一项)
+ */
+#include "shead.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_HEADS 1024
+#define BENCH_ROUNDS 20000
+
+static double bench_elapsed_ns(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+    static char buf[SHEAD_ENCODE_SIZE * BENCH_HEADS];
+    static struct shead_frame frames[BENCH_HEADS];
+    struct shead head = {0};
+    struct timespec start;
+    uint64_t sum = 0, used;
+    uint32_t i, r;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (r = 0; r < BENCH_ROUNDS; ++r) {
+        for (i = 0; i < BENCH_HEADS; ++i) {
+            head.id = i + r;
+            head.type = i;
+            shead_encode(&head, buf + SHEAD_ENCODE_SIZE * i, SHEAD_ENCODE_SIZE);
+        }
+    }
+    printf("encode %.2f ns/header\n", bench_elapsed_ns(&start) / BENCH_ROUNDS / BENCH_HEADS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (r = 0; r < BENCH_ROUNDS; ++r) {
+        for (i = 0; i < BENCH_HEADS; ++i) {
+            shead_decode(&head, buf + SHEAD_ENCODE_SIZE * i, SHEAD_ENCODE_SIZE);
+            sum += head.id;
+        }
+    }
+    printf("decode %.2f ns/header\n", bench_elapsed_ns(&start) / BENCH_ROUNDS / BENCH_HEADS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (r = 0; r < BENCH_ROUNDS; ++r) {
+        int n = shead_scan(buf, sizeof(buf), 0, frames, BENCH_HEADS, &used);
+        for (i = 0; i < (uint32_t)n; ++i)
+            sum += frames[i].head.id;
+    }
+    printf("scan %.2f ns/header\n", bench_elapsed_ns(&start) / BENCH_ROUNDS / BENCH_HEADS);
+
+    /* 使用计算结果, 避免被优化掉 */
+    printf("checksum %llu\n", (unsigned long long)sum);
+    return 0;
+}
@@ -16,24 +16,300 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
+#endif
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 #include "sio.h"
 #include "sio_dgram.h"
 
+/* linux支持一次系统调用收发多个datagram */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define SIO_DGRAM_MMSG
+#endif
+
+/* linux支持UDP分段卸载(GSO)与接收合并(GRO) */
+#if defined(SIO_DGRAM_MMSG) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define SIO_DGRAM_OFFLOAD
+#endif
+
+/* sendmmsg每次最多提交的datagram个数, 参数数组分配在栈上 */
+#define SIO_DGRAM_SEND_CHUNK 64
+/* 每个接收槽位的控制消息缓冲大小 */
+#define SIO_DGRAM_CTRL_SIZE 64
+/* 单个UDP datagram的最大负载 */
+#define SIO_DGRAM_MAX_PAYLOAD 65507
+
+/* 
+ * 接收槽位: 数据区之前保留一个头部记录容量, 使用户sio_dgram_take拿走的缓冲
+ * 在归还时能判断是否与当前槽位大小一致, 一致则回收进空闲池, 否则直接释放.
+ * */
+#define SIO_DGRAM_SLOT_HEAD 16
+
+static char *_sio_dgram_slot_new(uint32_t size)
+{
+    char *base = malloc(SIO_DGRAM_SLOT_HEAD + size);
+    if (!base)
+        return NULL;
+    memcpy(base, &size, sizeof(size));
+    return base + SIO_DGRAM_SLOT_HEAD;
+}
+
+static uint32_t _sio_dgram_slot_size(const char *data)
+{
+    uint32_t size;
+    memcpy(&size, data - SIO_DGRAM_SLOT_HEAD, sizeof(size));
+    return size;
+}
+
+static void _sio_dgram_slot_free(char *data)
+{
+    free(data - SIO_DGRAM_SLOT_HEAD);
+}
+
+/* 优先从空闲池取槽位 */
+static char *_sio_dgram_slot_get(struct sio_dgram *sdgram)
+{
+    if (sdgram->pool_count)
+        return sdgram->pool[--sdgram->pool_count];
+    return _sio_dgram_slot_new(sdgram->bufsize);
+}
+
+static void _sio_dgram_slot_put(struct sio_dgram *sdgram, char *data)
+{
+    if (_sio_dgram_slot_size(data) == sdgram->bufsize && sdgram->pool_count < sdgram->pool_capacity)
+        sdgram->pool[sdgram->pool_count++] = data;
+    else
+        _sio_dgram_slot_free(data);
+}
+
+/* 按槽位大小调整空闲池: 释放大小不符的槽位, 预分配至pool_capacity个 */
+static void _sio_dgram_fill_pool(struct sio_dgram *sdgram)
+{
+    uint32_t i, kept = 0;
+    for (i = 0; i < sdgram->pool_count; ++i) {
+        if (_sio_dgram_slot_size(sdgram->pool[i]) == sdgram->bufsize && kept < sdgram->pool_capacity)
+            sdgram->pool[kept++] = sdgram->pool[i];
+        else
+            _sio_dgram_slot_free(sdgram->pool[i]);
+    }
+    sdgram->pool_count = kept;
+    while (sdgram->pool_count < sdgram->pool_capacity) {
+        char *slot = _sio_dgram_slot_new(sdgram->bufsize);
+        if (!slot)
+            break;
+        sdgram->pool[sdgram->pool_count++] = slot;
+    }
+}
+
+/* 
+ * 按新的个数与大小重建接收槽位: 先备齐全部新资源, 全部成功后才替换,
+ * 失败时sdgram保持原样, 仍能继续收包.
+ * */
+static int _sio_dgram_alloc_batch(struct sio_dgram *sdgram, uint32_t batch, uint32_t bufsize)
+{
+    char **slots = calloc(batch, sizeof(*slots));
+    char *ctrlbuf = malloc((uint64_t)batch * SIO_DGRAM_CTRL_SIZE);
+    struct sio_dgram_msg *msgs = calloc(batch, sizeof(*msgs));
+    struct iovec *iovs = calloc(batch, sizeof(*iovs));
+#ifdef SIO_DGRAM_MMSG
+    struct mmsghdr *hdrs = calloc(batch, sizeof(*hdrs));
+    if (!slots || !ctrlbuf || !msgs || !iovs || !hdrs) {
+#else
+    struct mmsghdr *hdrs = NULL;
+    if (!slots || !ctrlbuf || !msgs || !iovs) {
+#endif
+        free(slots);
+        free(ctrlbuf);
+        free(msgs);
+        free(iovs);
+        free(hdrs);
+        return -1;
+    }
+
+    /* 大小不变时沿用旧槽位, 不足的优先从空闲池获取; 大小改变则全部新分配 */
+    char same_size = bufsize == sdgram->bufsize;
+    uint32_t i, reused = 0;
+    for (i = 0; i < batch; ++i) {
+        if (same_size && i < sdgram->batch) {
+            slots[i] = sdgram->slots[i];
+            ++reused;
+        } else {
+            slots[i] = same_size ? _sio_dgram_slot_get(sdgram) : _sio_dgram_slot_new(bufsize);
+        }
+        if (!slots[i]) {
+            /* 新取得的槽位按原大小放回空闲池或释放, 沿用的旧槽位不动 */
+            while (i > reused)
+                _sio_dgram_slot_put(sdgram, slots[--i]);
+            free(slots);
+            free(ctrlbuf);
+            free(msgs);
+            free(iovs);
+            free(hdrs);
+            return -1;
+        }
+        iovs[i].iov_base = slots[i];
+        iovs[i].iov_len = bufsize;
+#ifdef SIO_DGRAM_MMSG
+        hdrs[i].msg_hdr.msg_name = &msgs[i].addr;
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+#endif
+    }
+
+    /* 未沿用的旧槽位回收进空闲池(大小不符则释放) */
+    sdgram->bufsize = bufsize;
+    for (i = reused; i < sdgram->batch; ++i)
+        _sio_dgram_slot_put(sdgram, sdgram->slots[i]);
+    _sio_dgram_fill_pool(sdgram);
+
+    free(sdgram->slots);
+    free(sdgram->ctrlbuf);
+    free(sdgram->msgs);
+    free(sdgram->iovs);
+    free(sdgram->hdrs);
+    sdgram->batch = batch;
+    sdgram->slots = slots;
+    sdgram->ctrlbuf = ctrlbuf;
+    sdgram->msgs = msgs;
+    sdgram->iovs = iovs;
+    sdgram->hdrs = hdrs;
+    return 0;
+}
+
+static void _sio_dgram_free(struct sio_dgram *sdgram)
+{
+    uint32_t i;
+    for (i = 0; i < sdgram->batch; ++i)
+        _sio_dgram_slot_free(sdgram->slots[i]);
+    for (i = 0; i < sdgram->pool_count; ++i)
+        _sio_dgram_slot_free(sdgram->pool[i]);
+    free(sdgram->slots);
+    free(sdgram->pool);
+    free(sdgram->ctrlbuf);
+    free(sdgram->msgs);
+    free(sdgram->iovs);
+    free(sdgram->hdrs);
+    free(sdgram);
+}
+
+#ifdef SIO_DGRAM_OFFLOAD
+/* 从控制消息中取出GRO合并的分段大小, 未合并返回0 */
+static uint16_t _sio_dgram_gro_size(struct msghdr *hdr)
+{
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+            continue;
+        if (cmsg->cmsg_len >= CMSG_LEN(sizeof(int))) {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            return gso_size;
+        }
+        uint16_t gso_size;
+        memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+        return gso_size;
+    }
+    return 0;
+}
+#endif
+
+/* 一次性接收至多batch个datagram, 返回个数 */
+static int _sio_dgram_recv(struct sio_dgram *sdgram)
+{
+#ifdef SIO_DGRAM_MMSG
+    uint32_t i;
+    for (i = 0; i < sdgram->batch; ++i) {
+        struct msghdr *hdr = &sdgram->hdrs[i].msg_hdr;
+        hdr->msg_namelen = sizeof(struct sockaddr_in);
+        hdr->msg_control = sdgram->gro ? sdgram->ctrlbuf + (uint64_t)i * SIO_DGRAM_CTRL_SIZE : NULL;
+        hdr->msg_controllen = sdgram->gro ? SIO_DGRAM_CTRL_SIZE : 0;
+    }
+    int count = recvmmsg(sdgram->sock, sdgram->hdrs, sdgram->batch, MSG_DONTWAIT, NULL);
+    if (count <= 0)
+        return 0;
+    for (i = 0; i < count; ++i) {
+        struct sio_dgram_msg *msg = sdgram->msgs + i;
+        msg->data = sdgram->iovs[i].iov_base;
+        msg->size = sdgram->hdrs[i].msg_len;
+        msg->segment_size = 0;
+        msg->truncated = (sdgram->hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) ? 1 : 0;
+#ifdef SIO_DGRAM_OFFLOAD
+        if (sdgram->gro) {
+            msg->segment_size = _sio_dgram_gro_size(&sdgram->hdrs[i].msg_hdr);
+            if (msg->segment_size >= msg->size)
+                msg->segment_size = 0; /* 只有一个分段, 等同于普通datagram */
+        }
+#endif
+    }
+#else
+    int count = 0;
+    while (count < sdgram->batch) {
+        struct sio_dgram_msg *msg = sdgram->msgs + count;
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &msg->addr;
+        hdr.msg_namelen = sizeof(msg->addr);
+        hdr.msg_iov = &sdgram->iovs[count];
+        hdr.msg_iovlen = 1;
+        int64_t size = recvmsg(sdgram->sock, &hdr, 0);
+        if (size <= 0)
+            break;
+        msg->data = sdgram->iovs[count].iov_base;
+        msg->size = size;
+        msg->segment_size = 0;
+        msg->truncated = (hdr.msg_flags & MSG_TRUNC) ? 1 : 0;
+        ++count;
+    }
+#endif
+    int n;
+    for (n = 0; n < count; ++n)
+        sdgram->truncated += sdgram->msgs[n].truncated;
+    return count;
+}
+
 static void _sio_dgram_read(struct sio *sio, struct sio_dgram *sdgram)
 {
-    struct sockaddr_in source;
-    socklen_t len = sizeof(source);
-    int64_t size = recvfrom(sdgram->sock, sdgram->inbuf, 4096, 0, (struct sockaddr *)&source, &len);
-    if (size > 0) {
-        sdgram->user_callback(sio, sdgram, &source, sdgram->inbuf, size, sdgram->user_arg);
+    int count = _sio_dgram_recv(sdgram);
+    if (!count)
+        return;
+
+    /* 用户可能在回调中关闭sdgram, 推迟到回调结束后释放 */
+    sdgram->in_callback = 1;
+    if (sdgram->batch_callback) {
+        sdgram->batch_callback(sio, sdgram, sdgram->msgs, count, sdgram->batch_arg);
+    } else {
+        int i;
+        for (i = 0; i < count && !sdgram->is_closed; ++i) {
+            struct sio_dgram_msg *msg = sdgram->msgs + i;
+            if (!msg->segment_size) {
+                sdgram->user_callback(sio, sdgram, &msg->addr, msg->data, msg->size, sdgram->user_arg);
+                continue;
+            }
+            /* GRO合并的缓冲拆回单个datagram回调 */
+            uint64_t offset;
+            for (offset = 0; offset < msg->size && !sdgram->is_closed; offset += msg->segment_size) {
+                uint64_t left = msg->size - offset;
+                sdgram->user_callback(sio, sdgram, &msg->addr, msg->data + offset,
+                        left < msg->segment_size ? left : msg->segment_size, sdgram->user_arg);
+            }
+        }
     }
+    sdgram->in_callback = 0;
+    if (sdgram->is_closed)
+        _sio_dgram_free(sdgram);
 }
 
 static void _sio_dgram_callback(struct sio *sio, struct sio_fd *sfd, int fd, enum sio_event event, void *arg)
@@ -53,7 +329,8 @@ static void _sio_dgram_callback(struct sio *sio, struct sio_fd *sfd, int fd, enu
     }
 }
 
-struct sio_dgram *sio_dgram_open(struct sio *sio, const char *ipv4, uint16_t port, sio_dgram_callback_t callback, void *arg)
+static struct sio_dgram *_sio_dgram_open(struct sio *sio, const char *ipv4, uint16_t port, char reuseport,
+        sio_dgram_callback_t callback, void *arg)
 {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock == -1)
@@ -63,6 +340,18 @@ struct sio_dgram *sio_dgram_open(struct sio *sio, const char *ipv4, uint16_t por
     int bufsize = 1048576;
     setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
     setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+#ifdef SO_REUSEPORT
+    int on = 1;
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        close(sock);
+        return NULL;
+    }
+#else
+    if (reuseport) {
+        close(sock);
+        return NULL;
+    }
+#endif
     
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
@@ -76,6 +365,12 @@ struct sio_dgram *sio_dgram_open(struct sio *sio, const char *ipv4, uint16_t por
     sdgram->sock = sock;
     sdgram->user_callback = callback;
     sdgram->user_arg = arg;
+    sdgram->max_size = SIO_DGRAM_BUFFER_SIZE;
+    if (_sio_dgram_alloc_batch(sdgram, 1, SIO_DGRAM_BUFFER_SIZE) == -1) {
+        close(sock);
+        free(sdgram);
+        return NULL;
+    }
     sdgram->sfd = sio_add(sio, sock, _sio_dgram_callback, sdgram);
     if (!sdgram->sfd) {
         sio_dgram_close(sio, sdgram);
@@ -85,13 +380,73 @@ struct sio_dgram *sio_dgram_open(struct sio *sio, const char *ipv4, uint16_t por
     return sdgram;
 }
 
+struct sio_dgram *sio_dgram_open(struct sio *sio, const char *ipv4, uint16_t port, sio_dgram_callback_t callback, void *arg)
+{
+    return _sio_dgram_open(sio, ipv4, port, 0, callback, arg);
+}
+
+/* 挂载cBPF程序, 返回收包CPU作为组内socket下标, 下标越界时内核退回哈希分发 */
+static int _sio_dgram_attach_cpu_steering(struct sio_dgram *sdgram)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    return setsockopt(sdgram->sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#else
+    return -1;
+#endif
+}
+
+struct sio_dgram_group *sio_dgram_open_reuseport(struct sio **sios, uint32_t count, const char *ipv4, uint16_t port,
+        int cpu_steering, sio_dgram_callback_t callback, void *arg)
+{
+    if (!count)
+        return NULL;
+
+    struct sio_dgram_group *group = malloc(sizeof(*group));
+    group->count = 0;
+    group->sdgrams = calloc(count, sizeof(*group->sdgrams));
+
+    uint32_t i;
+    for (i = 0; i < count; ++i) {
+        group->sdgrams[i] = _sio_dgram_open(sios[i], ipv4, port, 1, callback, arg);
+        if (!group->sdgrams[i]) {
+            sio_dgram_group_close(sios, group);
+            return NULL;
+        }
+        group->count++;
+    }
+    /* 程序对整个reuseport组生效, 挂载到任意一个socket即可; 失败不影响收包 */
+    if (cpu_steering)
+        _sio_dgram_attach_cpu_steering(group->sdgrams[0]);
+    return group;
+}
+
+void sio_dgram_group_close(struct sio **sios, struct sio_dgram_group *group)
+{
+    uint32_t i;
+    for (i = 0; i < group->count; ++i)
+        sio_dgram_close(sios[i], group->sdgrams[i]);
+    free(group->sdgrams);
+    free(group);
+}
+
 void sio_dgram_close(struct sio *sio, struct sio_dgram *sdgram)
 {
     if (sdgram->sfd) {
         sio_del(sio, sdgram->sfd);
     }
     close(sdgram->sock);
-    free(sdgram);
+    if (sdgram->in_callback) {
+        sdgram->is_closed = 1;
+        return;
+    }
+    _sio_dgram_free(sdgram);
 }
 
 int sio_dgram_write(struct sio *sio, struct sio_dgram *sdgram, const char *ipv4, uint16_t port, const char *data, uint64_t size)
@@ -107,6 +462,221 @@ int sio_dgram_write(struct sio *sio, struct sio_dgram *sdgram, const char *ipv4,
     return ret; // -1 or 0
 }
 
+int sio_dgram_write_batch(struct sio *sio, struct sio_dgram *sdgram, struct sio_dgram_msg *msgs, uint32_t count)
+{
+    uint32_t sent = 0;
+#ifdef SIO_DGRAM_MMSG
+    struct mmsghdr hdrs[SIO_DGRAM_SEND_CHUNK];
+    struct iovec iovs[SIO_DGRAM_SEND_CHUNK];
+    memset(hdrs, 0, sizeof(hdrs));
+
+    while (sent < count) {
+        uint32_t chunk = count - sent < SIO_DGRAM_SEND_CHUNK ? count - sent : SIO_DGRAM_SEND_CHUNK;
+        uint32_t i;
+        for (i = 0; i < chunk; ++i) {
+            struct sio_dgram_msg *msg = msgs + sent + i;
+            iovs[i].iov_base = msg->data;
+            iovs[i].iov_len = msg->size;
+            hdrs[i].msg_hdr.msg_name = &msg->addr;
+            hdrs[i].msg_hdr.msg_namelen = sizeof(msg->addr);
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int ret = sendmmsg(sdgram->sock, hdrs, chunk, 0);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        sent += ret;
+        if (ret < chunk)
+            break; /* 发送缓冲已满 */
+    }
+#else
+    while (sent < count) {
+        struct sio_dgram_msg *msg = msgs + sent;
+        if (sendto(sdgram->sock, msg->data, msg->size, 0, (struct sockaddr *)&msg->addr, sizeof(msg->addr)) == -1)
+            break;
+        ++sent;
+    }
+#endif
+    if (!sent && count)
+        return -1;
+    return sent;
+}
+
+/* 软件分段, 用于内核不支持UDP_SEGMENT的情况, 返回发出的datagram个数, 一个都未发出返回-1 */
+static int _sio_dgram_write_segments(struct sio *sio, struct sio_dgram *sdgram, struct sockaddr_in *addr,
+        const char *data, uint64_t size, uint16_t segment_size)
+{
+    struct sio_dgram_msg msgs[SIO_DGRAM_SEND_CHUNK];
+    uint64_t offset = 0;
+    int sent = 0;
+    while (offset < size) {
+        uint32_t count = 0;
+        while (count < SIO_DGRAM_SEND_CHUNK && offset < size) {
+            uint64_t left = size - offset;
+            msgs[count].addr = *addr;
+            msgs[count].data = (char *)data + offset;
+            msgs[count].size = left < segment_size ? left : segment_size;
+            offset += msgs[count++].size;
+        }
+        int ret = sio_dgram_write_batch(sio, sdgram, msgs, count);
+        if (ret == -1)
+            break;
+        sent += ret;
+        if (ret < count)
+            break; /* 发送缓冲已满 */
+    }
+    if (!sent && size)
+        return -1;
+    return sent;
+}
+
+int sio_dgram_write_gso(struct sio *sio, struct sio_dgram *sdgram, struct sockaddr_in *addr,
+        const char *data, uint64_t size, uint16_t segment_size)
+{
+    if (!segment_size)
+        return -1;
+#ifdef SIO_DGRAM_OFFLOAD
+    /* 每次sendmsg受限于单个UDP包的最大长度与内核的最大分段数 */
+    uint64_t max_chunk = (uint64_t)segment_size * SIO_DGRAM_GSO_MAX_SEGMENTS;
+    if (max_chunk > SIO_DGRAM_MAX_PAYLOAD)
+        max_chunk = SIO_DGRAM_MAX_PAYLOAD / segment_size * segment_size;
+
+    uint64_t offset = 0;
+    while (!sdgram->gso_disabled && offset < size && max_chunk) {
+        uint64_t chunk = size - offset < max_chunk ? size - offset : max_chunk;
+
+        struct iovec iov;
+        iov.iov_base = (char *)data + offset;
+        iov.iov_len = chunk;
+
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        memset(control, 0, sizeof(control));
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = addr;
+        hdr.msg_namelen = sizeof(*addr);
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+        if (sendmsg(sdgram->sock, &hdr, 0) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EIO && errno != EINVAL && errno != ENOPROTOOPT && errno != EOPNOTSUPP)
+                return offset ? offset / segment_size : -1; /* 已发出的部分都是完整分段 */
+            sdgram->gso_disabled = 1; /* 内核或网卡不支持, 之后走软件分段 */
+            break;
+        }
+        offset += chunk;
+    }
+    int sent = (offset + segment_size - 1) / segment_size;
+    if (offset == size)
+        return sent;
+    int ret = _sio_dgram_write_segments(sio, sdgram, addr, data + offset, size - offset, segment_size);
+    if (ret == -1)
+        return sent ? sent : -1;
+    return sent + ret;
+#else
+    return _sio_dgram_write_segments(sio, sdgram, addr, data, size, segment_size);
+#endif
+}
+
+int sio_dgram_set_gro(struct sio *sio, struct sio_dgram *sdgram, int enable)
+{
+#ifdef SIO_DGRAM_OFFLOAD
+    int on = enable ? 1 : 0;
+    if (setsockopt(sdgram->sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1)
+        return -1;
+    /* 合并后的缓冲最大64KB, 接收槽位需随之扩大 */
+    uint32_t bufsize = on ? SIO_DGRAM_GRO_BUFFER_SIZE : sdgram->max_size;
+    if (bufsize != sdgram->bufsize && _sio_dgram_alloc_batch(sdgram, sdgram->batch, bufsize) == -1) {
+        on = sdgram->gro;
+        setsockopt(sdgram->sock, SOL_UDP, UDP_GRO, &on, sizeof(on));
+        return -1;
+    }
+    sdgram->gro = on;
+    return 0;
+#else
+    return enable ? -1 : 0;
+#endif
+}
+
+int sio_dgram_set_buffer(struct sio *sio, struct sio_dgram *sdgram, uint32_t max_size, uint32_t spare_slots)
+{
+    if (!max_size || max_size > SIO_DGRAM_GRO_BUFFER_SIZE)
+        return -1;
+    if (spare_slots > sdgram->pool_capacity) {
+        char **pool = realloc(sdgram->pool, spare_slots * sizeof(*pool));
+        if (!pool)
+            return -1;
+        sdgram->pool = pool;
+    }
+
+    /* 槽位重建成功后才更新配置, 失败时保持原样 */
+    uint32_t bufsize = sdgram->gro ? SIO_DGRAM_GRO_BUFFER_SIZE : max_size;
+    if (bufsize != sdgram->bufsize && _sio_dgram_alloc_batch(sdgram, sdgram->batch, bufsize) == -1)
+        return -1;
+    sdgram->pool_capacity = spare_slots;
+    sdgram->max_size = max_size;
+    _sio_dgram_fill_pool(sdgram);
+    return 0;
+}
+
+char *sio_dgram_take(struct sio_dgram *sdgram, const char *data)
+{
+    uint32_t i;
+    for (i = 0; i < sdgram->batch; ++i) {
+        if (sdgram->slots[i] != data)
+            continue;
+        /* 逐个回调时GRO合并的槽位之后还要拆出其余datagram回调, 不能交给用户 */
+        if (!sdgram->batch_callback && sdgram->msgs[i].segment_size)
+            return NULL;
+        char *slot = _sio_dgram_slot_get(sdgram);
+        if (!slot)
+            return NULL;
+        sdgram->slots[i] = slot;
+        sdgram->iovs[i].iov_base = slot;
+        return (char *)data;
+    }
+    return NULL;
+}
+
+void sio_dgram_release(struct sio_dgram *sdgram, char *data)
+{
+    _sio_dgram_slot_put(sdgram, data);
+}
+
+void sio_dgram_buffer_free(char *data)
+{
+    _sio_dgram_slot_free(data);
+}
+
+uint64_t sio_dgram_truncated(struct sio_dgram *sdgram)
+{
+    return sdgram->truncated;
+}
+
+int sio_dgram_set_batch(struct sio *sio, struct sio_dgram *sdgram, uint32_t batch, sio_dgram_batch_callback_t callback, void *arg)
+{
+    if (!batch || batch > SIO_DGRAM_MAX_BATCH)
+        return -1;
+    if (batch != sdgram->batch && _sio_dgram_alloc_batch(sdgram, batch, sdgram->bufsize) == -1)
+        return -1;
+    sdgram->batch_callback = callback;
+    sdgram->batch_arg = arg;
+    return 0;
+}
+
 void sio_dgram_set(struct sio *sio, struct sio_dgram *sdgram, sio_dgram_callback_t callback, void *arg)
 {
     sdgram->user_callback = callback;
@@ -8,20 +8,66 @@
 extern "C" {
 #endif
 
+/* 每个datagram的默认接收缓冲大小, 可通过sio_dgram_set_buffer调整 */
+#define SIO_DGRAM_BUFFER_SIZE 4096
+/* 开启GRO后每个接收槽位需容纳合并后的最大UDP负载, 也是可配置的最大datagram长度 */
+#define SIO_DGRAM_GRO_BUFFER_SIZE 65536
+/* 一次GSO发送最多切分的datagram个数(内核限制) */
+#define SIO_DGRAM_GSO_MAX_SEGMENTS 64
+/* 一次批量收发的最大datagram个数 */
+#define SIO_DGRAM_MAX_BATCH 1024
+
 struct sio;
 struct sio_fd;
 struct sio_dgram;
+struct mmsghdr;
+struct iovec;
+
+/* 批量收发中的一个datagram */
+struct sio_dgram_msg {
+    struct sockaddr_in addr; /* 接收时为来源地址, 发送时为目的地址 */
+    char *data; /* 数据 */
+    uint64_t size; /* 数据长度 */
+    uint16_t segment_size; /* 非0表示data是GRO合并的多个datagram, 每个segment_size字节(最后一个可能更短) */
+    char truncated; /* datagram超过接收槽位大小被截断 */
+};
 
 /* UDP收包回调 */
 typedef void (*sio_dgram_callback_t)(struct sio *sio, struct sio_dgram *sdgram,
         struct sockaddr_in *addr, char *data, uint64_t size, void *arg);
+/* UDP批量收包回调, msgs只在回调期间有效 */
+typedef void (*sio_dgram_batch_callback_t)(struct sio *sio, struct sio_dgram *sdgram,
+        struct sio_dgram_msg *msgs, uint32_t count, void *arg);
+
+/* 绑定在同一端口上的一组SO_REUSEPORT socket, 由内核在组内分发datagram */
+struct sio_dgram_group {
+    uint32_t count; /* socket个数 */
+    struct sio_dgram **sdgrams; /* 第i个socket注册在第i个sio上 */
+};
 
 struct sio_dgram {
     int sock;
     struct sio_fd *sfd;
     sio_dgram_callback_t user_callback;
+    sio_dgram_batch_callback_t batch_callback; /* 非NULL时以批量方式回调 */
     void *user_arg;
-    char inbuf[4096];
+    void *batch_arg; /* 批量回调的参数, 与user_arg互不影响 */
+    uint32_t batch; /* 每次可读事件最多接收的datagram个数 */
+    uint32_t max_size; /* 用户配置的最大datagram长度 */
+    uint32_t bufsize; /* 每个接收槽位的大小, 开启GRO时为64KB, 否则为max_size */
+    char **slots; /* batch个接收槽位 */
+    char **pool; /* 预分配的空闲槽位, 用于补充被sio_dgram_take拿走的槽位 */
+    uint32_t pool_count; /* 空闲槽位个数 */
+    uint32_t pool_capacity; /* 空闲池容量 */
+    uint64_t truncated; /* 累计被截断的datagram个数 */
+    char *ctrlbuf; /* 每个接收槽位的控制消息缓冲(GRO) */
+    char gro; /* 是否开启UDP_GRO */
+    char gso_disabled; /* 内核不支持UDP_SEGMENT, 回退为sendmmsg */
+    struct sio_dgram_msg *msgs; /* 本次接收的datagram */
+    struct mmsghdr *hdrs; /* recvmmsg参数 */
+    struct iovec *iovs; /* recvmmsg参数 */
+    char in_callback; /* 正在回调用户 */
+    char is_closed; /* 回调中被sio_dgram_close, 回调结束后释放 */
 };
 
 /**
@@ -40,6 +86,38 @@ struct sio_dgram {
  * @date 2014/03/31 13:55:27
 **/
 struct sio_dgram *sio_dgram_open(struct sio *sio, const char *ipv4, uint16_t port, sio_dgram_callback_t callback, void *arg);
+/**
+ * @brief 在同一ipv4,port上打开count个SO_REUSEPORT udp socket, 第i个socket注册到sios[i],
+ *        使UDP接收随sio线程数扩展. 必须在各sio的事件循环启动前调用.
+ *
+ * @param [in] sios   : struct sio** count个sio, 通常每个线程一个
+ * @param [in] count   : uint32_t
+ * @param [in] ipv4   : const char*
+ * @param [in] port   : uint16_t
+ * @param [in] cpu_steering   : int 非0则挂载cBPF程序按收包CPU选择socket,
+ *                              需要第i个sio的线程绑定在CPU i上, 内核不支持时退化为按四元组哈希
+ * @param [in] callback   : sio_dgram_callback_t
+ * @param [in] arg   : void*
+ * @return  struct sio_dgram_group* 
+ * @retval   失败返回NULL
+ * @see 
+ * @author liangdong
+ * @date 2014/09/22 10:21:45
+**/
+struct sio_dgram_group *sio_dgram_open_reuseport(struct sio **sios, uint32_t count, const char *ipv4, uint16_t port,
+        int cpu_steering, sio_dgram_callback_t callback, void *arg);
+/**
+ * @brief 关闭一组udp socket, 必须在各sio的事件循环停止后调用
+ *
+ * @param [in] sios   : struct sio** 与open时相同
+ * @param [in] group   : struct sio_dgram_group*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/22 10:23:10
+**/
+void sio_dgram_group_close(struct sio **sios, struct sio_dgram_group *group);
 /**
  * @brief 关闭udp socket
  *
@@ -83,6 +161,130 @@ int sio_dgram_write(struct sio *sio, struct sio_dgram *sdgram, const char *ipv4,
  * @date 2014/03/31 15:19:22
 **/
 int sio_dgram_response(struct sio *sio, struct sio_dgram *sdgram, struct sockaddr_in *source, const char *data, uint64_t size);
+/**
+ * @brief 批量发送datagram, 尽可能通过一次系统调用发出(sendmmsg)
+ *
+ * @param [in] sio   : struct sio*
+ * @param [in] sdgram   : struct sio_dgram*
+ * @param [in] msgs   : struct sio_dgram_msg* 每个datagram需填写目的地址addr
+ * @param [in] count   : uint32_t
+ * @return  int 返回成功交给内核的datagram个数(发送缓冲满时可能小于count), 一个都未发出返回-1
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/17 14:32:10
+**/
+int sio_dgram_write_batch(struct sio *sio, struct sio_dgram *sdgram, struct sio_dgram_msg *msgs, uint32_t count);
+/**
+ * @brief 通过UDP GSO发送: data按segment_size切分为多个datagram发往addr,
+ *        由内核(或网卡)完成分段, 内核不支持时回退为sendmmsg批量发送
+ *
+ * @param [in] sio   : struct sio*
+ * @param [in] sdgram   : struct sio_dgram*
+ * @param [in] addr   : struct sockaddr_in* 目的地址
+ * @param [in] data   : const char*
+ * @param [in] size   : uint64_t
+ * @param [in] segment_size   : uint16_t 每个datagram的负载大小, 必须>0
+ * @return  int 返回交给内核的datagram个数n, 即data的前n * segment_size字节已发出,
+ *              发送缓冲满时可能少于总数, 一个都未发出返回-1
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/18 16:05:44
+**/
+int sio_dgram_write_gso(struct sio *sio, struct sio_dgram *sdgram, struct sockaddr_in *addr,
+        const char *data, uint64_t size, uint16_t segment_size);
+/**
+ * @brief 开启或关闭UDP GRO接收: 同一来源的连续datagram被内核合并为一个缓冲,
+ *        批量回调通过sio_dgram_msg.segment_size得到合并缓冲, 逐个回调仍按单个datagram回调
+ *
+ * @param [in] sio   : struct sio*
+ * @param [in] sdgram   : struct sio_dgram*
+ * @param [in] enable   : int
+ * @return  int 
+ * @retval   内核不支持返回-1, 成功返回0
+ * @see 不要在回调中调用
+ * @author liangdong
+ * @date 2014/09/18 16:12:19
+**/
+int sio_dgram_set_gro(struct sio *sio, struct sio_dgram *sdgram, int enable);
+/**
+ * @brief 设置最大datagram长度与预分配的空闲槽位个数, 超长的datagram被截断并计数
+ *
+ * @param [in] sio   : struct sio*
+ * @param [in] sdgram   : struct sio_dgram*
+ * @param [in] max_size   : uint32_t 1~SIO_DGRAM_GRO_BUFFER_SIZE, 默认SIO_DGRAM_BUFFER_SIZE
+ * @param [in] spare_slots   : uint32_t 空闲池容量, 回调中sio_dgram_take拿走的槽位由空闲池补充
+ * @return  int 
+ * @retval   参数非法或内存不足返回-1, 成功返回0
+ * @see 不要在回调中调用
+ * @author liangdong
+ * @date 2014/09/19 11:03:27
+**/
+int sio_dgram_set_buffer(struct sio *sio, struct sio_dgram *sdgram, uint32_t max_size, uint32_t spare_slots);
+/**
+ * @brief 在收包回调中取走datagram所在的接收槽位, 避免拷贝, 槽位由空闲池补充
+ *
+ * @param [in] sdgram   : struct sio_dgram*
+ * @param [in] data   : const char* 必须是回调传入的data
+ * @return  char* 取走的缓冲(即data), 用户用完后调用sio_dgram_release或sio_dgram_buffer_free
+ * @retval   data不是槽位起始地址, 或内存不足, 或逐个回调中data属于GRO合并的缓冲(拆分出的任何一个datagram,
+ *           包括首个)时返回NULL, 此时data只在回调期间有效. 批量回调中可以取走整个合并缓冲
+ * @see 
+ * @author liangdong
+ * @date 2014/09/19 11:10:52
+**/
+char *sio_dgram_take(struct sio_dgram *sdgram, const char *data);
+/**
+ * @brief 归还sio_dgram_take取走的缓冲, 放回空闲池复用, 只能在sdgram所在的sio线程调用
+ *
+ * @param [in] sdgram   : struct sio_dgram*
+ * @param [in] data   : char*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/19 11:12:30
+**/
+void sio_dgram_release(struct sio_dgram *sdgram, char *data);
+/**
+ * @brief 释放sio_dgram_take取走的缓冲, 不回收, 可以在任意线程调用, sdgram关闭后也可调用
+ *
+ * @param [in] data   : char*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/19 11:13:04
+**/
+void sio_dgram_buffer_free(char *data);
+/**
+ * @brief 返回累计被截断的datagram个数
+ *
+ * @param [in] sdgram   : struct sio_dgram*
+ * @return  uint64_t 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/19 11:14:18
+**/
+uint64_t sio_dgram_truncated(struct sio_dgram *sdgram);
+/**
+ * @brief 设置每次可读事件最多接收batch个datagram(recvmmsg),
+ *        callback非NULL时整批回调一次, 否则对每个datagram调用sio_dgram_open时的回调
+ *
+ * @param [in] sio   : struct sio*
+ * @param [in] sdgram   : struct sio_dgram*
+ * @param [in] batch   : uint32_t 1~SIO_DGRAM_MAX_BATCH, 默认1
+ * @param [in] callback   : sio_dgram_batch_callback_t 可以为NULL
+ * @param [in] arg   : void* 批量回调的用户参数, 不影响sio_dgram_open/sio_dgram_set设置的参数
+ * @return  int 
+ * @retval   batch非法返回-1, 成功返回0
+ * @see 不要在回调中调用
+ * @author liangdong
+ * @date 2014/09/17 14:35:51
+**/
+int sio_dgram_set_batch(struct sio *sio, struct sio_dgram *sdgram, uint32_t batch, sio_dgram_batch_callback_t callback, void *arg);
 /**
  * @brief 更新sio_dgram的回调函数和参数
  *
@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+#include "shash.h"
+#include "sdeque.h"
+#include "sio.h"
+#include "sio_rpc.h"
+#include "sio_dgram.h"
+#include "sio_dgram_rpc.h"
+
+/* 清理过期去重记录的间隔 */
+#define SIO_DGRAM_RPC_SWEEP_INTERVAL 100
+
+static uint64_t _sio_dgram_rpc_cur_time_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void _sio_dgram_rpc_client_callback(struct sio *sio, struct sio_dgram *sdgram,
+        struct sockaddr_in *addr, char *data, uint64_t size, void *arg);
+
+struct sio_dgram_rpc_client *sio_dgram_rpc_client_new(struct sio_rpc *rpc)
+{
+    struct sio_dgram *sdgram = sio_dgram_open(rpc->sio, "0.0.0.0", 0, _sio_dgram_rpc_client_callback, NULL);
+    if (!sdgram)
+        return NULL;
+    if (sio_dgram_set_buffer(rpc->sio, sdgram, SIO_DGRAM_GRO_BUFFER_SIZE, 0) == -1) {
+        sio_dgram_close(rpc->sio, sdgram);
+        return NULL;
+    }
+
+    struct sio_dgram_rpc_client *client = malloc(sizeof(*client));
+    client->rpc = rpc;
+    client->sdgram = sdgram;
+    client->rr_upstream = 0;
+    client->upstream_count = 0;
+    client->upstreams = NULL;
+    /* 服务端按(来源地址, 请求ID)去重, 以启动时间作为ID起点, 避免进程重启复用端口后与旧请求冲突 */
+    client->req_id = _sio_dgram_rpc_cur_time_ms() << 20;
+    client->req_status = shash_new();
+    sio_dgram_set(rpc->sio, sdgram, _sio_dgram_rpc_client_callback, client);
+    return client;
+}
+
+static void _sio_dgram_rpc_free_call(struct sio_dgram_rpc_request *req)
+{
+    free(req->packet);
+    free(req);
+}
+
+void sio_dgram_rpc_client_free(struct sio_dgram_rpc_client *client)
+{
+    shash_begin_iterate(client->req_status);
+    void *value;
+    while (shash_iterate(client->req_status, NULL, NULL, &value) != -1) {
+        struct sio_dgram_rpc_request *req = value;
+        sio_stop_timer(client->rpc->sio, &req->timer);
+        assert(shash_erase(client->req_status, (const char *)&req->id, sizeof(req->id)) == 0);
+        /* XXX: 回调用户, 通知请求超时, 用户必须保证不再发起更多的call, 否则死循环. */
+        req->cb(client, 1, NULL, 0, req->arg);
+        _sio_dgram_rpc_free_call(req);
+    }
+    shash_end_iterate(client->req_status);
+
+    shash_free(client->req_status);
+    sio_dgram_close(client->rpc->sio, client->sdgram);
+    free(client->upstreams);
+    free(client);
+}
+
+void sio_dgram_rpc_add_upstream(struct sio_dgram_rpc_client *client, const char *ip, uint16_t port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip);
+
+    uint32_t i;
+    for (i = 0; i < client->upstream_count; ++i) {
+        if (client->upstreams[i].sin_addr.s_addr == addr.sin_addr.s_addr && client->upstreams[i].sin_port == addr.sin_port)
+            return;
+    }
+    client->upstreams = realloc(client->upstreams, (client->upstream_count + 1) * sizeof(*client->upstreams));
+    client->upstreams[client->upstream_count++] = addr;
+}
+
+void sio_dgram_rpc_remove_upstream(struct sio_dgram_rpc_client *client, const char *ip, uint16_t port)
+{
+    in_addr_t s_addr = inet_addr(ip);
+    uint16_t n_port = htons(port);
+
+    uint32_t i;
+    for (i = 0; i < client->upstream_count; ++i) {
+        if (client->upstreams[i].sin_addr.s_addr == s_addr && client->upstreams[i].sin_port == n_port) {
+            memmove(client->upstreams + i, client->upstreams + i + 1, (client->upstream_count - i - 1) * sizeof(*client->upstreams));
+            --client->upstream_count;
+            return;
+        }
+    }
+}
+
+/* 轮转发送到下一个上游, 无可用上游或发送失败则等待超时重试 */
+static void _sio_dgram_rpc_send(struct sio_dgram_rpc_client *client, struct sio_dgram_rpc_request *req)
+{
+    if (!client->upstream_count)
+        return;
+    struct sockaddr_in *addr = &client->upstreams[client->rr_upstream++ % client->upstream_count];
+    sio_dgram_response(client->rpc->sio, client->sdgram, addr, req->packet, req->packet_len);
+}
+
+/* rpc call 超时 */
+static void _sio_dgram_rpc_call_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_dgram_rpc_request *req = arg;
+    struct sio_dgram_rpc_client *client = req->client;
+
+    /* call超过重试限制, 回调用户 */
+    if (req->retry_count++ >= req->retry_times) {
+        assert(shash_erase(client->req_status, (const char *)&req->id, sizeof(req->id)) == 0);
+        req->cb(client, 1, NULL, 0, req->arg);
+        _sio_dgram_rpc_free_call(req);
+    } else { /* 以相同的请求ID重发, 服务端据此去重 */
+        sio_start_timer(sio, &req->timer, req->timeout, _sio_dgram_rpc_call_timer, req);
+        _sio_dgram_rpc_send(client, req);
+    }
+}
+
+/* 发起远程调用, 消息类型type, 请求超时timeout_ms, 重试次数retry_times, 请求request, 请求长度size, 结果回调cb, 回调参数arg */
+void sio_dgram_rpc_call(struct sio_dgram_rpc_client *client, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_dgram_rpc_callback_t cb, void *arg)
+{
+    struct sio_dgram_rpc_request *req = malloc(sizeof(*req));
+    req->id = client->req_id++;
+    req->type = type;
+    req->timeout = timeout_ms;
+    req->retry_times = retry_times;
+    req->retry_count = 0;
+    req->client = client;
+    req->cb = cb;
+    req->arg = arg;
+    req->packet = NULL;
+    req->packet_len = 0;
+    assert(shash_insert(client->req_status, (const char *)&req->id, sizeof(req->id), req) == 0);
+
+    if (size > SIO_DGRAM_RPC_MAX_BODY) { /* 无法放进一个datagram, 立即以超时回调 */
+        req->retry_times = 0;
+        sio_start_timer(client->rpc->sio, &req->timer, 0, _sio_dgram_rpc_call_timer, req);
+        return;
+    }
+
+    struct shead shead;
+    shead.id = req->id;
+    shead.type = type;
+    shead.reserved = 0;
+    shead.body_len = size;
+
+    req->packet_len = SHEAD_ENCODE_SIZE + size;
+    req->packet = malloc(req->packet_len);
+    assert(shead_encode(&shead, req->packet, SHEAD_ENCODE_SIZE) == 0);
+    if (size)
+        memcpy(req->packet + SHEAD_ENCODE_SIZE, request, size);
+
+    sio_start_timer(client->rpc->sio, &req->timer, timeout_ms, _sio_dgram_rpc_call_timer, req);
+    _sio_dgram_rpc_send(client, req);
+}
+
+static void _sio_dgram_rpc_client_callback(struct sio *sio, struct sio_dgram *sdgram,
+        struct sockaddr_in *addr, char *data, uint64_t size, void *arg)
+{
+    struct sio_dgram_rpc_client *client = arg;
+
+    struct shead head;
+    if (size < SHEAD_ENCODE_SIZE || shead_decode(&head, data, SHEAD_ENCODE_SIZE) == -1)
+        return; /* header不合法 */
+    if (head.body_len != size - SHEAD_ENCODE_SIZE)
+        return; /* body不完整 */
+
+    /* 重复的应答(请求已完成)或者过期的应答直接丢弃 */
+    void *value;
+    if (shash_find(client->req_status, (const char *)&head.id, sizeof(head.id), &value) == -1)
+        return;
+    struct sio_dgram_rpc_request *req = value;
+    if (req->type != head.type)
+        return;
+
+    sio_stop_timer(sio, &req->timer);
+    assert(shash_erase(client->req_status, (const char *)&req->id, sizeof(req->id)) == 0);
+    if (head.reserved & SIO_DGRAM_RPC_FRAME_ERROR) /* 服务端无法应答, 立即以失败回调 */
+        req->cb(client, 1, NULL, 0, req->arg);
+    else
+        req->cb(client, 0, data + SHEAD_ENCODE_SIZE, head.body_len, req->arg);
+    _sio_dgram_rpc_free_call(req);
+}
+
+/* 去重记录的key: 来源ip + 来源port + 请求ID */
+static void _sio_dgram_rpc_dedup_key(char *key, const struct sockaddr_in *source, uint64_t id)
+{
+    memcpy(key, &source->sin_addr.s_addr, 4);
+    memcpy(key + 4, &source->sin_port, 2);
+    memcpy(key + 6, &id, 8);
+}
+
+static void _sio_dgram_rpc_dedup_free(struct sio_dgram_rpc_dedup *dedup)
+{
+    free(dedup->packet);
+    free(dedup);
+}
+
+/* 去重记录按加入顺序过期, 从队头清理 */
+static void _sio_dgram_rpc_dedup_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_dgram_rpc_server *server = arg;
+
+    sio_start_timer(sio, &server->timer, SIO_DGRAM_RPC_SWEEP_INTERVAL, _sio_dgram_rpc_dedup_timer, server);
+
+    uint64_t now = _sio_dgram_rpc_cur_time_ms();
+    void *value;
+    while (sdeque_front(server->dedup_queue, &value) == 0) {
+        struct sio_dgram_rpc_dedup *dedup = value;
+        if (dedup->expire > now)
+            break;
+        sdeque_pop_front(server->dedup_queue);
+        assert(shash_erase(server->dedup, dedup->key, sizeof(dedup->key)) == 0);
+        _sio_dgram_rpc_dedup_free(dedup);
+    }
+}
+
+/* 返回0表示需要处理请求, -1表示重复的请求(已回放缓存的应答或仍在处理中) */
+static int _sio_dgram_rpc_dedup_check(struct sio_dgram_rpc_server *server, struct sockaddr_in *source, uint64_t id)
+{
+    if (!server->dedup_ms)
+        return 0;
+
+    char key[sizeof(((struct sio_dgram_rpc_dedup *)0)->key)];
+    _sio_dgram_rpc_dedup_key(key, source, id);
+
+    void *value;
+    if (shash_find(server->dedup, key, sizeof(key), &value) == 0) {
+        struct sio_dgram_rpc_dedup *dedup = value;
+        if (dedup->packet)
+            sio_dgram_response(server->rpc->sio, server->sdgram, source, dedup->packet, dedup->packet_len);
+        return -1;
+    }
+
+    struct sio_dgram_rpc_dedup *dedup = malloc(sizeof(*dedup));
+    memcpy(dedup->key, key, sizeof(key));
+    dedup->expire = _sio_dgram_rpc_cur_time_ms() + server->dedup_ms;
+    dedup->packet = NULL;
+    dedup->packet_len = 0;
+    assert(shash_insert(server->dedup, dedup->key, sizeof(dedup->key), dedup) == 0);
+    sdeque_push_back(server->dedup_queue, dedup);
+    return 0;
+}
+
+static void _sio_dgram_rpc_server_callback(struct sio *sio, struct sio_dgram *sdgram,
+        struct sockaddr_in *addr, char *data, uint64_t size, void *arg)
+{
+    struct sio_dgram_rpc_server *server = arg;
+
+    struct shead head;
+    if (size < SHEAD_ENCODE_SIZE || shead_decode(&head, data, SHEAD_ENCODE_SIZE) == -1)
+        return; /* header不合法 */
+    if (head.body_len != size - SHEAD_ENCODE_SIZE)
+        return; /* body不完整 */
+
+    void *value;
+    if (shash_find(server->methods, (const char *)&head.type, sizeof(head.type), &value) == -1)
+        return;
+    struct sio_dgram_rpc_method *method = value;
+
+    if (_sio_dgram_rpc_dedup_check(server, addr, head.id) == -1)
+        return;
+
+    struct sio_dgram_rpc_response *resp = malloc(sizeof(*resp));
+    resp->server = server;
+    memcpy(&resp->source, addr, sizeof(*addr));
+    memcpy(&resp->req_head, &head, sizeof(head));
+    /* 优先取走接收槽位避免拷贝请求 */
+    resp->buffer = sio_dgram_take(sdgram, data);
+    resp->is_taken = resp->buffer != NULL;
+    if (!resp->is_taken) {
+        resp->buffer = malloc(size);
+        memcpy(resp->buffer, data, size);
+    }
+
+    method->cb(server, resp, method->arg);
+}
+
+struct sio_dgram_rpc_server *sio_dgram_rpc_server_new(struct sio_rpc *rpc, const char *ip, uint16_t port, uint64_t dedup_ms)
+{
+    struct sio_dgram *sdgram = sio_dgram_open(rpc->sio, ip, port, _sio_dgram_rpc_server_callback, NULL);
+    if (!sdgram)
+        return NULL;
+    if (sio_dgram_set_buffer(rpc->sio, sdgram, SIO_DGRAM_GRO_BUFFER_SIZE, 16) == -1) {
+        sio_dgram_close(rpc->sio, sdgram);
+        return NULL;
+    }
+
+    struct sio_dgram_rpc_server *server = malloc(sizeof(*server));
+    server->rpc = rpc;
+    server->sdgram = sdgram;
+    server->dedup_ms = dedup_ms;
+    server->dedup = shash_new();
+    server->dedup_queue = sdeque_new();
+    server->methods = shash_new();
+    sio_dgram_set(rpc->sio, sdgram, _sio_dgram_rpc_server_callback, server);
+    sio_start_timer(rpc->sio, &server->timer, SIO_DGRAM_RPC_SWEEP_INTERVAL, _sio_dgram_rpc_dedup_timer, server);
+    return server;
+}
+
+void sio_dgram_rpc_server_free(struct sio_dgram_rpc_server *server)
+{
+    const char *key;
+    void *value;
+
+    shash_begin_iterate(server->methods);
+    while (shash_iterate(server->methods, &key, NULL, &value) != -1) {
+        struct sio_dgram_rpc_method *method = value;
+        free(method);
+    }
+    shash_end_iterate(server->methods);
+
+    while (sdeque_front(server->dedup_queue, &value) == 0) {
+        sdeque_pop_front(server->dedup_queue);
+        _sio_dgram_rpc_dedup_free(value);
+    }
+
+    sio_stop_timer(server->rpc->sio, &server->timer);
+    shash_free(server->methods);
+    shash_free(server->dedup);
+    sdeque_free(server->dedup_queue);
+    sio_dgram_close(server->rpc->sio, server->sdgram);
+    free(server);
+}
+
+void sio_dgram_rpc_server_add_method(struct sio_dgram_rpc_server *server, uint32_t type, sio_dgram_rpc_method_t cb, void *arg)
+{
+    if (shash_find(server->methods, (const char *)&type, sizeof(type), NULL) == 0)
+        return;
+
+    struct sio_dgram_rpc_method *method = malloc(sizeof(*method));
+    method->cb = cb;
+    method->arg = arg;
+    assert(shash_insert(server->methods, (const char *)&type, sizeof(type), method) == 0);
+}
+
+void sio_dgram_rpc_server_remove_method(struct sio_dgram_rpc_server *server, uint32_t type)
+{
+    void *value;
+    if (shash_find(server->methods, (const char *)&type, sizeof(type), &value) == -1)
+        return;
+    assert(shash_erase(server->methods, (const char *)&type, sizeof(type)) == 0);
+    free(value);
+}
+
+int sio_dgram_rpc_finish(struct sio_dgram_rpc_response *resp, const char *body, uint32_t len)
+{
+    struct sio_dgram_rpc_server *server = resp->server;
+
+    /* 应答放不进一个datagram, 改为回复空的失败应答, 客户端立即失败而不是等待超时 */
+    int ret = 0;
+    struct shead resp_head;
+    memcpy(&resp_head, &resp->req_head, sizeof(resp_head));
+    if (len > SIO_DGRAM_RPC_MAX_BODY) {
+        resp_head.reserved |= SIO_DGRAM_RPC_FRAME_ERROR;
+        len = 0;
+        ret = -1;
+    }
+    resp_head.body_len = len;
+
+    uint32_t packet_len = SHEAD_ENCODE_SIZE + len;
+    char *packet = malloc(packet_len);
+    assert(shead_encode(&resp_head, packet, SHEAD_ENCODE_SIZE) == 0);
+    if (len)
+        memcpy(packet + SHEAD_ENCODE_SIZE, body, len);
+    sio_dgram_response(server->rpc->sio, server->sdgram, &resp->source, packet, packet_len);
+
+    /* 缓存应答, 重发的请求直接回放; 去重记录已过期则丢弃 */
+    char key[sizeof(((struct sio_dgram_rpc_dedup *)0)->key)];
+    _sio_dgram_rpc_dedup_key(key, &resp->source, resp->req_head.id);
+    void *value;
+    if (server->dedup_ms && shash_find(server->dedup, key, sizeof(key), &value) == 0 && !((struct sio_dgram_rpc_dedup *)value)->packet) {
+        struct sio_dgram_rpc_dedup *dedup = value;
+        dedup->packet = packet;
+        dedup->packet_len = packet_len;
+    } else {
+        free(packet);
+    }
+
+    if (resp->is_taken)
+        sio_dgram_release(server->sdgram, resp->buffer);
+    else
+        free(resp->buffer);
+    free(resp);
+    return ret;
+}
+
+char *sio_dgram_rpc_request(struct sio_dgram_rpc_response *resp, uint32_t *len)
+{
+    if (len)
+        *len = resp->req_head.body_len;
+    return resp->buffer + SHEAD_ENCODE_SIZE;
+}
+
+/* vim: set ts=4 sw=4 sts=4 tw=100 */
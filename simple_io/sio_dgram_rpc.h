@@ -0,0 +1,252 @@
+#ifndef SIMPLE_IO_SIO_DGRAM_RPC_H
+#define SIMPLE_IO_SIO_DGRAM_RPC_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "shead.h"
+#include "sio_timer.h"
+
+/*
+ * 基于UDP的rpc, 沿用shead作为报文头, 每个datagram承载一个完整的请求或应答.
+ *
+ * 客户端为每个请求启动定时器, 超时后以相同的请求ID轮转重发到下一个上游;
+ * 服务端按(来源地址, 请求ID)缓存应答, 重发的请求直接回放缓存的应答或在处理中时丢弃,
+ * 从而在没有TCP队头阻塞的情况下得到至多一次执行的语义.
+ * 去重记录只保留dedup_ms, 之后才到达的重发请求会被再次执行, 至多一次只在dedup_ms内成立.
+ * */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shash;
+struct sdeque;
+struct sio_rpc;
+struct sio_dgram;
+struct sio_dgram_rpc_client;
+struct sio_dgram_rpc_server;
+struct sio_dgram_rpc_response;
+
+/* 一个datagram能承载的最大请求/应答体 */
+#define SIO_DGRAM_RPC_MAX_BODY (65507 - SHEAD_ENCODE_SIZE)
+
+/* shead.reserved: 服务端无法给出应答(如应答超长), 客户端收到后立即以失败回调 */
+#define SIO_DGRAM_RPC_FRAME_ERROR 0x01
+
+/* udp rpc client的应答回调, 与sio_rpc_call的回调形式相同, 超时或服务端回复失败应答时is_timeout为1 */
+typedef void (*sio_dgram_rpc_callback_t)(struct sio_dgram_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg);
+/* udp rpc server的请求回调 */
+typedef void (*sio_dgram_rpc_method_t)(struct sio_dgram_rpc_server *server, struct sio_dgram_rpc_response *resp, void *arg);
+
+/* udp rpc请求 */
+struct sio_dgram_rpc_request {
+    uint64_t id; /* 请求ID, 重发时保持不变, 服务端据此去重 */
+    uint32_t type; /* 请求的类型 */
+    char *packet; /* 编码好的header+body, 重发时复用 */
+    uint32_t packet_len; /* packet长度 */
+    uint32_t retry_count; /* 当前重试的次数 */
+    uint32_t retry_times; /* 总共重试次数限制 */
+    uint64_t timeout; /* 每次重试的超时 */
+    struct sio_timer timer; /* 请求超时定时器 */
+    struct sio_dgram_rpc_client *client; /* 请求所属客户端 */
+    sio_dgram_rpc_callback_t cb; /* 应答回调 */
+    void *arg; /* 应答回调参数 */
+};
+
+/* udp rpc客户端 */
+struct sio_dgram_rpc_client {
+    struct sio_rpc *rpc; /* rpc框架 */
+    struct sio_dgram *sdgram; /* 收发socket */
+    uint32_t rr_upstream; /* 轮转各个上游 */
+    uint32_t upstream_count; /* 上游个数 */
+    struct sockaddr_in *upstreams; /* 上游地址 */
+    uint64_t req_id; /* 自增请求ID */
+    struct shash *req_status; /* 等待应答的请求, key:请求ID */
+};
+
+/* 服务端注册的rpc方法 */
+struct sio_dgram_rpc_method {
+    sio_dgram_rpc_method_t cb; /* 本地rpc方法 */
+    void *arg; /* rpc参数 */
+};
+
+/* 服务端的应答去重记录 */
+struct sio_dgram_rpc_dedup {
+    char key[14]; /* 来源ip(4) + 来源port(2) + 请求ID(8) */
+    uint64_t expire; /* 过期时间(毫秒) */
+    char *packet; /* 已编码的应答, NULL表示请求处理中 */
+    uint32_t packet_len; /* 应答长度 */
+};
+
+/* udp rpc应答 */
+struct sio_dgram_rpc_response {
+    struct sio_dgram_rpc_server *server; /* 所属server */
+    struct sockaddr_in source; /* 请求来源 */
+    struct shead req_head; /* 请求的header */
+    char *buffer; /* 请求所在的接收缓冲(sio_dgram_take取走)或拷贝 */
+    char is_taken; /* buffer是否为sio_dgram_take取走的槽位 */
+};
+
+/* udp rpc服务端 */
+struct sio_dgram_rpc_server {
+    struct sio_rpc *rpc; /* rpc框架 */
+    struct sio_dgram *sdgram; /* 监听socket */
+    uint64_t dedup_ms; /* 应答缓存时间, 0表示不去重 */
+    struct shash *dedup; /* 去重记录, key:sio_dgram_rpc_dedup.key */
+    struct sdeque *dedup_queue; /* 按过期时间排列的去重记录 */
+    struct sio_timer timer; /* 定时清理过期的去重记录 */
+    struct shash *methods; /* 注册的rpc方法 */
+};
+
+/**
+ * @brief 创建udp rpc客户端
+ *
+ * @param [in] rpc   : struct sio_rpc*
+ * @return  struct sio_dgram_rpc_client*
+ * @retval   创建socket失败返回NULL
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:10:31
+**/
+struct sio_dgram_rpc_client *sio_dgram_rpc_client_new(struct sio_rpc *rpc);
+/**
+ * @brief 释放udp rpc客户端, 所有未完成的请求以超时回调
+ *
+ * @param [in] client   : struct sio_dgram_rpc_client*
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:11:02
+**/
+void sio_dgram_rpc_client_free(struct sio_dgram_rpc_client *client);
+/**
+ * @brief 添加一个上游
+ *
+ * @param [in] client   : struct sio_dgram_rpc_client*
+ * @param [in] ip   : const char*
+ * @param [in] port   : uint16_t
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:11:30
+**/
+void sio_dgram_rpc_add_upstream(struct sio_dgram_rpc_client *client, const char *ip, uint16_t port);
+/**
+ * @brief 移除一个上游, 已发出的请求超时后重发到其他上游
+ *
+ * @param [in] client   : struct sio_dgram_rpc_client*
+ * @param [in] ip   : const char*
+ * @param [in] port   : uint16_t
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:11:52
+**/
+void sio_dgram_rpc_remove_upstream(struct sio_dgram_rpc_client *client, const char *ip, uint16_t port);
+/**
+ * @brief 发起udp rpc调用, 超时后以相同ID重发到下一个上游
+ *
+ * @param [in] client   : struct sio_dgram_rpc_client*
+ * @param [in] type   : uint32_t 请求的类型
+ * @param [in] timeout_ms   : uint64_t 每次发送的超时, 总耗费时间最大timeout_ms * (retry_times + 1)
+ * @param [in] retry_times   : uint32_t 重发次数
+ * @param [in] request   : const char* 可以为NULL
+ * @param [in] size   : uint32_t 不超过SIO_DGRAM_RPC_MAX_BODY, 否则直接以超时回调
+ * @param [in] cb   : sio_dgram_rpc_callback_t
+ * @param [in] arg   : void*
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:12:40
+**/
+void sio_dgram_rpc_call(struct sio_dgram_rpc_client *client, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_dgram_rpc_callback_t cb, void *arg);
+/**
+ * @brief 创建udp rpc服务端
+ *
+ * @param [in] rpc   : struct sio_rpc*
+ * @param [in] ip   : const char*
+ * @param [in] port   : uint16_t
+ * @param [in] dedup_ms   : uint64_t 应答缓存时间, 应不小于客户端的timeout_ms * retry_times, 0表示不去重,
+ *                                   超过该时间到达的重发请求会被再次执行
+ * @return  struct sio_dgram_rpc_server*
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:13:25
+**/
+struct sio_dgram_rpc_server *sio_dgram_rpc_server_new(struct sio_rpc *rpc, const char *ip, uint16_t port, uint64_t dedup_ms);
+/**
+ * @brief 释放udp rpc服务端(释放前确保所有的response都finish, 否则会内存泄露)
+ *
+ * @param [in] server   : struct sio_dgram_rpc_server*
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:13:50
+**/
+void sio_dgram_rpc_server_free(struct sio_dgram_rpc_server *server);
+/**
+ * @brief 注册一个RPC方法
+ *
+ * @param [in] server   : struct sio_dgram_rpc_server*
+ * @param [in] type   : uint32_t
+ * @param [in] cb   : sio_dgram_rpc_method_t
+ * @param [in] arg   : void*
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:14:12
+**/
+void sio_dgram_rpc_server_add_method(struct sio_dgram_rpc_server *server, uint32_t type, sio_dgram_rpc_method_t cb, void *arg);
+/**
+ * @brief 取消一个RPC方法(不要在回调中执行)
+ *
+ * @param [in] server   : struct sio_dgram_rpc_server*
+ * @param [in] type   : uint32_t
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:14:30
+**/
+void sio_dgram_rpc_server_remove_method(struct sio_dgram_rpc_server *server, uint32_t type);
+/**
+ * @brief 结束一个RPC调用, 返回应答并缓存用于去重, resp在调用后失效
+ *
+ * @param [in] resp   : struct sio_dgram_rpc_response*
+ * @param [in] body   : const char* 可以为NULL
+ * @param [in] len   : uint32_t 不超过SIO_DGRAM_RPC_MAX_BODY, 否则回复失败应答, 客户端立即以失败回调
+ * @return  int
+ * @retval   应答超长返回-1, 成功返回0
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:15:02
+**/
+int sio_dgram_rpc_finish(struct sio_dgram_rpc_response *resp, const char *body, uint32_t len);
+/**
+ * @brief 从sio_dgram_rpc_response中取出请求和长度
+ *
+ * @param [in] resp   : struct sio_dgram_rpc_response*
+ * @param [in] len   : uint32_t* 可以为NULL
+ * @return  char*
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/09/24 14:15:24
+**/
+char *sio_dgram_rpc_request(struct sio_dgram_rpc_response *resp, uint32_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  //SIMPLE_IO_SIO_DGRAM_RPC_H
+
+/* vim: set ts=4 sw=4 sts=4 tw=100 */
@@ -20,419 +20,2310 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
 #include "shash.h"
 #include "sio.h"
 #include "sio_stream.h"
 #include "sio_rpc.h"
 
 static void _sio_rpc_free_call(struct sio_rpc_request *req);
-static void _sio_rpc_reset_upstream(struct sio_rpc_upstream *upstream);
+static void _sio_rpc_reset_conn(struct sio_rpc_conn *conn);
+static void _sio_rpc_close_conn(struct sio_rpc_conn *conn);
 static void _sio_rpc_remove_upstream(struct sio_rpc_client *client, struct sio_rpc_upstream *upstream);
+static void _sio_rpc_rebuild_balance(struct sio_rpc_client *client);
+static void _sio_rpc_dstream_free(struct sio_rpc_dstream *dstream);
+static void _sio_rpc_call_overloaded(struct sio *sio, struct sio_rpc_request *req, struct sio_rpc_upstream *upstream);
+
+static uint64_t _sio_rpc_cur_time_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
 struct sio_rpc *sio_rpc_new(struct sio *sio, uint64_t max_pending)
 {
     struct sio_rpc *rpc = malloc(sizeof(*rpc));
     rpc->sio = sio;
     rpc->max_pending = max_pending;
+    rpc->conn_timeout = 0;
+    sio_sockopt_profile_init(&rpc->profile);
+    memset(rpc->codecs, 0, sizeof(rpc->codecs));
+    rpc->dicts = NULL;
     return rpc;
 }
 
 void sio_rpc_free(struct sio_rpc *rpc)
 {
+    if (rpc->dicts) {
+        void *value;
+        shash_begin_iterate(rpc->dicts);
+        while (shash_iterate(rpc->dicts, NULL, NULL, &value) != -1) {
+            struct sio_rpc_dict *dict = value;
+            free(dict->data);
+            free(dict);
+        }
+        shash_end_iterate(rpc->dicts);
+        shash_free(rpc->dicts);
+    }
     free(rpc);
 }
 
+void sio_rpc_set_connect_timeout(struct sio_rpc *rpc, uint64_t timeout_ms)
+{
+    rpc->conn_timeout = timeout_ms;
+}
+
+void sio_rpc_set_sockopt(struct sio_rpc *rpc, const struct sio_sockopt_profile *profile)
+{
+    rpc->profile = *profile;
+}
+
+int sio_rpc_add_codec(struct sio_rpc *rpc, uint32_t codec, sio_rpc_compress_t compress, sio_rpc_decompress_t decompress, void *arg)
+{
+    if (!codec || codec > SIO_RPC_CODEC_MAX || !compress || !decompress)
+        return -1;
+    rpc->codecs[codec].compress = compress;
+    rpc->codecs[codec].decompress = decompress;
+    rpc->codecs[codec].arg = arg;
+    return 0;
+}
+
+void sio_rpc_set_dictionary(struct sio_rpc *rpc, uint32_t type, const char *dict, uint32_t len)
+{
+    void *value;
+    if (rpc->dicts && shash_find(rpc->dicts, (const char *)&type, sizeof(type), &value) == 0) {
+        struct sio_rpc_dict *old = value;
+        assert(shash_erase(rpc->dicts, (const char *)&type, sizeof(type)) == 0);
+        free(old->data);
+        free(old);
+    }
+    if (!dict)
+        return;
+    struct sio_rpc_dict *entry = malloc(sizeof(*entry));
+    entry->data = malloc(len ? len : 1);
+    memcpy(entry->data, dict, len);
+    entry->len = len;
+    if (!rpc->dicts)
+        rpc->dicts = shash_new();
+    assert(shash_insert(rpc->dicts, (const char *)&type, sizeof(type), entry) == 0);
+}
+
+/* 只在sio_run线程中查找, 工作线程使用入队时取出的字典 */
+static const struct sio_rpc_dict *_sio_rpc_find_dict(struct sio_rpc *rpc, uint32_t type)
+{
+    void *value;
+    if (!rpc->dicts || shash_find(rpc->dicts, (const char *)&type, sizeof(type), &value) == -1)
+        return NULL;
+    return value;
+}
+
+/* 压缩body, 返回以原始长度开头的新缓冲区; 压缩失败或没有变小返回NULL, 调用者原样发送 */
+static char *_sio_rpc_compress(const struct sio_rpc_codec *codec, const struct sio_rpc_dict *dict,
+        const char *body, uint32_t len, uint32_t *out_len)
+{
+    if (len <= sizeof(uint32_t))
+        return NULL;
+    char *out = malloc(len);
+    int64_t bytes = codec->compress(body, len, out + sizeof(uint32_t), len - sizeof(uint32_t),
+            dict ? dict->data : NULL, dict ? dict->len : 0, codec->arg);
+    if (bytes < 0 || bytes >= len - sizeof(uint32_t)) {
+        free(out);
+        return NULL;
+    }
+    uint32_t raw_len = htonl(len);
+    memcpy(out, &raw_len, sizeof(raw_len));
+    *out_len = sizeof(uint32_t) + bytes;
+    return out;
+}
+
+/* 按head中的压缩方式解压body, 成功返回新缓冲区并把head->body_len改为原始长度;
+ * 压缩方式未注册, 原始长度超过max_pending或数据不合法返回NULL */
+static char *_sio_rpc_decompress(struct sio_rpc *rpc, struct shead *head, const char *body)
+{
+    const struct sio_rpc_codec *codec = &rpc->codecs[(head->reserved >> SIO_RPC_CODEC_SHIFT) & SIO_RPC_CODEC_MASK];
+    if (!codec->decompress || head->body_len < sizeof(uint32_t))
+        return NULL;
+    uint32_t raw_len;
+    memcpy(&raw_len, body, sizeof(raw_len));
+    raw_len = ntohl(raw_len);
+    if (raw_len > rpc->max_pending)
+        return NULL;
+    const struct sio_rpc_dict *dict = _sio_rpc_find_dict(rpc, head->type);
+    char *out = malloc(raw_len ? raw_len : 1);
+    if (codec->decompress(body + sizeof(uint32_t), head->body_len - sizeof(uint32_t), out, raw_len,
+                dict ? dict->data : NULL, dict ? dict->len : 0, codec->arg) == -1) {
+        free(out);
+        return NULL;
+    }
+    head->body_len = raw_len;
+    return out;
+}
+
 struct sio_rpc_client *sio_rpc_client_new(struct sio_rpc *rpc)
 {
     struct sio_rpc_client *client = malloc(sizeof(*client));
     client->rpc = rpc;
     client->rr_stream = 0;
+    client->balance = SIO_RPC_BALANCE_LEAST_PENDING;
+    client->rand_seed = (unsigned int)_sio_rpc_cur_time_us();
+    client->wrr_len = 0;
+    client->wrr_schedule = NULL;
+    client->vnode_count = 0;
+    client->hash_ring = NULL;
+    client->hedge_percentile = 0;
+    client->hedge_budget = 0;
+    client->hedge_min_delay = 0;
+    client->hedge_delay = 0;
+    client->hedge_tokens = 0;
+    client->lat_total = 0;
+    memset(client->lat_hist, 0, sizeof(client->lat_hist));
+    client->breaker_percent = 0;
+    client->breaker_min_requests = 0;
+    client->breaker_consecutive = 0;
+    client->breaker_eject = 0;
+    client->conn_per_upstream = 1;
+    client->coalesce = 0;
+    client->send_cancel = 0;
+    client->codec = 0;
+    client->compress_min = 0;
+    client->compact = 0;
+    client->flush_on = 0;
     client->upstream_count = 0;
     client->upstreams = NULL;
-    assert(client->req_record = shash_new()); /* 所有运行中的rpc request地址都记录, 以便client_free时回收  */
+    /* 所有运行中的rpc request都记录, 以便client_free时回收 */
+    client->req_seq = 0;
+    client->ring_mask = SIO_RPC_REQUEST_SLAB - 1;
+    client->req_ring = calloc(client->ring_mask + 1, sizeof(*client->req_ring));
+    client->free_reqs = NULL;
+    client->slab_count = 0;
+    client->slabs = NULL;
     return client;
 }
 
 void sio_rpc_client_free(struct sio_rpc_client *client)
 {
+    if (client->flush_on) /* 未发送的合并请求随连接关闭丢弃, 下面以超时回调 */
+        sio_stop_timer(client->rpc->sio, &client->flush_timer);
+
     int i;
     for (i = 0; i < client->upstream_count; ++i)
         _sio_rpc_remove_upstream(client, client->upstreams[i]);
 
-    shash_begin_iterate(client->req_record);
-    const char *key;
-    while (shash_iterate(client->req_record, &key, NULL, NULL) != -1) {
-        struct sio_rpc_request *req = *(struct sio_rpc_request * const*)key;
+    uint64_t r;
+    for (r = 0; r <= client->ring_mask; ++r) {
+        struct sio_rpc_request *req = client->req_ring[r];
+        if (!req)
+            continue;
         sio_stop_timer(client->rpc->sio, &req->timer);
         /* XXX: 回调用户, 通知请求超时, 用户必须保证不再发起更多的call, 否则死循环. */
-        req->cb(client, 1, NULL, 0, req->arg);
+        req->cb(client, SIO_RPC_CALL_TIMEOUT, NULL, 0, req->arg);
         _sio_rpc_free_call(req);
     }
-    shash_end_iterate(client->req_record);
 
-    shash_free(client->req_record);
+    for (i = 0; i < client->slab_count; ++i)
+        free(client->slabs[i]);
+    free(client->slabs);
+    free(client->req_ring);
+    free(client->wrr_schedule);
+    free(client->hash_ring);
     free(client->upstreams);
     free(client);
 }
 
-static int _sio_rpc_upstream_parse_response(struct sio *sio, struct sio_rpc_upstream *upstream)
+/* 以id & slot_mask为下标记录请求, 下标被仍在等待应答的请求占用则扩容 */
+static void _sio_rpc_slot_insert(struct sio_rpc_conn *conn, uint64_t id, struct sio_rpc_request *req)
+{
+    while (conn->slots[id & conn->slot_mask].req) {
+        /* 原来id & mask互不相同的请求, 在新的mask下依然互不相同 */
+        uint64_t mask = conn->slot_mask * 2 + 1;
+        struct sio_rpc_slot *slots = calloc(mask + 1, sizeof(*slots));
+        uint64_t i;
+        for (i = 0; i <= conn->slot_mask; ++i) {
+            if (conn->slots[i].req)
+                slots[conn->slots[i].id & mask] = conn->slots[i];
+        }
+        free(conn->slots);
+        conn->slots = slots;
+        conn->slot_mask = mask;
+    }
+    struct sio_rpc_slot *slot = &conn->slots[id & conn->slot_mask];
+    slot->id = id;
+    slot->req = req;
+    ++conn->pending;
+    ++conn->upstream->pending;
+}
+
+/* 取出并清空id对应的槽位, 槽位空闲或已被其他请求占用返回NULL */
+static struct sio_rpc_request *_sio_rpc_slot_remove(struct sio_rpc_conn *conn, uint64_t id)
+{
+    struct sio_rpc_slot *slot = &conn->slots[id & conn->slot_mask];
+    if (!slot->req || slot->id != id)
+        return NULL;
+    struct sio_rpc_request *req = slot->req;
+    slot->req = NULL;
+    --conn->pending;
+    --conn->upstream->pending;
+    return req;
+}
+
+/* 以1/8的权重把一次延迟采样计入upstream的EWMA */
+static void _sio_rpc_upstream_latency(struct sio_rpc_upstream *upstream, uint64_t sample_us)
+{
+    if (!sample_us)
+        sample_us = 1; /* ewma_us为0表示还没有采样 */
+    if (!upstream->ewma_us)
+        upstream->ewma_us = sample_us;
+    else if (sample_us > upstream->ewma_us)
+        upstream->ewma_us += (sample_us - upstream->ewma_us) >> 3;
+    else
+        upstream->ewma_us -= (upstream->ewma_us - sample_us) >> 3;
+}
+
+static uint32_t _sio_rpc_latency_bucket(uint64_t us)
+{
+    if (us < 4)
+        return us;
+    uint32_t msb = 63 - __builtin_clzll(us);
+    return msb * 4 + ((us >> (msb - 2)) & 3);
+}
+
+static uint64_t _sio_rpc_latency_bucket_upper(uint32_t bucket)
+{
+    if (bucket < 4)
+        return bucket;
+    uint32_t msb = bucket / 4;
+    return ((uint64_t)(4 + bucket % 4 + 1) << (msb - 2)) - 1;
+}
+
+/* 记录一次应答延迟, 每128个样本重新计算对冲延迟, 样本过多时减半以跟随最近的延迟 */
+static void _sio_rpc_client_latency(struct sio_rpc_client *client, uint64_t sample_us)
+{
+    if (!client->hedge_percentile)
+        return;
+    ++client->lat_hist[_sio_rpc_latency_bucket(sample_us)];
+    if (++client->lat_total % 128)
+        return;
+
+    uint32_t i;
+    if (client->lat_total >= 8192) {
+        client->lat_total = 0;
+        for (i = 0; i < SIO_RPC_LATENCY_BUCKETS; ++i) {
+            client->lat_hist[i] /= 2;
+            client->lat_total += client->lat_hist[i];
+        }
+    }
+    uint64_t target = client->lat_total * client->hedge_percentile / 100, count = 0;
+    for (i = 0; i < SIO_RPC_LATENCY_BUCKETS; ++i) {
+        count += client->lat_hist[i];
+        if (count > target)
+            break;
+    }
+    uint64_t delay = (_sio_rpc_latency_bucket_upper(i) + 999) / 1000;
+    client->hedge_delay = delay > client->hedge_min_delay ? delay : client->hedge_min_delay;
+    if (!client->hedge_delay)
+        client->hedge_delay = 1;
+}
+
+void sio_rpc_client_set_hedge(struct sio_rpc_client *client, uint32_t percentile, uint64_t min_delay_ms, uint32_t budget_percent)
+{
+    client->hedge_percentile = percentile > 99 ? 99 : percentile;
+    client->hedge_min_delay = min_delay_ms;
+    client->hedge_budget = budget_percent > 100 ? 100 : budget_percent;
+    client->hedge_delay = 0;
+    client->hedge_tokens = 0;
+    client->lat_total = 0;
+    memset(client->lat_hist, 0, sizeof(client->lat_hist));
+}
+
+void sio_rpc_client_set_breaker(struct sio_rpc_client *client, uint32_t failure_percent, uint32_t min_requests,
+        uint32_t consecutive_failures, uint32_t eject_seconds)
+{
+    client->breaker_percent = failure_percent > 100 ? 100 : failure_percent;
+    client->breaker_min_requests = min_requests;
+    client->breaker_consecutive = consecutive_failures;
+    client->breaker_eject = eject_seconds;
+
+    uint32_t i;
+    for (i = 0; i < client->upstream_count; ++i) {
+        struct sio_rpc_upstream *upstream = client->upstreams[i];
+        upstream->breaker = SIO_RPC_BREAKER_CLOSED;
+        upstream->probe_inflight = 0;
+        upstream->win_requests = upstream->win_failures = upstream->consecutive_failures = 0;
+        upstream->eject_count = 0;
+        upstream->win_start = time(NULL);
+    }
+}
+
+void sio_rpc_client_set_connections(struct sio_rpc_client *client, uint32_t count)
+{
+    if (count < 1)
+        count = 1;
+    else if (count > SIO_RPC_MAX_CONNECTIONS)
+        count = SIO_RPC_MAX_CONNECTIONS;
+    client->conn_per_upstream = count;
+}
+
+/* 以一次write发出连接上合并的请求 */
+static void _sio_rpc_flush_conn(struct sio_rpc_conn *conn)
+{
+    uint64_t size;
+    char *data = sio_buffer_data(conn->batch, &size);
+    if (!size)
+        return;
+    int ret = sio_stream_write(conn->upstream->client->rpc->sio, conn->stream, data, size);
+    sio_buffer_erase(conn->batch, size);
+    if (ret == -1) /* 发送失败, 重置连接, 请求等待超时 */
+        _sio_rpc_reset_conn(conn);
+}
+
+static void _sio_rpc_flush(struct sio_rpc_client *client)
+{
+    uint32_t i, j;
+    for (i = 0; i < client->upstream_count; ++i) {
+        struct sio_rpc_upstream *upstream = client->upstreams[i];
+        for (j = 0; j < upstream->conn_count; ++j) {
+            if (upstream->conns[j].batch)
+                _sio_rpc_flush_conn(&upstream->conns[j]);
+        }
+    }
+}
+
+static void _sio_rpc_flush_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_rpc_client *client = arg;
+    client->flush_on = 0;
+    _sio_rpc_flush(client);
+}
+
+void sio_rpc_client_set_cancel(struct sio_rpc_client *client, int enable)
+{
+    client->send_cancel = enable ? 1 : 0;
+}
+
+void sio_rpc_client_set_compact(struct sio_rpc_client *client, int enable)
+{
+    client->compact = enable ? 1 : 0;
+}
+
+int sio_rpc_client_set_compress(struct sio_rpc_client *client, uint32_t codec, uint32_t min_bytes)
+{
+    /* 没有注册的方式不能声明, 否则服务端压缩的应答客户端无法解压 */
+    if (codec > SIO_RPC_CODEC_MAX || (codec && !client->rpc->codecs[codec].decompress))
+        return -1;
+    client->codec = codec;
+    client->compress_min = min_bytes;
+    return 0;
+}
+
+void sio_rpc_client_set_coalesce(struct sio_rpc_client *client, int enable)
+{
+    client->coalesce = enable ? 1 : 0;
+    if (!client->coalesce && client->flush_on) {
+        sio_stop_timer(client->rpc->sio, &client->flush_timer);
+        client->flush_on = 0;
+        _sio_rpc_flush(client);
+    }
+}
+
+/* upstream是否可以接收新请求 */
+static int _sio_rpc_upstream_usable(struct sio_rpc_upstream *upstream)
+{
+    if (!upstream->connected)
+        return 0;
+    return upstream->breaker == SIO_RPC_BREAKER_CLOSED
+        || (upstream->breaker == SIO_RPC_BREAKER_HALF_OPEN && !upstream->probe_inflight);
+}
+
+static void _sio_rpc_breaker_open(struct sio_rpc_upstream *upstream)
+{
+    uint32_t shift = upstream->eject_count < 5 ? upstream->eject_count : 5;
+    upstream->breaker = SIO_RPC_BREAKER_OPEN;
+    upstream->probe_inflight = 0;
+    upstream->eject_until = time(NULL) + ((time_t)upstream->client->breaker_eject << shift);
+    ++upstream->eject_count;
+}
+
+static void _sio_rpc_breaker_success(struct sio_rpc_upstream *upstream)
+{
+    if (!upstream->client->breaker_eject)
+        return;
+    ++upstream->win_requests;
+    upstream->consecutive_failures = 0;
+    if (upstream->breaker == SIO_RPC_BREAKER_HALF_OPEN) { /* 探测成功, 恢复 */
+        upstream->breaker = SIO_RPC_BREAKER_CLOSED;
+        upstream->probe_inflight = 0;
+        upstream->eject_count = 0;
+        upstream->win_requests = upstream->win_failures = 0;
+        upstream->win_start = time(NULL);
+    }
+}
+
+static void _sio_rpc_breaker_failure(struct sio_rpc_upstream *upstream)
+{
+    struct sio_rpc_client *client = upstream->client;
+    if (!client->breaker_eject)
+        return;
+    ++upstream->win_requests;
+    ++upstream->win_failures;
+    ++upstream->consecutive_failures;
+    if (upstream->breaker == SIO_RPC_BREAKER_HALF_OPEN) { /* 探测失败, 再次摘除 */
+        _sio_rpc_breaker_open(upstream);
+    } else if (upstream->breaker == SIO_RPC_BREAKER_CLOSED) {
+        if ((client->breaker_consecutive && upstream->consecutive_failures >= client->breaker_consecutive)
+                || (client->breaker_percent && upstream->win_requests >= client->breaker_min_requests
+                    && upstream->win_failures * 100 >= client->breaker_percent * upstream->win_requests))
+            _sio_rpc_breaker_open(upstream);
+    }
+}
+
+/* 请求被取消(对冲失败方)时没有结论, 允许再次探测 */
+static void _sio_rpc_breaker_cancel(struct sio_rpc_upstream *upstream)
+{
+    if (upstream->breaker == SIO_RPC_BREAKER_HALF_OPEN)
+        upstream->probe_inflight = 0;
+}
+
+/* 由upstream定时器每秒调用, 滚动统计窗口, 摘除到期转为半开 */
+static void _sio_rpc_breaker_tick(struct sio_rpc_upstream *upstream)
+{
+    if (!upstream->client->breaker_eject)
+        return;
+    time_t now = time(NULL);
+    if (upstream->breaker == SIO_RPC_BREAKER_OPEN && now >= upstream->eject_until) {
+        upstream->breaker = SIO_RPC_BREAKER_HALF_OPEN;
+        upstream->probe_inflight = 0;
+    }
+    if (now - upstream->win_start >= SIO_RPC_BREAKER_WINDOW) {
+        upstream->win_requests = upstream->win_failures = 0;
+        upstream->win_start = now;
+    }
+}
+
+/* 按连接的协商状态编码header, 返回编码长度, output需要SHEAD_COMPACT_MAX_SIZE大小 */
+static uint32_t _sio_rpc_head_encode(const struct shead *shead, enum sio_rpc_compact compact, char *output)
+{
+    if (compact == SIO_RPC_COMPACT_ON)
+        return shead_encode_compact(shead, output, SHEAD_COMPACT_MAX_SIZE);
+    struct shead fixed = *shead;
+    if (compact == SIO_RPC_COMPACT_OFFER)
+        fixed.reserved |= SIO_RPC_FRAME_COMPACT;
+    assert(shead_encode(&fixed, output, SHEAD_ENCODE_SIZE) == 0);
+    return SHEAD_ENCODE_SIZE;
+}
+
+/* 直接向TCP连接写一帧 */
+static int _sio_rpc_frame_write(struct sio *sio, struct sio_stream *stream, enum sio_rpc_compact compact, uint64_t id, uint32_t type, uint32_t flags,
+        const char *data, uint32_t size)
+{
+    struct shead shead;
+    shead.id = id;
+    shead.type = type;
+    shead.reserved = flags;
+    shead.body_len = size;
+
+    char head[SHEAD_COMPACT_MAX_SIZE];
+    uint32_t head_len = _sio_rpc_head_encode(&shead, compact, head);
+
+    if (sio_stream_write(sio, stream, head, head_len) == -1)
+        return -1;
+    if (size && sio_stream_write(sio, stream, data, size) == -1)
+        return -1;
+    return 0;
+}
+
+/* 通知服务端放弃请求, 合并缓冲区非空时排在其后以保持顺序; 尽力而为, 发送失败由连接事件处理 */
+static void _sio_rpc_conn_cancel(struct sio_rpc_conn *conn, uint64_t id, uint32_t type)
+{
+    if (!conn->upstream->client->send_cancel || !conn->stream)
+        return;
+    if (conn->batch && sio_buffer_length(conn->batch)) {
+        struct shead shead;
+        shead.id = id;
+        shead.type = type;
+        shead.reserved = SIO_RPC_FRAME_CANCEL;
+        shead.body_len = 0;
+        sio_buffer_reserve(conn->batch, SHEAD_COMPACT_MAX_SIZE);
+        sio_buffer_seek(conn->batch, _sio_rpc_head_encode(&shead, conn->compact, sio_buffer_space(conn->batch, NULL)));
+        return;
+    }
+    _sio_rpc_frame_write(conn->upstream->client->rpc->sio, conn->stream, conn->compact, id, type, SIO_RPC_FRAME_CANCEL, NULL, 0);
+}
+
+/* 流从所在连接的流表中移除, 之后收不到任何帧 */
+static void _sio_rpc_stream_detach(struct sio_rpc_stream *stream)
+{
+    struct shash *streams = NULL;
+    if (stream->conn)
+        streams = stream->conn->streams;
+    else if (stream->dstream)
+        streams = stream->dstream->streams;
+    if (streams)
+        shash_erase(streams, (const char *)&stream->id, sizeof(stream->id));
+    stream->conn = NULL;
+    stream->dstream = NULL;
+}
+
+static void _sio_rpc_stream_free(struct sio_rpc_stream *stream)
+{
+    _sio_rpc_stream_detach(stream);
+    if (stream->timer_on)
+        sio_stop_timer(stream->rpc->sio, &stream->timer);
+    free(stream);
+}
+
+/* 结束一次回调或用户操作, 流已出错或关闭且没有其他回调在进行则释放, 返回-1表示流已释放 */
+static int _sio_rpc_stream_leave(struct sio_rpc_stream *stream)
+{
+    if (--stream->busy)
+        return 0;
+    if (stream->failed && !stream->closed) {
+        stream->closed = 1;
+        ++stream->busy;
+        stream->cb(stream, SIO_RPC_STREAM_ERROR, NULL, 0, stream->arg);
+        --stream->busy;
+    }
+    if (!stream->closed)
+        return 0;
+    _sio_rpc_stream_free(stream);
+    return -1;
+}
+
+/*
+ * 流表所在的连接断开, 表中所有流出错.
+ * ERROR回调中用户可能取消表中的其他流, 因此先把流全部取出并持有引用, 释放流表后再逐个回调.
+ */
+static void _sio_rpc_stream_fail_all(struct shash *streams)
+{
+    uint64_t i, count = 0;
+    struct sio_rpc_stream **list = malloc(shash_size(streams) * sizeof(*list) + 1);
+    void *value;
+    shash_begin_iterate(streams);
+    while (shash_iterate(streams, NULL, NULL, &value) != -1) {
+        struct sio_rpc_stream *stream = value;
+        stream->conn = NULL; /* 整个流表随后释放, 不再逐个移除 */
+        stream->dstream = NULL;
+        ++stream->busy;
+        list[count++] = stream;
+    }
+    shash_end_iterate(streams);
+    shash_free(streams);
+
+    for (i = 0; i < count; ++i) {
+        list[i]->failed = 1;
+        _sio_rpc_stream_leave(list[i]);
+    }
+    free(list);
+}
+
+/* 在流所在的连接上发送一帧, 发送失败则断开连接 */
+static int _sio_rpc_stream_send(struct sio_rpc_stream *stream, uint32_t flags, const char *data, uint32_t size)
+{
+    struct sio_stream *sstream = NULL;
+    enum sio_rpc_compact compact = SIO_RPC_COMPACT_OFF;
+    if (stream->conn) {
+        sstream = stream->conn->stream;
+        compact = stream->conn->compact;
+    } else if (stream->dstream) {
+        sstream = stream->dstream->stream;
+        compact = stream->dstream->compact;
+    }
+    if (!sstream)
+        return -1;
+    if (_sio_rpc_frame_write(stream->rpc->sio, sstream, compact, stream->id, stream->type, SIO_RPC_FRAME_STREAM | flags, data, size) == 0)
+        return 0;
+    if (stream->conn)
+        _sio_rpc_reset_conn(stream->conn);
+    else
+        _sio_rpc_dstream_free(stream->dstream);
+    return -1;
+}
+
+static void _sio_rpc_stream_notify(struct sio_rpc_stream *stream, enum sio_rpc_stream_event event, const char *data, uint32_t size)
+{
+    if (!stream->closed && !stream->failed)
+        stream->cb(stream, event, data, size, stream->arg);
+}
+
+static void _sio_rpc_stream_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_rpc_stream *stream = arg;
+    stream->timer_on = 0;
+    ++stream->busy;
+    if (stream->conn)
+        _sio_rpc_stream_send(stream, SIO_RPC_FRAME_CANCEL, NULL, 0);
+    _sio_rpc_stream_detach(stream);
+    stream->failed = 1;
+    _sio_rpc_stream_leave(stream);
+}
+
+/* 处理流的一个输入帧 */
+static void _sio_rpc_stream_input(struct sio_rpc_stream *stream, const struct shead *head, const char *body)
+{
+    ++stream->busy;
+    if (stream->timer_on) {
+        sio_stop_timer(stream->rpc->sio, &stream->timer);
+        sio_start_timer(stream->rpc->sio, &stream->timer, stream->timeout, _sio_rpc_stream_timer, stream);
+    }
+    if (head->reserved & SIO_RPC_FRAME_CANCEL) {
+        _sio_rpc_stream_detach(stream);
+        stream->failed = 1;
+    } else if (head->reserved & SIO_RPC_FRAME_CREDIT) {
+        uint32_t credit;
+        if (head->body_len == sizeof(credit)) {
+            memcpy(&credit, body, sizeof(credit));
+            stream->send_credit += ntohl(credit);
+            if (stream->send_blocked) {
+                stream->send_blocked = 0;
+                _sio_rpc_stream_notify(stream, SIO_RPC_STREAM_WRITABLE, NULL, 0);
+            }
+        }
+    } else if (!stream->peer_end) {
+        char is_end = (head->reserved & SIO_RPC_FRAME_END) != 0;
+        if (head->body_len) {
+            _sio_rpc_stream_notify(stream, SIO_RPC_STREAM_DATA, body, head->body_len);
+            /* 片段已被消费, 累计到半个窗口再归还对端, 对端结束后不再需要额度 */
+            stream->recv_unacked += head->body_len;
+            if (!is_end && stream->recv_unacked >= SIO_RPC_STREAM_WINDOW / 2 && !stream->closed && !stream->failed) {
+                uint32_t credit = htonl(stream->recv_unacked);
+                stream->recv_unacked = 0;
+                _sio_rpc_stream_send(stream, SIO_RPC_FRAME_CREDIT, (const char *)&credit, sizeof(credit));
+            }
+        }
+        if (is_end) {
+            stream->peer_end = 1;
+            _sio_rpc_stream_notify(stream, SIO_RPC_STREAM_END, NULL, 0);
+            if (stream->local_end)
+                stream->closed = 1;
+        }
+    }
+    _sio_rpc_stream_leave(stream);
+}
+
+int sio_rpc_stream_write(struct sio_rpc_stream *stream, const char *data, uint32_t size)
+{
+    if (stream->local_end || stream->closed || stream->failed || (!stream->conn && !stream->dstream))
+        return -1;
+    uint32_t len = size < stream->send_credit ? size : stream->send_credit;
+    if (len < size)
+        stream->send_blocked = 1;
+    if (!len)
+        return 0;
+    ++stream->busy;
+    int ret = _sio_rpc_stream_send(stream, 0, data, len);
+    if (ret == 0)
+        stream->send_credit -= len;
+    _sio_rpc_stream_leave(stream);
+    return ret == 0 ? len : -1;
+}
+
+int sio_rpc_stream_end(struct sio_rpc_stream *stream)
+{
+    if (stream->local_end || stream->closed || stream->failed || (!stream->conn && !stream->dstream))
+        return -1;
+    stream->local_end = 1;
+    ++stream->busy;
+    int ret = _sio_rpc_stream_send(stream, SIO_RPC_FRAME_END, NULL, 0);
+    if (ret == 0 && stream->peer_end) /* 双方都已结束 */
+        stream->closed = 1;
+    _sio_rpc_stream_leave(stream);
+    return ret;
+}
+
+void sio_rpc_stream_cancel(struct sio_rpc_stream *stream)
+{
+    if (stream->closed)
+        return;
+    ++stream->busy;
+    if (!stream->failed && (stream->conn || stream->dstream))
+        _sio_rpc_stream_send(stream, SIO_RPC_FRAME_CANCEL, NULL, 0);
+    _sio_rpc_stream_detach(stream);
+    stream->closed = 1;
+    _sio_rpc_stream_leave(stream);
+}
+
+static int _sio_rpc_conn_parse_response(struct sio *sio, struct sio_rpc_conn *conn)
 {
-    struct sio_stream *stream = upstream->stream;
+    struct sio_rpc_upstream *upstream = conn->upstream;
+    struct sio_stream *stream = conn->stream;
 
     struct sio_buffer *input = sio_stream_buffer(stream);
     uint64_t size;
     char *data= sio_buffer_data(input, &size);
 
+    uint64_t now = _sio_rpc_cur_time_us();
     uint64_t used = 0;
-    while (used < size) {
-        uint64_t left = size - used;
-        if (left < SHEAD_ENCODE_SIZE)
-            break; /* header不完整 */
-        struct shead head;
-        if (shead_decode(&head, data + used, SHEAD_ENCODE_SIZE) == -1)
-            return -1; /* header不合法 */
-        if (left - SHEAD_ENCODE_SIZE < head.body_len)
-            break; /* body不完整 */
-        void *value;
-        if (shash_find(upstream->req_status, (const char *)&head.id, sizeof(head.id), &value) == 0) { /* 找到call */
-            assert(shash_erase(upstream->req_status, (const char *)&head.id, sizeof(head.id)) == 0);
-            struct sio_rpc_request *req = value;
-            if (head.type == req->type) { /* call的type相同, 回调用户, 关闭超时定时器, 释放call */
-                req->cb(upstream->client, 0, data + used + SHEAD_ENCODE_SIZE, head.body_len, req->arg);
+    int err = 0;
+    struct shead_frame frames[SIO_RPC_SCAN_BATCH];
+    int count = 0, next = 0;
+    conn->parsing = 1;
+    while (conn->stream == stream) { /* 回调中连接被断开则停止解析 */
+        if (next == count) { /* 一批帧处理完, 扫描之后的完整帧 */
+            count = shead_scan(data + used, size - used, conn->compact != SIO_RPC_COMPACT_OFF, frames, SIO_RPC_SCAN_BATCH, NULL);
+            next = 0;
+            if (count == -1) {
+                err = -1; /* header不合法 */
+                break;
+            }
+            if (!count)
+                break; /* header或body不完整 */
+        }
+        struct shead head = frames[next].head;
+        uint32_t head_len = frames[next++].head_len;
+        if (conn->compact == SIO_RPC_COMPACT_OFFER && (unsigned char)data[used] == SHEAD_COMPACT_MAGIC)
+            conn->compact = SIO_RPC_COMPACT_ON; /* 服务端接受了提议, 之后以紧凑格式发送 */
+        if (head.reserved & SIO_RPC_FRAME_STREAM) { /* 流式调用的帧, 找不到流则忽略 */
+            void *value;
+            if (conn->streams && shash_find(conn->streams, (const char *)&head.id, sizeof(head.id), &value) == 0)
+                _sio_rpc_stream_input(value, &head, data + used + head_len);
+            used += head_len + head.body_len;
+            continue;
+        }
+        uint64_t frame_len = head_len + head.body_len; /* 解压会修改head.body_len */
+        const char *body = data + used + head_len;
+        char *plain = NULL;
+        struct sio_rpc_request *req = _sio_rpc_slot_remove(conn, head.id);
+        if (req) { /* 找到call */
+            char is_hedge = req->hedge_conn == conn;
+            if (head.reserved & SIO_RPC_FRAME_OVERLOADED) { /* 服务端过载而未执行, 不计入熔断, 换upstream重试 */
+                _sio_rpc_breaker_cancel(upstream);
+                if (is_hedge) {
+                    req->hedge_upstream = NULL;
+                    req->hedge_conn = NULL;
+                } else {
+                    req->upstream = NULL;
+                    req->conn = NULL;
+                }
+                _sio_rpc_call_overloaded(sio, req, upstream);
+            } else if (head.type == req->type && (!((head.reserved >> SIO_RPC_CODEC_SHIFT) & SIO_RPC_CODEC_MASK)
+                        || (plain = _sio_rpc_decompress(upstream->client->rpc, &head, body)))) {
+                /* call的type相同且应答可以解压, 回调用户, 关闭超时定时器, 释放call */
+                uint64_t start_us = is_hedge ? req->hedge_start_us : req->start_us;
+                uint64_t sample_us = now > start_us ? now - start_us : 0;
+                _sio_rpc_upstream_latency(upstream, sample_us);
+                _sio_rpc_client_latency(upstream->client, sample_us);
+                _sio_rpc_breaker_success(upstream);
+                /* 取消另一个仍在等待的副本, 它的应答到达时找不到槽位而被忽略 */
+                if (is_hedge && req->conn) {
+                    assert(_sio_rpc_slot_remove(req->conn, req->id) == req);
+                    _sio_rpc_breaker_cancel(req->upstream);
+                    _sio_rpc_conn_cancel(req->conn, req->id, req->type);
+                } else if (!is_hedge && req->hedge_conn) {
+                    assert(_sio_rpc_slot_remove(req->hedge_conn, req->hedge_id) == req);
+                    _sio_rpc_breaker_cancel(req->hedge_upstream);
+                    _sio_rpc_conn_cancel(req->hedge_conn, req->hedge_id, req->type);
+                }
+                req->cb(upstream->client, 0, plain ? plain : body, head.body_len, req->arg);
                 sio_stop_timer(sio, &req->timer);
                 _sio_rpc_free_call(req);
-            } else { /* 请求与应答的type不同, 客户端有bug才会至此, 作为超时处理 */
+            } else if (is_hedge) { /* 请求与应答的type不同或应答无法解压, 双方配置有误才会至此, 作为超时处理 */
+                _sio_rpc_breaker_failure(upstream);
+                req->hedge_upstream = NULL;
+                req->hedge_conn = NULL;
+            } else {
+                _sio_rpc_breaker_failure(upstream);
                 req->upstream = NULL;
+                req->conn = NULL;
             }
         } /* 没有找到对应的call, 忽略此应答 */
-        used += SHEAD_ENCODE_SIZE + head.body_len;
+        free(plain);
+        used += frame_len;
+    }
+    conn->parsing = 0;
+    if (conn->closing) { /* 解析期间连接被断开, 此时才能释放输入缓冲区 */
+        sio_stream_close(sio, conn->closing);
+        conn->closing = NULL;
+        return 0;
     }
     sio_buffer_erase(input, used);
-    return 0;
+    return err;
 }
 
-static void _sio_rpc_upstream_callback(struct sio *sio, struct sio_stream *stream, enum sio_stream_event event, void *arg)
+static void _sio_rpc_conn_callback(struct sio *sio, struct sio_stream *stream, enum sio_stream_event event, void *arg)
 {
-    struct sio_rpc_upstream *upstream = arg;
+    struct sio_rpc_conn *conn = arg;
     int err = 0;
     switch (event) {
     case SIO_STREAM_CONNECTED:
     	break;
     case SIO_STREAM_DATA:
-        err = _sio_rpc_upstream_parse_response(sio, upstream);
+        err = _sio_rpc_conn_parse_response(sio, conn);
         break;
     case SIO_STREAM_ERROR:
     case SIO_STREAM_CLOSE:
-        _sio_rpc_reset_upstream(upstream);
+    case SIO_STREAM_CONNECT_TIMEOUT:
+        _sio_rpc_reset_conn(conn);
         break;
     default:
         assert(0);
     }
-    if (err)
-        _sio_rpc_reset_upstream(upstream);
+    if (err)
+        _sio_rpc_reset_conn(conn);
+}
+
+static int _sio_rpc_conn_connect(struct sio *sio, struct sio_rpc_conn *conn)
+{
+    struct sio_rpc_upstream *upstream = conn->upstream;
+    const char *ip = upstream->ip;
+    conn->stream = sio_stream_connect_multi(sio, &ip, 1, upstream->port, upstream->client->rpc->conn_timeout, 0,
+            &upstream->client->rpc->profile, _sio_rpc_conn_callback, conn);
+    conn->last_conn_time = time(NULL);
+    conn->compact = upstream->client->compact ? SIO_RPC_COMPACT_OFFER : SIO_RPC_COMPACT_OFF;
+    if (!conn->stream) {
+        conn->conn_delay = conn->conn_delay >= 256 ? 256 : conn->conn_delay * 2;
+        return -1;
+    }
+    ++upstream->connected;
+    return 0;
+}
+
+/* 连接upstream所有断开的连接, 至少一条连接可用返回0 */
+static int _sio_rpc_upstream_connect(struct sio *sio, struct sio_rpc_upstream *upstream)
+{
+    uint32_t i;
+    for (i = 0; i < upstream->conn_count; ++i) {
+        if (!upstream->conns[i].stream)
+            _sio_rpc_conn_connect(sio, &upstream->conns[i]);
+    }
+    return upstream->connected ? 0 : -1;
+}
+
+static void _sio_rpc_upstream_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_rpc_upstream *upstream = arg;
+
+    _sio_rpc_breaker_tick(upstream);
+
+    uint32_t i;
+    for (i = 0; i < upstream->conn_count; ++i) {
+        struct sio_rpc_conn *conn = &upstream->conns[i];
+        /* 检查stream的读写缓冲区pending长度, 过长则断开连接 */
+        if (conn->stream && 
+                (sio_stream_pending(conn->stream) >= upstream->client->rpc->max_pending 
+                    || sio_buffer_length(sio_stream_buffer(conn->stream)) >= upstream->client->rpc->max_pending))
+            _sio_rpc_reset_conn(conn);
+
+        if (!conn->stream) {
+            time_t now = time(NULL);
+            time_t period = now > conn->last_conn_time ? now - conn->last_conn_time : 0;
+            //printf("period=%ld conn_delay=%ld\n", period, conn->conn_delay);
+            if (period >= conn->conn_delay)
+                _sio_rpc_conn_connect(sio, conn);
+        }
+    }
+
+    sio_start_timer(upstream->client->rpc->sio, &upstream->timer, 1000, _sio_rpc_upstream_timer, upstream);
+}
+
+void sio_rpc_add_upstream(struct sio_rpc_client *client, const char *ip, uint16_t port)
+{
+    uint32_t i;
+    for (i = 0; i < client->upstream_count; ++i) {
+        if (strcmp(client->upstreams[i]->ip, ip) == 0 && client->upstreams[i]->port == port)
+            return;
+    }
+    sio_rpc_add_upstream_weight(client, ip, port, 1);
+}
+
+void sio_rpc_add_upstream_weight(struct sio_rpc_client *client, const char *ip, uint16_t port, uint32_t weight)
+{
+    if (weight < 1)
+        weight = 1;
+    else if (weight > SIO_RPC_MAX_WEIGHT)
+        weight = SIO_RPC_MAX_WEIGHT;
+
+    uint32_t i;
+    for (i = 0; i < client->upstream_count; ++i) {
+        if (strcmp(client->upstreams[i]->ip, ip) == 0 && client->upstreams[i]->port == port) {
+            client->upstreams[i]->weight = weight;
+            _sio_rpc_rebuild_balance(client);
+            return;
+        }
+    }
+
+    struct sio_rpc_upstream *upstream = malloc(sizeof(*upstream));
+    upstream->ip = strdup(ip);
+    upstream->port = port;
+    upstream->client = client;
+    upstream->pending = 0;
+    upstream->connected = 0;
+    upstream->conn_count = client->conn_per_upstream;
+    upstream->conns = calloc(upstream->conn_count, sizeof(*upstream->conns));
+    for (i = 0; i < upstream->conn_count; ++i) {
+        struct sio_rpc_conn *conn = &upstream->conns[i];
+        conn->upstream = upstream;
+        conn->conn_delay = 1; /* 最小延迟1秒重连 */
+        conn->last_conn_time = time(NULL);
+        conn->slot_mask = SIO_RPC_UPSTREAM_SLOTS - 1;
+        conn->slots = calloc(conn->slot_mask + 1, sizeof(*conn->slots));
+    }
+    upstream->weight = weight;
+    upstream->ewma_us = 0;
+    upstream->breaker = SIO_RPC_BREAKER_CLOSED;
+    upstream->probe_inflight = 0;
+    upstream->win_requests = upstream->win_failures = upstream->consecutive_failures = 0;
+    upstream->eject_count = 0;
+    upstream->win_start = time(NULL);
+    upstream->eject_until = 0;
+    _sio_rpc_upstream_connect(client->rpc->sio, upstream);
+
+    sio_start_timer(client->rpc->sio, &upstream->timer, 1000, _sio_rpc_upstream_timer, upstream);
+
+    client->upstreams = realloc(client->upstreams, ++client->upstream_count * sizeof(*client->upstreams));
+    client->upstreams[client->upstream_count - 1] = upstream;
+    _sio_rpc_rebuild_balance(client);
+}
+
+static void _sio_rpc_remove_upstream(struct sio_rpc_client *client, struct sio_rpc_upstream *upstream)
+{
+    uint32_t i;
+    for (i = 0; i < upstream->conn_count; ++i) {
+        if (upstream->conns[i].stream) /* 主动关闭连接, 重置所有排队请求, 不计入熔断统计 */
+            _sio_rpc_close_conn(&upstream->conns[i]);
+        free(upstream->conns[i].slots);
+        if (upstream->conns[i].streams)
+            shash_free(upstream->conns[i].streams);
+        if (upstream->conns[i].batch)
+            sio_buffer_free(upstream->conns[i].batch);
+    }
+    sio_stop_timer(client->rpc->sio, &upstream->timer); /* 关闭定时器 */
+    free(upstream->ip);
+    free(upstream->conns);
+    free(upstream);
+}
+
+void sio_rpc_remove_upstream(struct sio_rpc_client *client, const char *ip, uint16_t port)
+{
+    struct sio_rpc_upstream *upstream = NULL;
+
+    uint32_t i;
+    for (i = 0; i < client->upstream_count; ++i) {
+        if (strcmp(client->upstreams[i]->ip, ip) == 0 && client->upstreams[i]->port == port) {
+            upstream = client->upstreams[i];
+            break;
+        }
+    }
+    if (!upstream)
+        return;
+    if (i != client->upstream_count - 1)
+        client->upstreams[i] = client->upstreams[client->upstream_count - 1]; /* 最后一个upstream往前放 */
+    client->upstream_count--;
+    _sio_rpc_remove_upstream(client, upstream);
+    _sio_rpc_rebuild_balance(client);
+}
+
+static uint64_t _sio_rpc_hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int _sio_rpc_vnode_compare(const void *a, const void *b)
+{
+    const struct sio_rpc_vnode *va = a, *vb = b;
+    return va->hash < vb->hash ? -1 : (va->hash > vb->hash ? 1 : 0);
+}
+
+/* upstream变化或策略切换后, 重新计算加权轮转序列与一致性哈希环 */
+static void _sio_rpc_rebuild_balance(struct sio_rpc_client *client)
+{
+    free(client->wrr_schedule);
+    client->wrr_schedule = NULL;
+    client->wrr_len = 0;
+    free(client->hash_ring);
+    client->hash_ring = NULL;
+    client->vnode_count = 0;
+
+    if (client->balance != SIO_RPC_BALANCE_WRR && client->balance != SIO_RPC_BALANCE_HASH)
+        return;
+
+    uint32_t i, total = 0;
+    for (i = 0; i < client->upstream_count; ++i)
+        total += client->upstreams[i]->weight;
+    if (!total)
+        return;
+
+    /* 平滑加权轮转: 每轮各upstream的current加上权重, 选中current最大者并减去总权重 */
+    int64_t *current = calloc(client->upstream_count, sizeof(*current));
+    client->wrr_schedule = malloc(total * sizeof(*client->wrr_schedule));
+    client->wrr_len = total;
+    uint32_t k;
+    for (k = 0; k < total; ++k) {
+        uint32_t best = 0;
+        for (i = 0; i < client->upstream_count; ++i) {
+            current[i] += client->upstreams[i]->weight;
+            if (current[i] > current[best])
+                best = i;
+        }
+        current[best] -= total;
+        client->wrr_schedule[k] = best;
+    }
+    free(current);
+
+    if (client->balance != SIO_RPC_BALANCE_HASH)
+        return;
+
+    client->vnode_count = total * SIO_RPC_HASH_VNODES;
+    client->hash_ring = malloc(client->vnode_count * sizeof(*client->hash_ring));
+    struct sio_rpc_vnode *vnode = client->hash_ring;
+    for (i = 0; i < client->upstream_count; ++i) {
+        struct sio_rpc_upstream *upstream = client->upstreams[i];
+        /* 虚拟节点位置只取决于ip:port, 增删upstream不影响其他upstream的节点 */
+        uint64_t h = 14695981039346656037ULL;
+        const char *p;
+        for (p = upstream->ip; *p; ++p)
+            h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+        h ^= (uint64_t)upstream->port << 16;
+        for (k = 0; k < upstream->weight * SIO_RPC_HASH_VNODES; ++k) {
+            vnode->hash = _sio_rpc_hash_mix(h ^ ((uint64_t)(k + 1) << 40));
+            vnode->upstream = upstream;
+            ++vnode;
+        }
+    }
+    qsort(client->hash_ring, client->vnode_count, sizeof(*client->hash_ring), _sio_rpc_vnode_compare);
+}
+
+void sio_rpc_client_set_balance(struct sio_rpc_client *client, enum sio_rpc_balance balance)
+{
+    client->balance = balance;
+    _sio_rpc_rebuild_balance(client);
+}
+
+static struct sio_rpc_upstream *_sio_rpc_choose_least_pending(struct sio_rpc_client *client, char ignore_breaker)
+{
+    uint64_t min_pending = ~0;
+    struct sio_rpc_upstream *upstream = NULL;
+
+    client->rr_stream++;
+    
+    uint32_t i;
+    for (i = 0; i < client->upstream_count; ++i) {
+        uint32_t idx = (client->rr_stream + i) % client->upstream_count;
+        if (ignore_breaker ? client->upstreams[idx]->connected != 0 : _sio_rpc_upstream_usable(client->upstreams[idx])) {
+            uint64_t pending = client->upstreams[idx]->pending;
+            if (pending <= min_pending) {
+                min_pending = pending;
+                upstream = client->upstreams[idx];
+            }
+        }
+    }
+    return upstream;
+}
+
+/* 随机选两个upstream比较代价, 其中有未连接的则退化为扫描 */
+static struct sio_rpc_upstream *_sio_rpc_choose_p2c(struct sio_rpc_client *client, char by_latency)
+{
+    uint32_t n = client->upstream_count;
+    uint32_t ia = rand_r(&client->rand_seed) % n;
+    uint32_t ib = n > 1 ? (ia + 1 + rand_r(&client->rand_seed) % (n - 1)) % n : ia;
+    struct sio_rpc_upstream *a = client->upstreams[ia];
+    struct sio_rpc_upstream *b = client->upstreams[ib];
+
+    char usable_a = _sio_rpc_upstream_usable(a), usable_b = _sio_rpc_upstream_usable(b);
+    if (!usable_a || !usable_b)
+        return usable_a ? a : (usable_b ? b : _sio_rpc_choose_least_pending(client, 0));
+    if (by_latency)
+        return (a->ewma_us + 1) * (a->pending + 1) <= (b->ewma_us + 1) * (b->pending + 1) ? a : b;
+    return a->pending <= b->pending ? a : b;
+}
+
+static struct sio_rpc_upstream *_sio_rpc_choose_wrr(struct sio_rpc_client *client)
+{
+    uint32_t i;
+    for (i = 0; i < client->wrr_len; ++i) {
+        struct sio_rpc_upstream *upstream = client->upstreams[client->wrr_schedule[client->rr_stream++ % client->wrr_len]];
+        if (_sio_rpc_upstream_usable(upstream))
+            return upstream;
+    }
+    return NULL;
+}
+
+/* 从key在环上的位置顺时针找到第一个已连接的upstream, 每次重试换一个位置 */
+static struct sio_rpc_upstream *_sio_rpc_choose_hash(struct sio_rpc_client *client, const struct sio_rpc_request *req)
+{
+    if (!client->vnode_count)
+        return NULL;
+    uint64_t h = _sio_rpc_hash_mix(req->hash_key + req->retry_count);
+
+    uint32_t low = 0, high = client->vnode_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (client->hash_ring[mid].hash < h)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    uint32_t i;
+    for (i = 0; i < client->vnode_count; ++i) {
+        struct sio_rpc_upstream *upstream = client->hash_ring[(low + i) % client->vnode_count].upstream;
+        if (_sio_rpc_upstream_usable(upstream))
+            return upstream;
+    }
+    return NULL;
+}
+
+static struct sio_rpc_upstream *_sio_rpc_choose_upstream(struct sio_rpc_client *client, const struct sio_rpc_request *req)
+{
+    struct sio_rpc_upstream *upstream = NULL;
+
+    if (!client->upstream_count)
+        return NULL;
+
+    switch (client->balance) {
+    case SIO_RPC_BALANCE_P2C:
+        upstream = _sio_rpc_choose_p2c(client, 0);
+        break;
+    case SIO_RPC_BALANCE_EWMA:
+        upstream = _sio_rpc_choose_p2c(client, 1);
+        break;
+    case SIO_RPC_BALANCE_HASH:
+        if (req && req->has_key) {
+            upstream = _sio_rpc_choose_hash(client, req);
+            break;
+        }
+        /* fallthrough: 不是sio_rpc_call_hash发起的请求没有key, 无法定位哈希环, 按权重轮转(HASH策略同样生成了WRR调度表) */
+    case SIO_RPC_BALANCE_WRR:
+        upstream = _sio_rpc_choose_wrr(client);
+        break;
+    default:
+        upstream = _sio_rpc_choose_least_pending(client, 0);
+    }
+    if (upstream)
+        return upstream;
+    /* 可用的upstream都被熔断, 忽略熔断状态 */
+    if (client->breaker_eject && (upstream = _sio_rpc_choose_least_pending(client, 1)))
+        return upstream;
+    /* 没有已连接的upstream, 立即发起连接 */
+    upstream = client->upstreams[client->rr_stream % client->upstream_count];
+    if (_sio_rpc_upstream_connect(client->rpc->sio, upstream) == -1)
+        return NULL;
+    return upstream;
+}
+
+/* 从空闲链表取一个请求, 链表为空则批量分配一块 */
+static struct sio_rpc_request *_sio_rpc_alloc_call(struct sio_rpc_client *client)
+{
+    if (!client->free_reqs) {
+        struct sio_rpc_request *slab = malloc(SIO_RPC_REQUEST_SLAB * sizeof(*slab));
+        client->slabs = realloc(client->slabs, (client->slab_count + 1) * sizeof(*client->slabs));
+        client->slabs[client->slab_count++] = slab;
+        int i;
+        for (i = 0; i < SIO_RPC_REQUEST_SLAB; ++i) {
+            slab[i].next_free = client->free_reqs;
+            client->free_reqs = &slab[i];
+        }
+    }
+    struct sio_rpc_request *req = client->free_reqs;
+    client->free_reqs = req->next_free;
+    return req;
+}
+
+/* 以seq为下标记录请求, 下标被仍在运行的请求占用则扩容 */
+static void _sio_rpc_record_call(struct sio_rpc_client *client, struct sio_rpc_request *req)
+{
+    req->seq = client->req_seq++;
+    while (client->req_ring[req->seq & client->ring_mask]) {
+        /* 原来seq & mask互不相同的请求, 在新的mask下依然互不相同 */
+        uint64_t mask = client->ring_mask * 2 + 1;
+        struct sio_rpc_request **ring = calloc(mask + 1, sizeof(*ring));
+        uint64_t r;
+        for (r = 0; r <= client->ring_mask; ++r) {
+            if (client->req_ring[r])
+                ring[client->req_ring[r]->seq & mask] = client->req_ring[r];
+        }
+        free(client->req_ring);
+        client->req_ring = ring;
+        client->ring_mask = mask;
+    }
+    client->req_ring[req->seq & client->ring_mask] = req;
+}
+
+static void _sio_rpc_free_call(struct sio_rpc_request *req)
+{
+    struct sio_rpc_client *client = req->client;
+
+    client->req_ring[req->seq & client->ring_mask] = NULL;
+    if (req->hedge_on)
+        sio_stop_timer(client->rpc->sio, &req->hedge_timer);
+    if (req->release)
+        req->release(client, req->body, req->bodylen, req->arg);
+    else
+        free((char *)req->body);
+    free(req->packed);
+    req->next_free = client->free_reqs;
+    client->free_reqs = req;
+}
+
+static int _sio_rpc_call(struct sio_rpc_upstream *upstream, struct sio_rpc_request *req, char is_hedge);
+static void _sio_rpc_arm_hedge(struct sio_rpc_client *client, struct sio_rpc_request *req);
+
+static void _sio_rpc_release_none(struct sio_rpc_client *client, const char *request, uint32_t size, void *arg)
+{
+}
+
+static void _sio_rpc_call_timer(struct sio *sio, struct sio_timer *timer, void *arg);
+static struct sio_rpc_upstream *_sio_rpc_choose_hedge(struct sio_rpc_client *client, struct sio_rpc_upstream *primary);
+
+/*
+ * call没有副本在等待应答: 超过重试限制则以status回调用户, 否则重新选择upstream重试,
+ * avoid不为NULL时优先选择其他upstream
+ */
+static void _sio_rpc_retry_call(struct sio_rpc_request *req, char status, struct sio_rpc_upstream *avoid)
+{
+    if (req->retry_count++ >= req->retry_times) {
+        req->cb(req->client, status, NULL, 0, req->arg);
+        _sio_rpc_free_call(req);
+    } else {
+        sio_start_timer(req->client->rpc->sio, &req->timer, req->timeout, _sio_rpc_call_timer, req);
+        req->upstream = avoid ? _sio_rpc_choose_hedge(req->client, avoid) : NULL;
+        if (!req->upstream)
+            req->upstream = _sio_rpc_choose_upstream(req->client, req);
+        if (req->upstream && _sio_rpc_call(req->upstream, req, 0) == -1)
+            req->upstream = NULL; /* 重试call失败, 等待请求超时 */
+        _sio_rpc_arm_hedge(req->client, req);
+    }
+}
+
+/* rpc call 超时 */
+static void _sio_rpc_call_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_rpc_request *req = arg;
+
+    if (req->upstream) { /* call已送出, 取消call, 超时计入upstream延迟 */
+        assert(_sio_rpc_slot_remove(req->conn, req->id) == req);
+        _sio_rpc_conn_cancel(req->conn, req->id, req->type);
+        _sio_rpc_upstream_latency(req->upstream, req->timeout * 1000);
+        _sio_rpc_breaker_failure(req->upstream);
+        req->upstream = NULL;
+        req->conn = NULL;
+    }
+    if (req->hedge_upstream) { /* 对冲副本同样超时 */
+        assert(_sio_rpc_slot_remove(req->hedge_conn, req->hedge_id) == req);
+        _sio_rpc_conn_cancel(req->hedge_conn, req->hedge_id, req->type);
+        uint64_t now = _sio_rpc_cur_time_us();
+        _sio_rpc_upstream_latency(req->hedge_upstream, now > req->hedge_start_us ? now - req->hedge_start_us : 0);
+        _sio_rpc_breaker_failure(req->hedge_upstream);
+        req->hedge_upstream = NULL;
+        req->hedge_conn = NULL;
+    }
+    if (req->hedge_on) {
+        sio_stop_timer(sio, &req->hedge_timer);
+        req->hedge_on = 0;
+    }
+    _sio_rpc_retry_call(req, SIO_RPC_CALL_TIMEOUT, NULL);
+}
+
+/* upstream过载拒绝了一个副本, 另一个副本仍在等待则继续等待, 否则立即换upstream重试而不等待超时 */
+static void _sio_rpc_call_overloaded(struct sio *sio, struct sio_rpc_request *req, struct sio_rpc_upstream *upstream)
+{
+    if (req->upstream || req->hedge_upstream)
+        return;
+    sio_stop_timer(sio, &req->timer);
+    if (req->hedge_on) {
+        sio_stop_timer(sio, &req->hedge_timer);
+        req->hedge_on = 0;
+    }
+    _sio_rpc_retry_call(req, SIO_RPC_CALL_OVERLOADED, upstream);
+}
+
+/* 选择primary之外代价最小的已连接upstream */
+static struct sio_rpc_upstream *_sio_rpc_choose_hedge(struct sio_rpc_client *client, struct sio_rpc_upstream *primary)
+{
+    struct sio_rpc_upstream *upstream = NULL;
+    uint32_t i;
+    for (i = 0; i < client->upstream_count; ++i) {
+        struct sio_rpc_upstream *cand = client->upstreams[i];
+        if (cand == primary || !_sio_rpc_upstream_usable(cand))
+            continue;
+        if (!upstream || (cand->ewma_us + 1) * (cand->pending + 1) < (upstream->ewma_us + 1) * (upstream->pending + 1))
+            upstream = cand;
+    }
+    return upstream;
+}
+
+/* 对冲延迟到期仍无应答, 预算充足时向另一个upstream发送副本 */
+static void _sio_rpc_hedge_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_rpc_request *req = arg;
+    struct sio_rpc_client *client = req->client;
+
+    req->hedge_on = 0;
+    if (!req->upstream || req->hedge_upstream || client->hedge_tokens < 100)
+        return;
+    struct sio_rpc_upstream *upstream = _sio_rpc_choose_hedge(client, req->upstream);
+    if (!upstream)
+        return;
+    client->hedge_tokens -= 100;
+    req->hedge_upstream = upstream;
+    if (_sio_rpc_call(upstream, req, 1) == -1)
+        req->hedge_upstream = NULL;
+}
+
+static void _sio_rpc_arm_hedge(struct sio_rpc_client *client, struct sio_rpc_request *req)
+{
+    if (!req->upstream || !client->hedge_delay || client->hedge_delay >= req->timeout)
+        return;
+    sio_start_timer(client->rpc->sio, &req->hedge_timer, client->hedge_delay, _sio_rpc_hedge_timer, req);
+    req->hedge_on = 1;
+}
+
+/* 连接异常: 计入熔断统计后关闭连接 */
+static void _sio_rpc_reset_conn(struct sio_rpc_conn *conn)
+{
+    _sio_rpc_breaker_failure(conn->upstream);
+    _sio_rpc_close_conn(conn);
+}
+
+static void _sio_rpc_close_conn(struct sio_rpc_conn *conn)
+{
+    /* 关闭连接, 等待定时器检测发起重连 */
+    struct sio_rpc_upstream *upstream = conn->upstream;
+    struct sio *sio = upstream->client->rpc->sio;
+    if (conn->parsing) /* 正在解析该连接的输入, 解析结束后再关闭 */
+        conn->closing = conn->stream;
+    else
+        sio_stream_close(sio, conn->stream);
+    conn->stream = NULL;
+    conn->req_id = 0;
+    --upstream->connected;
+    if (conn->batch) /* 尚未发出的合并请求随连接一起丢弃 */
+        sio_buffer_erase(conn->batch, sio_buffer_length(conn->batch));
+
+    time_t now = time(NULL);
+    time_t conn_life = now > conn->last_conn_time ? now - conn->last_conn_time : 0;
+    if (conn_life < 5) /* 连接存活不超过5秒, 增加惩罚时间 */
+        conn->conn_delay = conn->conn_delay >= 256 ? 256 : conn->conn_delay * 2;
+    else
+        conn->conn_delay = 1;
+
+    /* 重置所有等待应答的请求的连接为NULL, 等待超时后重新调度到其他连接 */
+    uint64_t i;
+    for (i = 0; i <= conn->slot_mask && conn->pending; ++i) {
+        struct sio_rpc_slot *slot = &conn->slots[i];
+        if (slot->req) {
+            if (slot->req->hedge_conn == conn) {
+                slot->req->hedge_upstream = NULL;
+                slot->req->hedge_conn = NULL;
+            } else {
+                slot->req->upstream = NULL;
+                slot->req->conn = NULL;
+            }
+            slot->req = NULL;
+            --conn->pending;
+            --upstream->pending;
+        }
+    }
+
+    /* 连接上的流无法继续, 以ERROR通知用户 */
+    if (conn->streams) {
+        struct shash *streams = conn->streams;
+        conn->streams = NULL;
+        _sio_rpc_stream_fail_all(streams);
+    }
+}
+
+/* 选择upstream上等待应答最少的连接 */
+static struct sio_rpc_conn *_sio_rpc_choose_conn(struct sio_rpc_upstream *upstream)
+{
+    struct sio_rpc_conn *conn = NULL;
+    uint32_t i;
+    for (i = 0; i < upstream->conn_count; ++i) {
+        if (upstream->conns[i].stream && (!conn || upstream->conns[i].pending < conn->pending))
+            conn = &upstream->conns[i];
+    }
+    return conn;
+}
+
+static int _sio_rpc_call(struct sio_rpc_upstream *upstream, struct sio_rpc_request *req, char is_hedge)
+{
+    struct sio *sio = upstream->client->rpc->sio;
+
+    struct sio_rpc_conn *conn = _sio_rpc_choose_conn(upstream);
+    if (!conn)
+        return -1;
+
+    const char *body = req->packed ? req->packed : req->body;
+    uint32_t body_len = req->packed ? req->packed_len : req->bodylen;
+
+    /* 小请求合并到连接的缓冲区, 大请求先发出已合并的请求再直接发送, 保持连接上的发送顺序 */
+    struct sio_rpc_client *client = upstream->client;
+    char coalesce = client->coalesce && SHEAD_COMPACT_MAX_SIZE + body_len <= SIO_RPC_COALESCE_LIMIT;
+    if (client->coalesce && !coalesce && conn->batch) {
+        _sio_rpc_flush_conn(conn);
+        if (!conn->stream)
+            return -1;
+    }
+    struct sio_stream *stream = conn->stream;
+
+    uint64_t id = conn->req_id++;
+    uint64_t now_us = _sio_rpc_cur_time_us();
+    if (is_hedge) {
+        req->hedge_conn = conn;
+        req->hedge_id = id;
+        req->hedge_start_us = now_us;
+    } else {
+        req->conn = conn;
+        req->id = id;
+        req->start_us = now_us;
+    }
+
+    /* 请求定时器的剩余时间即为服务端的排队预算, 对冲副本只剩下本次尝试余下的时间, 至少1ms; 没有超时的请求不限 */
+    uint64_t now_ms = now_us / 1000;
+    uint64_t budget = 0;
+    if (req->timeout)
+        budget = req->timer.expire > now_ms ? req->timer.expire - now_ms : 1;
+    if (budget > SIO_RPC_BUDGET_MAX)
+        budget = SIO_RPC_BUDGET_MAX;
+
+    struct shead shead;
+    shead.id = id;
+    shead.type = req->type;
+    shead.reserved = (uint32_t)budget << SIO_RPC_BUDGET_SHIFT;
+    shead.reserved |= req->codec << SIO_RPC_CODEC_SHIFT;
+    if (client->rpc->codecs[client->codec].decompress) /* 只声明能够解压的方式 */
+        shead.reserved |= client->codec << SIO_RPC_ACCEPT_SHIFT;
+    shead.body_len = body_len;
+
+    if (coalesce) { /* 直接编码到合并缓冲区, 等待flush_timer发出 */
+        if (!conn->batch)
+            conn->batch = sio_buffer_new();
+        sio_buffer_reserve(conn->batch, SHEAD_COMPACT_MAX_SIZE + body_len);
+        sio_buffer_seek(conn->batch, _sio_rpc_head_encode(&shead, conn->compact, sio_buffer_space(conn->batch, NULL)));
+        sio_buffer_append(conn->batch, body, body_len);
+        if (!client->flush_on) {
+            sio_start_timer(sio, &client->flush_timer, 0, _sio_rpc_flush_timer, client);
+            client->flush_on = 1;
+        }
+        _sio_rpc_slot_insert(conn, id, req);
+        if (upstream->breaker == SIO_RPC_BREAKER_HALF_OPEN)
+            upstream->probe_inflight = 1;
+        return 0;
+    }
+
+    char head[SHEAD_COMPACT_MAX_SIZE];
+    uint32_t head_len = _sio_rpc_head_encode(&shead, conn->compact, head);
+
+    int sent_head = sio_stream_write(sio, stream, head, head_len);
+    int sent_body = sio_stream_write(sio, stream, body, body_len);
+    if (sent_head == 0 && sent_body == 0) { /* call成功发出, 记录状态, 等待应答或者超时 */
+        _sio_rpc_slot_insert(conn, id, req);
+        if (upstream->breaker == SIO_RPC_BREAKER_HALF_OPEN)
+            upstream->probe_inflight = 1;
+        return 0;
+    }
+    /* call发送失败, 重置连接, 等待超时 */
+    if (is_hedge)
+        req->hedge_conn = NULL;
+    else
+        req->conn = NULL;
+    _sio_rpc_reset_conn(conn);
+    return -1;
+}
+
+static void _sio_rpc_start_call(struct sio_rpc_client *client, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_rpc_release_callback_t release, sio_rpc_upstream_callback_t cb, void *arg,
+        char has_key, uint64_t key)
+{
+    struct sio_rpc_request *req = _sio_rpc_alloc_call(client);
+    req->timeout = timeout_ms;
+    req->retry_times = retry_times;
+    req->retry_count = 0;
+    req->type = type;
+    req->body = request;
+    req->bodylen = size;
+    req->release = release;
+    req->has_key = has_key;
+    req->hash_key = key;
+    req->cb = cb;
+    req->arg = arg;
+    req->client = client;
+    req->conn = NULL;
+    req->hedge_upstream = NULL;
+    req->hedge_conn = NULL;
+    req->hedge_on = 0;
+    req->packed = NULL;
+    req->codec = 0;
+    if (client->codec && size >= client->compress_min && client->rpc->codecs[client->codec].compress) {
+        /* 只压缩一次, 重试与对冲都发送压缩后的body */
+        req->packed = _sio_rpc_compress(&client->rpc->codecs[client->codec], _sio_rpc_find_dict(client->rpc, type),
+                request, size, &req->packed_len);
+        if (req->packed)
+            req->codec = client->codec;
+    }
+    req->upstream = _sio_rpc_choose_upstream(client, req);
+    sio_start_timer(client->rpc->sio, &req->timer, timeout_ms, _sio_rpc_call_timer, req);
+    _sio_rpc_record_call(client, req);
+
+    if (client->hedge_percentile) {
+        client->hedge_tokens += client->hedge_budget;
+        if (client->hedge_tokens > 100 * SIO_RPC_HEDGE_BURST)
+            client->hedge_tokens = 100 * SIO_RPC_HEDGE_BURST;
+    }
+
+    if (!req->upstream)
+        return; /* 无可用连接, 等待请求超时 */
+    if (_sio_rpc_call(req->upstream, req, 0) == -1)
+        req->upstream = NULL; /* call失败, 等待请求超时 */
+    _sio_rpc_arm_hedge(client, req);
+}
+
+/* 发起远程调用, 消息类型type, 请求超时timeout_ms, 重试次数retry_times, 请求request, 请求长度size, 结果回调cb, 回调参数arg */
+void sio_rpc_call(struct sio_rpc_client *client, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_rpc_upstream_callback_t cb, void *arg)
+{
+    char *body = malloc(size);
+    memcpy(body, request, size);
+    _sio_rpc_start_call(client, type, timeout_ms, retry_times, body, size, NULL, cb, arg, 0, 0);
+}
+
+/* 同sio_rpc_call, 在一致性哈希策略下按key选择upstream */
+void sio_rpc_call_hash(struct sio_rpc_client *client, uint64_t key, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_rpc_upstream_callback_t cb, void *arg)
+{
+    char *body = malloc(size);
+    memcpy(body, request, size);
+    _sio_rpc_start_call(client, type, timeout_ms, retry_times, body, size, NULL, cb, arg, 1, key);
+}
+
+/* 同sio_rpc_call, 但直接引用调用者的请求体, 请求结束后通过release归还 */
+void sio_rpc_call_nocopy(struct sio_rpc_client *client, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_rpc_release_callback_t release, sio_rpc_upstream_callback_t cb, void *arg)
+{
+    /* 没有release回调时用空回调占位, 避免body被当作框架拷贝释放 */
+    _sio_rpc_start_call(client, type, timeout_ms, retry_times, request, size,
+            release ? release : _sio_rpc_release_none, cb, arg, 0, 0);
+}
+
+struct sio_rpc_stream *sio_rpc_stream_open(struct sio_rpc_client *client, uint32_t type, uint64_t idle_timeout_ms,
+        sio_rpc_stream_callback_t cb, void *arg)
+{
+    struct sio_rpc_upstream *upstream = _sio_rpc_choose_upstream(client, NULL);
+    if (!upstream)
+        return NULL;
+    struct sio_rpc_conn *conn = _sio_rpc_choose_conn(upstream);
+    if (!conn)
+        return NULL;
+
+    struct sio_rpc_stream *stream = calloc(1, sizeof(*stream));
+    stream->id = conn->req_id++;
+    stream->type = type;
+    stream->rpc = client->rpc;
+    stream->conn = conn;
+    stream->timeout = idle_timeout_ms;
+    stream->send_credit = SIO_RPC_STREAM_WINDOW;
+    stream->cb = cb;
+    stream->arg = arg;
+    if (!conn->streams)
+        conn->streams = shash_new();
+    assert(shash_insert(conn->streams, (const char *)&stream->id, sizeof(stream->id), stream) == 0);
+    if (idle_timeout_ms) {
+        sio_start_timer(client->rpc->sio, &stream->timer, idle_timeout_ms, _sio_rpc_stream_timer, stream);
+        stream->timer_on = 1;
+    }
+
+    /* 空的OPEN帧通知服务端创建流 */
+    ++stream->busy;
+    if (_sio_rpc_stream_send(stream, SIO_RPC_FRAME_OPEN, NULL, 0) == -1) {
+        stream->closed = 1; /* 以NULL返回, 不再回调 */
+        _sio_rpc_stream_leave(stream);
+        return NULL;
+    }
+    _sio_rpc_stream_leave(stream);
+    return stream;
+}
+
+static void _sio_rpc_mt_callback(struct sio_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg)
+{
+    struct sio_rpc_mt_call *call = arg;
+    if (!call->mt->executor) {
+        call->cb(call->mt, is_timeout, response, size, call->arg);
+        return;
+    }
+    /* 应答只在回调期间有效, 拷贝后在release中交给executor */
+    call->is_timeout = is_timeout;
+    if (!is_timeout && size) {
+        call->response = malloc(size);
+        memcpy(call->response, response, size);
+        call->response_len = size;
+    }
+}
+
+static void _sio_rpc_mt_release(struct sio_rpc_client *client, const char *request, uint32_t size, void *arg)
+{
+    struct sio_rpc_mt_call *call = arg;
+    if (call->mt->executor)
+        call->mt->executor(call, call->mt->executor_arg);
+    else
+        free(call);
+}
+
+/* 取走提交栈中的所有调用, 按提交顺序发起 */
+static void _sio_rpc_mt_dispatch(struct sio_rpc_client_mt *mt)
+{
+    struct sio_rpc_mt_call *stack = __sync_lock_test_and_set(&mt->submit, NULL);
+    struct sio_rpc_mt_call *queue = NULL;
+    while (stack) { /* 提交栈是后进先出的, 反转为先进先出 */
+        struct sio_rpc_mt_call *next = stack->next;
+        stack->next = queue;
+        queue = stack;
+        stack = next;
+    }
+    while (queue) {
+        struct sio_rpc_mt_call *call = queue;
+        queue = call->next;
+        sio_rpc_call_nocopy(mt->client, call->type, call->timeout, call->retry_times, (const char *)(call + 1), call->size,
+                _sio_rpc_mt_release, _sio_rpc_mt_callback, call);
+    }
+}
+
+static void _sio_rpc_mt_notify(struct sio *sio, struct sio_fd *sfd, int fd, enum sio_event event, void *arg)
+{
+    /* 先清空管道再取提交栈, 之后的提交会发现栈为空而重新通知 */
+    char buffer[1024];
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+    _sio_rpc_mt_dispatch(arg);
+}
+
+struct sio_rpc_client_mt *sio_rpc_client_mt_new(struct sio_rpc *rpc)
+{
+    struct sio_rpc_client_mt *mt = malloc(sizeof(*mt));
+    if (pipe(mt->notify_pipe) == -1) {
+        free(mt);
+        return NULL;
+    }
+    fcntl(mt->notify_pipe[0], F_SETFL, fcntl(mt->notify_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(mt->notify_pipe[1], F_SETFL, fcntl(mt->notify_pipe[1], F_GETFL) | O_NONBLOCK);
+    mt->notify_sfd = sio_add(rpc->sio, mt->notify_pipe[0], _sio_rpc_mt_notify, mt);
+    if (!mt->notify_sfd) {
+        close(mt->notify_pipe[0]);
+        close(mt->notify_pipe[1]);
+        free(mt);
+        return NULL;
+    }
+    sio_watch_read(rpc->sio, mt->notify_sfd);
+    mt->client = sio_rpc_client_new(rpc);
+    mt->submit = NULL;
+    mt->executor = NULL;
+    mt->executor_arg = NULL;
+    return mt;
+}
+
+void sio_rpc_client_mt_free(struct sio_rpc_client_mt *mt)
+{
+    struct sio *sio = mt->client->rpc->sio;
+    /* 尚未发出的调用也交给client, 随client释放以超时回调 */
+    _sio_rpc_mt_dispatch(mt);
+    sio_rpc_client_free(mt->client);
+    sio_del(sio, mt->notify_sfd);
+    close(mt->notify_pipe[0]);
+    close(mt->notify_pipe[1]);
+    free(mt);
+}
+
+void sio_rpc_client_mt_set_executor(struct sio_rpc_client_mt *mt, sio_rpc_executor_t executor, void *arg)
+{
+    mt->executor = executor;
+    mt->executor_arg = arg;
+}
+
+/* 可在任意线程调用: 请求拷贝到call之后, CAS压入提交栈, 栈由空变为非空时通知sio_run线程 */
+void sio_rpc_call_mt(struct sio_rpc_client_mt *mt, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_rpc_mt_callback_t cb, void *arg)
+{
+    struct sio_rpc_mt_call *call = malloc(sizeof(*call) + size);
+    call->mt = mt;
+    call->type = type;
+    call->timeout = timeout_ms;
+    call->retry_times = retry_times;
+    call->size = size;
+    call->is_timeout = 0;
+    call->response = NULL;
+    call->response_len = 0;
+    call->cb = cb;
+    call->arg = arg;
+    if (size)
+        memcpy(call + 1, request, size);
+
+    struct sio_rpc_mt_call *head = NULL, *prev;
+    for (;;) {
+        call->next = head;
+        prev = __sync_val_compare_and_swap(&mt->submit, head, call);
+        if (prev == head)
+            break;
+        head = prev; /* 栈顶已被其他线程改变, 以新栈顶重试 */
+    }
+    if (!head)
+        while (write(mt->notify_pipe[1], "", 1) == -1 && errno == EINTR);
+}
+
+void sio_rpc_mt_run(struct sio_rpc_mt_call *call)
+{
+    call->cb(call->mt, call->is_timeout, call->response, call->response_len, call->arg);
+    free(call->response);
+    free(call);
+}
+
+static void _sio_rpc_dstream_callback(struct sio *sio, struct sio_stream *stream, enum sio_stream_event event, void *arg);
+static void _sio_rpc_dstream_free(struct sio_rpc_dstream *dstream);
+
+static void _sio_rpc_dstream_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_rpc_dstream *dstream = arg;
+
+    sio_start_timer(sio, &dstream->timer, 1000, _sio_rpc_dstream_timer, dstream);
+
+    /* 检查stream的读写缓冲区pending, 过长则断开连接 */
+    uint64_t deferred = dstream->deferred ? sio_buffer_length(dstream->deferred) : 0;
+    if (sio_stream_pending(dstream->stream) + deferred >= dstream->server->rpc->max_pending
+            || sio_buffer_length(sio_stream_buffer(dstream->stream)) >= dstream->server->rpc->max_pending)
+        _sio_rpc_dstream_free(dstream);
+}
+
+static struct sio_rpc_method *_sio_rpc_find_method(struct sio_rpc_server *server, uint32_t type)
+{
+    if (type < server->method_table_size)
+        return server->method_table[type];
+    if (type < SIO_RPC_METHOD_TABLE_MAX)
+        return NULL;
+    void *value;
+    if (shash_find(server->methods, (const char *)&type, sizeof(type), &value) == -1)
+        return NULL;
+    return value;
+}
+
+/* 较小的type放入方法表, 按需扩容到2的幂; 已经存在返回-1 */
+static int _sio_rpc_insert_method(struct sio_rpc_server *server, uint32_t type, struct sio_rpc_method *method)
+{
+    if (type >= SIO_RPC_METHOD_TABLE_MAX)
+        return shash_insert(server->methods, (const char *)&type, sizeof(type), method);
+    if (type >= server->method_table_size) {
+        uint32_t size = server->method_table_size ? server->method_table_size : 16;
+        while (size <= type)
+            size *= 2;
+        server->method_table = realloc(server->method_table, size * sizeof(*server->method_table));
+        memset(server->method_table + server->method_table_size, 0, (size - server->method_table_size) * sizeof(*server->method_table));
+        server->method_table_size = size;
+    }
+    if (server->method_table[type])
+        return -1;
+    server->method_table[type] = method;
+    return 0;
 }
 
-static int _sio_rpc_upstream_connect(struct sio *sio, struct sio_rpc_upstream *upstream)
+static struct sio_rpc_method *_sio_rpc_erase_method(struct sio_rpc_server *server, uint32_t type)
 {
-    upstream->stream = sio_stream_connect(sio, upstream->ip, upstream->port, _sio_rpc_upstream_callback, upstream);
-    upstream->last_conn_time = time(NULL);
-    if (!upstream->stream)
-        upstream->conn_delay = upstream->conn_delay >= 256 ? 256 : upstream->conn_delay * 2;
-    return upstream->stream ? 0 : -1;
+    struct sio_rpc_method *method = _sio_rpc_find_method(server, type);
+    if (!method)
+        return NULL;
+    if (type < SIO_RPC_METHOD_TABLE_MAX)
+        server->method_table[type] = NULL;
+    else
+        assert(shash_erase(server->methods, (const char *)&type, sizeof(type)) == 0);
+    return method;
 }
 
-static void _sio_rpc_upstream_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+/* id的低32位为下标, 高32位为连接序号, 下标被复用后旧id查找不到 */
+static struct sio_rpc_dstream *_sio_rpc_find_dstream(struct sio_rpc_server *server, uint64_t id)
 {
-    struct sio_rpc_upstream *upstream = arg;
-
-    /* 检查stream的读写缓冲区pending长度, 过长则断开连接 */
-    if (upstream->stream && 
-            (sio_stream_pending(upstream->stream) >= upstream->client->rpc->max_pending 
-                || sio_buffer_length(sio_stream_buffer(upstream->stream)) >= upstream->client->rpc->max_pending))
-        _sio_rpc_reset_upstream(upstream);
+    uint32_t slot = (uint32_t)id;
+    if (slot >= server->slot_count || !server->dstream_slots[slot] || server->dstream_slots[slot]->id != id)
+        return NULL;
+    return server->dstream_slots[slot];
+}
 
-    if (!upstream->stream) {
-        time_t now = time(NULL);
-        time_t period = now > upstream->last_conn_time ? now - upstream->last_conn_time : 0;
-        //printf("period=%ld conn_delay=%ld\n", period, upstream->conn_delay);
-        if (period >= upstream->conn_delay)
-            _sio_rpc_upstream_connect(sio, upstream);
+static void _sio_rpc_insert_dstream(struct sio_rpc_server *server, struct sio_rpc_dstream *dstream)
+{
+    if (!server->free_count) { /* 下标用尽, 扩容一倍, 新下标从小到大分配 */
+        uint32_t count = server->slot_count ? server->slot_count * 2 : 64;
+        server->dstream_slots = realloc(server->dstream_slots, count * sizeof(*server->dstream_slots));
+        server->free_slots = realloc(server->free_slots, count * sizeof(*server->free_slots));
+        uint32_t i;
+        for (i = count; i > server->slot_count; --i) {
+            server->dstream_slots[i - 1] = NULL;
+            server->free_slots[server->free_count++] = i - 1;
+        }
+        server->slot_count = count;
     }
+    uint32_t slot = server->free_slots[--server->free_count];
+    dstream->id = (server->conn_id++ << 32) | slot;
+    server->dstream_slots[slot] = dstream;
+}
 
-    sio_start_timer(upstream->client->rpc->sio, &upstream->timer, 1000, _sio_rpc_upstream_timer, upstream);
+static void _sio_rpc_erase_dstream(struct sio_rpc_server *server, struct sio_rpc_dstream *dstream)
+{
+    uint32_t slot = (uint32_t)dstream->id;
+    assert(server->dstream_slots[slot] == dstream);
+    server->dstream_slots[slot] = NULL;
+    server->free_slots[server->free_count++] = slot;
 }
 
-void sio_rpc_add_upstream(struct sio_rpc_client *client, const char *ip, uint16_t port)
+/* 回调返回时尚未finish的请求记录在连接上, 收到取消帧时可以找到 */
+static void _sio_rpc_track(struct sio_rpc_dstream *dstream, struct sio_rpc_response *resp)
 {
-    uint32_t i;
-    for (i = 0; i < client->upstream_count; ++i) {
-        if (strcmp(client->upstreams[i]->ip, ip) == 0 && client->upstreams[i]->port == port)
-            return;
-    }
+    if (!dstream->pending)
+        dstream->pending = shash_new();
+    if (shash_insert(dstream->pending, (const char *)&resp->req_head.id, sizeof(resp->req_head.id), resp) == 0)
+        resp->tracked = 1;
+}
 
-    struct sio_rpc_upstream *upstream = malloc(sizeof(*upstream));
-    upstream->ip = strdup(ip);
-    upstream->port = port;
-    upstream->req_id = 0;
-    upstream->conn_delay = 1; /* 最小延迟1秒重连 */
-    upstream->last_conn_time = time(NULL);
-    upstream->client = client;
-    upstream->req_status = shash_new();
-    _sio_rpc_upstream_connect(client->rpc->sio, upstream);
+static void _sio_rpc_untrack(struct sio_rpc_dstream *dstream, struct sio_rpc_response *resp)
+{
+    if (!resp->tracked)
+        return;
+    resp->tracked = 0;
+    if (dstream) /* 连接已释放则记录随之释放 */
+        assert(shash_erase(dstream->pending, (const char *)&resp->req_head.id, sizeof(resp->req_head.id)) == 0);
+}
 
-    sio_start_timer(client->rpc->sio, &upstream->timer, 1000, _sio_rpc_upstream_timer, upstream);
+static void _sio_rpc_dstream_accept(struct sio_rpc_server *server, struct sio *sio, struct sio_stream *stream)
+{
+    struct sio_rpc_dstream *dstream = malloc(sizeof(*dstream));
+    dstream->server = server;
+    dstream->stream = stream;
+    dstream->streams = NULL;
+    dstream->parsing = 0;
+    dstream->closed = 0;
+    dstream->read_us = 0;
+    dstream->pending = NULL;
+    dstream->deferred = NULL;
+    dstream->deferred_lens = NULL;
+    dstream->compact = SIO_RPC_COMPACT_OFF;
+    _sio_rpc_insert_dstream(server, dstream);
+    sio_stream_set(sio, stream, _sio_rpc_dstream_callback, dstream);
+    sio_start_timer(sio, &dstream->timer, 1000, _sio_rpc_dstream_timer, dstream);
+}
 
-    client->upstreams = realloc(client->upstreams, ++client->upstream_count * sizeof(*client->upstreams));
-    client->upstreams[client->upstream_count - 1] = upstream;
+/* 应答应使用的压缩方式: 服务端开启了压缩, 应答足够大, 且客户端声明的方式在本地已注册, 否则返回0 */
+static uint32_t _sio_rpc_reply_codec(struct sio_rpc_server *server, const struct sio_rpc_response *resp, uint32_t len)
+{
+    uint32_t codec = (resp->req_head.reserved >> SIO_RPC_ACCEPT_SHIFT) & SIO_RPC_CODEC_MASK;
+    if (!server->compress_min || len < server->compress_min || !codec || !server->rpc->codecs[codec].compress)
+        return 0;
+    return codec;
 }
 
-static void _sio_rpc_remove_upstream(struct sio_rpc_client *client, struct sio_rpc_upstream *upstream)
+static int _sio_rpc_workers_submit(struct sio_rpc_workers *workers, struct sio_rpc_response *resp)
 {
-    if (upstream->stream) /* 关闭连接, 重置所有排队请求 */
-        _sio_rpc_reset_upstream(upstream);
-    sio_stop_timer(client->rpc->sio, &upstream->timer); /* 关闭定时器 */
-    free(upstream->ip);
-    shash_free(upstream->req_status);
-    free(upstream);
+    pthread_mutex_lock(&workers->lock);
+    if (workers->queue_len >= workers->queue_limit) {
+        pthread_mutex_unlock(&workers->lock);
+        return -1;
+    }
+    resp->next = NULL;
+    if (workers->queue_tail)
+        workers->queue_tail->next = resp;
+    else
+        workers->queue_head = resp;
+    workers->queue_tail = resp;
+    ++workers->queue_len;
+    pthread_cond_signal(&workers->cond);
+    pthread_mutex_unlock(&workers->lock);
+    return 0;
 }
 
-void sio_rpc_remove_upstream(struct sio_rpc_client *client, const char *ip, uint16_t port)
+/* 可在任意线程调用: 应答拷贝后CAS压入完成栈, 栈由空变为非空时通知sio_run线程 */
+static void _sio_rpc_workers_complete(struct sio_rpc_workers *workers, struct sio_rpc_response *resp, const char *body, uint32_t len)
 {
-    struct sio_rpc_upstream *upstream = NULL;
+    /* 压缩在工作线程中完成, 代替拷贝 */
+    resp->reply = NULL;
+    resp->reply_codec = _sio_rpc_reply_codec(workers->server, resp, len);
+    if (resp->reply_codec)
+        resp->reply = _sio_rpc_compress(&workers->server->rpc->codecs[resp->reply_codec], resp->dict, body, len, &resp->reply_len);
+    if (!resp->reply) {
+        resp->reply_codec = 0;
+        resp->reply_len = len;
+        if (len) {
+            resp->reply = malloc(len);
+            memcpy(resp->reply, body, len);
+        }
+    }
 
-    uint32_t i;
-    for (i = 0; i < client->upstream_count; ++i) {
-        if (strcmp(client->upstreams[i]->ip, ip) == 0 && client->upstreams[i]->port == port) {
-            upstream = client->upstreams[i];
+    struct sio_rpc_response *head = NULL, *prev;
+    for (;;) {
+        resp->next = head;
+        prev = __sync_val_compare_and_swap(&workers->done, head, resp);
+        if (prev == head)
             break;
-        }
+        head = prev; /* 栈顶已被其他线程改变, 以新栈顶重试 */
     }
-    if (!upstream)
-        return;
-    if (i != client->upstream_count - 1)
-        client->upstreams[i] = client->upstreams[client->upstream_count - 1]; /* 最后一个upstream往前放 */
-    client->upstream_count--;
-    _sio_rpc_remove_upstream(client, upstream);
+    if (!head)
+        while (write(workers->notify_pipe[1], "", 1) == -1 && errno == EINTR);
 }
 
-static struct sio_rpc_upstream *_sio_rpc_choose_upstream(struct sio_rpc_client *client)
+/* 工作线程: 依次取出请求执行方法, 方法中或之后的sio_rpc_finish把应答压入完成栈 */
+static void *_sio_rpc_worker_main(void *arg)
 {
-    uint64_t min_pending = ~0;
-    struct sio_rpc_upstream *upstream = NULL;
+    struct sio_rpc_workers *workers = arg;
 
-    client->rr_stream++;
-    
-    uint32_t i;
-    for (i = 0; i < client->upstream_count; ++i) {
-        uint32_t idx = (client->rr_stream + i) % client->upstream_count;
-        if (client->upstreams[idx]->stream) {
-            uint64_t pending = shash_size(client->upstreams[idx]->req_status);
-            if (pending <= min_pending) {
-                min_pending = pending;
-                upstream = client->upstreams[idx];
-            }
+    pthread_mutex_lock(&workers->lock);
+    for (;;) {
+        while (!workers->quit && !workers->queue_head)
+            pthread_cond_wait(&workers->cond, &workers->lock);
+        if (workers->quit) /* 未执行的请求由sio_rpc_server_free回收 */
+            break;
+        struct sio_rpc_response *resp = workers->queue_head;
+        workers->queue_head = resp->next;
+        if (!workers->queue_head)
+            workers->queue_tail = NULL;
+        --workers->queue_len;
+        pthread_mutex_unlock(&workers->lock);
+
+        if (sio_rpc_cancelled(resp)) { /* 客户端已经放弃, 不再执行也不应答 */
+            _sio_rpc_workers_complete(workers, resp, NULL, 0);
+        } else if (resp->deadline_us && _sio_rpc_cur_time_us() > resp->deadline_us) { /* 排队超过截止时间, 不再执行 */
+            resp->rejected = 1;
+            _sio_rpc_workers_complete(workers, resp, NULL, 0);
+        } else {
+            resp->cb(workers->server, resp, resp->arg);
         }
+
+        pthread_mutex_lock(&workers->lock);
     }
-    if (upstream)
-        return upstream;
-    if (!client->upstream_count)
-        return NULL;
-    upstream = client->upstreams[client->rr_stream % client->upstream_count];
-    if (_sio_rpc_upstream_connect(client->rpc->sio, upstream) == -1)
-        return NULL;
-    return upstream;
+    pthread_mutex_unlock(&workers->lock);
+    return NULL;
 }
 
-static void _sio_rpc_free_call(struct sio_rpc_request *req)
+/* 取走完成栈中的所有应答, 按完成顺序发送 */
+static void _sio_rpc_workers_dispatch(struct sio_rpc_workers *workers)
 {
-    assert(shash_erase(req->client->req_record, (const char *)&req, sizeof(req)) == 0);
-    free(req->body);
-    free(req);
+    struct sio_rpc_response *stack = __sync_lock_test_and_set(&workers->done, NULL);
+    struct sio_rpc_response *queue = NULL;
+    while (stack) { /* 完成栈是后进先出的, 反转为先进先出 */
+        struct sio_rpc_response *next = stack->next;
+        stack->next = queue;
+        queue = stack;
+        stack = next;
+    }
+    while (queue) {
+        struct sio_rpc_response *resp = queue;
+        queue = resp->next;
+        char *reply = resp->reply;
+        resp->offloaded = 0;
+        sio_rpc_finish(resp, reply, resp->reply_len);
+        free(reply);
+    }
 }
 
-static int _sio_rpc_call(struct sio_rpc_upstream *upstream, struct sio_rpc_request *req);
+static void _sio_rpc_workers_notify(struct sio *sio, struct sio_fd *sfd, int fd, enum sio_event event, void *arg)
+{
+    /* 先清空管道再取完成栈, 之后的完成会发现栈为空而重新通知 */
+    char buffer[1024];
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+    _sio_rpc_workers_dispatch(arg);
+}
 
-/* rpc call 超时 */
-static void _sio_rpc_call_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+static void _sio_rpc_workers_free(struct sio_rpc_workers *workers)
 {
-    struct sio_rpc_request *req = arg;
+    struct sio *sio = workers->server->rpc->sio;
 
-    if (req->upstream) { /* call已送出, 取消call */
-        assert(shash_erase(req->upstream->req_status, (const char *)&req->id, sizeof(req->id)) == 0);
-        req->upstream = NULL;
-    }
-    /* call超过重试限制, 回调用户 */
-    if (req->retry_count++ >= req->retry_times) {
-        req->cb(req->client, 1, NULL, 0, req->arg);
-        _sio_rpc_free_call(req);
-    } else { /* 重新选择upstream, 发起call重试 */
-        sio_start_timer(req->client->rpc->sio, &req->timer, req->timeout, _sio_rpc_call_timer, req);
-        req->upstream = _sio_rpc_choose_upstream(req->client);
-        if (req->upstream && _sio_rpc_call(req->upstream, req) == -1)
-            req->upstream = NULL; /* 重试call失败, 等待请求超时 */
+    pthread_mutex_lock(&workers->lock);
+    workers->quit = 1;
+    pthread_cond_broadcast(&workers->cond);
+    pthread_mutex_unlock(&workers->lock);
+    uint32_t i;
+    for (i = 0; i < workers->thread_count; ++i) /* 等待正在执行的方法返回 */
+        pthread_join(workers->threads[i], NULL);
+
+    while (workers->queue_head) { /* 尚未执行的请求直接丢弃 */
+        struct sio_rpc_response *resp = workers->queue_head;
+        workers->queue_head = resp->next;
+        _sio_rpc_untrack(_sio_rpc_find_dstream(workers->server, resp->conn_id), resp);
+        free(resp->request);
+        free(resp);
     }
+    _sio_rpc_workers_dispatch(workers);
+
+    sio_del(sio, workers->notify_sfd);
+    close(workers->notify_pipe[0]);
+    close(workers->notify_pipe[1]);
+    pthread_mutex_destroy(&workers->lock);
+    pthread_cond_destroy(&workers->cond);
+    free(workers->threads);
+    free(workers);
 }
 
-static void _sio_rpc_reset_upstream(struct sio_rpc_upstream *upstream)
+static void _sio_rpc_finish(struct sio_rpc_response *resp)
 {
-    /* 关闭连接, 等待定时器检测发起重连 */
-    struct sio *sio = upstream->client->rpc->sio;
-    sio_stream_close(sio, upstream->stream);
-    upstream->stream = NULL;
-    upstream->req_id = 0;
-
-    time_t now = time(NULL);
-    time_t conn_life = now > upstream->last_conn_time ? now - upstream->last_conn_time : 0;
-    if (conn_life < 5) /* 连接存活不超过5秒, 增加惩罚时间 */
-        upstream->conn_delay = upstream->conn_delay >= 256 ? 256 : upstream->conn_delay * 2;
-    else
-        upstream->conn_delay = 1;
-
-    /* 重置所有等待应答的请求的upstream为NULL, 等待超时后重新调度到其他upstream */
-    shash_begin_iterate(upstream->req_status);
-    const char *key;
-    void *value;
-    while (shash_iterate(upstream->req_status, &key, NULL, &value) != -1) {
-        struct sio_rpc_request *req = value;
-        req->upstream = NULL;
-        assert(shash_erase(upstream->req_status, (const char *)&req->id, sizeof(req->id)) == 0);
+    if (resp->in_callback) { /* 方法回调中finish, 回调返回后由调用者回收 */
+        resp->finished = 1;
+        return;
     }
-    shash_end_iterate(upstream->req_status);
+    if (!resp->borrowed)
+        free(resp->request);
+    free(resp);
 }
 
-static int _sio_rpc_call(struct sio_rpc_upstream *upstream, struct sio_rpc_request *req)
+/* 写缓冲区为空时从延后队列按帧移入, 直到缓冲区有积压或队列为空, 之后由DRAINED事件继续 */
+static int _sio_rpc_dstream_drain(struct sio_rpc_dstream *dstream)
 {
-    struct sio *sio = upstream->client->rpc->sio;
-    struct sio_stream *stream = upstream->stream;
-
-    req->id = upstream->req_id++;
-
-    struct shead shead;
-    shead.id = req->id;
-    shead.type = req->type;
-    shead.reserved = 0;
-    shead.body_len = req->bodylen;
-
-    char head[SHEAD_ENCODE_SIZE];
-    assert(shead_encode(&shead, head, sizeof(head)) == 0);
-
-    int sent_head = sio_stream_write(sio, stream, head, sizeof(head));
-    int sent_body = sio_stream_write(sio, stream, req->body, req->bodylen);
-    if (sent_head == 0 && sent_body == 0) { /* call成功发出, 记录状态, 等待应答或者超时 */
-        assert(shash_insert(upstream->req_status, (const char *)&req->id, sizeof(req->id), req) == 0);
-        return 0;
+    struct sio_rpc_server *server = dstream->server;
+    uint64_t size, lens_size;
+    char *data = sio_buffer_data(dstream->deferred, &size);
+    while (size && !sio_stream_pending(dstream->stream)) {
+        const char *lens = sio_buffer_data(dstream->deferred_lens, &lens_size);
+        uint64_t moved = 0, frames = 0;
+        while (moved < size && moved < SIO_RPC_DEFER_BATCH) {
+            uint64_t frame_len;
+            memcpy(&frame_len, lens + frames * sizeof(frame_len), sizeof(frame_len));
+            moved += frame_len;
+            ++frames;
+        }
+        if (sio_stream_write(server->rpc->sio, dstream->stream, data, moved) == -1)
+            return -1;
+        sio_buffer_erase(dstream->deferred, moved);
+        sio_buffer_erase(dstream->deferred_lens, frames * sizeof(uint64_t));
+        server->deferred_count -= frames;
+        data = sio_buffer_data(dstream->deferred, &size);
     }
-    /* call发送失败, 重置upstream, 等待超时 */
-    _sio_rpc_reset_upstream(upstream);
-    return -1;
+    sio_stream_notify_drain(dstream->stream, size != 0);
+    return 0;
 }
 
-/* 发起远程调用, 消息类型type, 请求超时timeout_ms, 重试次数retry_times, 请求request, 请求长度size, 结果回调cb, 回调参数arg */
-void sio_rpc_call(struct sio_rpc_client *client, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
-        const char *request, uint32_t size, sio_rpc_upstream_callback_t cb, void *arg)
+/* 小应答和紧急应答直接写入连接; 大应答在连接有积压时进入延后队列, 不阻塞之后的小应答 */
+static int _sio_rpc_dstream_send(struct sio_rpc_dstream *dstream, const struct shead *resp_head, const char *body, char urgent)
 {
-    struct sio_rpc_upstream *upstream = _sio_rpc_choose_upstream(client);
-
-    struct sio_rpc_request *req = malloc(sizeof(*req));
-    req->timeout = timeout_ms;
-    req->retry_times = retry_times;
-    req->retry_count = 0;
-    req->type = type;
-    req->body = malloc(size);
-    req->bodylen = size;
-    memcpy(req->body, request, size);
-    req->cb = cb;
-    req->arg = arg;
-    req->client = client;
-    req->upstream = upstream;
-    sio_start_timer(client->rpc->sio, &req->timer, timeout_ms, _sio_rpc_call_timer, req);
-    assert(shash_insert(client->req_record, (const char *)&req, sizeof(req), NULL) == 0);
-
-    if (!req->upstream)
-        return; /* 无可用连接, 等待请求超时 */
-    if (_sio_rpc_call(upstream, req) == -1)
-        req->upstream = NULL; /* call失败, 等待请求超时 */
+    struct sio_rpc_server *server = dstream->server;
+    char head[SHEAD_COMPACT_MAX_SIZE];
+    uint32_t head_len = _sio_rpc_head_encode(resp_head, dstream->compact, head);
+
+    char defer = !urgent && server->small_resp && resp_head->body_len > server->small_resp
+        && ((dstream->deferred && sio_buffer_length(dstream->deferred)) || sio_stream_pending(dstream->stream));
+    if (!defer) {
+        int sent_head = sio_stream_write(server->rpc->sio, dstream->stream, head, head_len);
+        int sent_body = sio_stream_write(server->rpc->sio, dstream->stream, body, resp_head->body_len);
+        return (sent_head != 0 || sent_body != 0) ? -1 : 0;
+    }
+    if (!dstream->deferred) {
+        dstream->deferred = sio_buffer_new();
+        dstream->deferred_lens = sio_buffer_new();
+    }
+    uint64_t frame_len = head_len + resp_head->body_len;
+    sio_buffer_append(dstream->deferred, head, head_len);
+    sio_buffer_append(dstream->deferred, body, resp_head->body_len);
+    sio_buffer_append(dstream->deferred_lens, (const char *)&frame_len, sizeof(frame_len));
+    ++server->deferred_count;
+    sio_stream_notify_drain(dstream->stream, 1);
+    return 0;
 }
 
-static void _sio_rpc_dstream_callback(struct sio *sio, struct sio_stream *stream, enum sio_stream_event event, void *arg);
-static void _sio_rpc_dstream_free(struct sio_rpc_dstream *dstream);
-
-static void _sio_rpc_dstream_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+void sio_rpc_finish(struct sio_rpc_response *resp, const char *body, uint32_t len)
 {
-    struct sio_rpc_dstream *dstream = arg;
+    struct sio_rpc_server *server = resp->server;
 
-    sio_start_timer(sio, &dstream->timer, 1000, _sio_rpc_dstream_timer, dstream);
+    if (resp->offloaded) { /* 工作线程中不能访问连接, 交回sio_run线程发送 */
+        _sio_rpc_workers_complete(server->workers, resp, body, len);
+        return;
+    }
 
-    /* 检查stream的读写缓冲区pending, 过长则断开连接 */
-    if (sio_stream_pending(dstream->stream) >= dstream->server->rpc->max_pending
-            || sio_buffer_length(sio_stream_buffer(dstream->stream)) >= dstream->server->rpc->max_pending)
-        _sio_rpc_dstream_free(dstream);
+    struct sio_rpc_method *method = resp->limited ? _sio_rpc_find_method(server, resp->req_head.type) : NULL;
+    if (method && method->inflight) /* 方法可能被移除后重新注册 */
+        --method->inflight;
+    if (resp->rejected)
+        ++server->shed_count;
+
+    struct sio_rpc_dstream *dstream = _sio_rpc_find_dstream(server, resp->conn_id);
+    _sio_rpc_untrack(dstream, resp);
+    if (dstream && !resp->cancelled) { /* 已取消的请求客户端不再等待应答 */
+        struct shead resp_head;
+        memcpy(&resp_head, &resp->req_head, sizeof(resp_head));
+        resp_head.reserved = resp->rejected ? SIO_RPC_FRAME_OVERLOADED : 0;
+
+        char *packed = NULL;
+        uint32_t codec = resp->reply_codec; /* 工作线程中已经压缩 */
+        if (!codec && (codec = _sio_rpc_reply_codec(server, resp, len))) {
+            packed = _sio_rpc_compress(&server->rpc->codecs[codec], _sio_rpc_find_dict(server->rpc, resp->req_head.type),
+                    body, len, &len);
+            if (packed)
+                body = packed;
+            else
+                codec = 0;
+        }
+        resp_head.reserved |= codec << SIO_RPC_CODEC_SHIFT;
+        resp_head.body_len = len;
+
+        char urgent = 0;
+        if (server->small_resp && len > server->small_resp) {
+            if (!method)
+                method = _sio_rpc_find_method(server, resp->req_head.type);
+            urgent = method && method->urgent;
+        }
+        if (_sio_rpc_dstream_send(dstream, &resp_head, body, urgent) == -1) { /* response发送失败, 关闭连接 */
+            _sio_rpc_dstream_free(dstream);
+        }
+        free(packed);
+    }
+    _sio_rpc_finish(resp);
 }
 
-static void _sio_rpc_dstream_accept(struct sio_rpc_server *server, struct sio *sio, struct sio_stream *stream)
+char *sio_rpc_request(struct sio_rpc_response *resp, uint32_t *len)
 {
-    struct sio_rpc_dstream *dstream = malloc(sizeof(*dstream));
-    dstream->id = server->conn_id++;
-    dstream->server = server;
-    dstream->stream = stream;
-    assert(shash_insert(server->dstreams, (const char *)&dstream->id, sizeof(dstream->id), dstream) == 0);
-    sio_stream_set(sio, stream, _sio_rpc_dstream_callback, dstream);
-    sio_start_timer(sio, &dstream->timer, 1000, _sio_rpc_dstream_timer, dstream);
+    if (len)
+        *len = resp->req_head.body_len;
+    return resp->request;
 }
 
-static void _sio_rpc_finish(struct sio_rpc_response *resp)
+uint64_t sio_rpc_remaining_ms(const struct sio_rpc_response *resp)
 {
-	free(resp->request);
-	free(resp);
+    if (!resp->deadline_us)
+        return SIO_RPC_NO_DEADLINE;
+    uint64_t now = _sio_rpc_cur_time_us();
+    return now < resp->deadline_us ? (resp->deadline_us - now) / 1000 : 0;
 }
 
-void sio_rpc_finish(struct sio_rpc_response *resp, const char *body, uint32_t len)
+char sio_rpc_cancelled(const struct sio_rpc_response *resp)
 {
-	struct sio_rpc_server *server = resp->server;
-
-	void *value;
-	if (shash_find(server->dstreams, (const char *)&resp->conn_id, sizeof(resp->conn_id), &value) == 0) {
-		struct sio_rpc_dstream *dstream = value;
-
-		struct shead resp_head;
-		memcpy(&resp_head, &resp->req_head, sizeof(resp_head));
-		resp_head.body_len = len;
-
-		char head[SHEAD_ENCODE_SIZE];
-		assert(shead_encode(&resp_head, head, sizeof(head)) == 0);
+    return __sync_fetch_and_or(&((struct sio_rpc_response *)resp)->cancelled, 0);
+}
 
-		int sent_head = sio_stream_write(server->rpc->sio, dstream->stream, head, sizeof(head));
-		int sent_body = sio_stream_write(server->rpc->sio, dstream->stream, body, len);
-		if (sent_head != 0 && sent_body != 0) { /* response发送失败, 关闭连接 */
-			_sio_rpc_dstream_free(dstream);
-		}
-	}
-	_sio_rpc_finish(resp);
+/* 客户端放弃了请求: 尚未执行的请求被丢弃, 执行中的请求finish时不再应答 */
+static void _sio_rpc_dstream_cancel(struct sio_rpc_dstream *dstream, const struct shead *head)
+{
+    void *value;
+    if (dstream->pending && shash_find(dstream->pending, (const char *)&head->id, sizeof(head->id), &value) == 0)
+        __sync_lock_test_and_set(&((struct sio_rpc_response *)value)->cancelled, 1); /* 工作线程可能正在读 */
 }
 
-char *sio_rpc_request(struct sio_rpc_response *resp, uint32_t *len)
+/* 以过载应答拒绝请求, 请求不会被执行 */
+static void _sio_rpc_dstream_reject(struct sio_rpc_dstream *dstream, const struct shead *head)
 {
-	if (len)
-		*len = resp->req_head.body_len;
-	return resp->request;
+    struct sio_rpc_server *server = dstream->server;
+    ++server->shed_count;
+    if (_sio_rpc_frame_write(server->rpc->sio, dstream->stream, dstream->compact, head->id, head->type,
+                SIO_RPC_FRAME_OVERLOADED, NULL, 0) == -1)
+        _sio_rpc_dstream_free(dstream);
 }
 
 static void _sio_rpc_dstream_handle_request(struct sio_rpc_dstream *dstream, const struct shead *head, const char *req)
 {
-	void *value;
-	if (shash_find(dstream->server->methods, (const char *)&head->type, sizeof(head->type), &value) == -1)
-		return;
+    struct sio_rpc_method *method = _sio_rpc_find_method(dstream->server, head->type);
+    if (!method || !method->cb)
+        return; /* 流式方法不接受普通调用 */
+
+    if (method->max_inflight && method->inflight >= method->max_inflight) { /* 达到并发上限, 不排队直接拒绝 */
+        _sio_rpc_dstream_reject(dstream, head);
+        return;
+    }
+    uint64_t budget_ms = head->reserved >> SIO_RPC_BUDGET_SHIFT;
+    uint64_t deadline_us = budget_ms ? dstream->read_us + budget_ms * 1000 : 0;
+    struct sio_rpc_workers *workers = method->dispatch == SIO_RPC_DISPATCH_WORKER ? dstream->server->workers : NULL;
+    /* 同一批输入中排在前面的请求耗时过长, 客户端已经不再等待 */
+    if (!workers && deadline_us && _sio_rpc_cur_time_us() > deadline_us) {
+        _sio_rpc_dstream_reject(dstream, head);
+        return;
+    }
+
+    struct sio_rpc_server *server = dstream->server;
+    struct sio_rpc_response *resp = server->spare_resp;
+    if (resp)
+        server->spare_resp = NULL;
+    else
+        resp = malloc(sizeof(*resp));
+    resp->conn_id = dstream->id;
+    resp->server = server;
+    memcpy(&resp->req_head, head, sizeof(*head));
+    resp->borrowed = server->borrow && !workers;
+    resp->offloaded = 0;
+    resp->rejected = 0;
+    resp->limited = method->max_inflight != 0;
+    resp->deadline_us = deadline_us;
+    resp->cancelled = 0;
+    resp->tracked = 0;
+    resp->reply_codec = 0;
+    if (resp->borrowed) { /* 输入缓冲区在解析结束前不会移动或释放 */
+        resp->request = (char *)req;
+    } else {
+        resp->request = malloc(head->body_len);
+        memcpy(resp->request, req, head->body_len);
+    }
+    if (workers) {
+        resp->in_callback = 0;
+        resp->offloaded = 1;
+        resp->cb = method->cb;
+        resp->arg = method->arg;
+        resp->dict = _sio_rpc_find_dict(server->rpc, head->type);
+        _sio_rpc_track(dstream, resp);
+        if (_sio_rpc_workers_submit(workers, resp) == 0) {
+            method->inflight += resp->limited;
+            return;
+        }
+        _sio_rpc_untrack(dstream, resp);
+        free(resp->request); /* 工作队列已满, 拒绝而不是阻塞sio_run线程 */
+        free(resp);
+        _sio_rpc_dstream_reject(dstream, head);
+        return;
+    }
+    method->inflight += resp->limited;
+    resp->in_callback = 1;
+    resp->finished = 0;
+
+    method->cb(server, resp, method->arg);
+
+    resp->in_callback = 0;
+    if (resp->finished) { /* 同步处理完成, 复用response */
+        if (!resp->borrowed)
+            free(resp->request);
+        if (!server->spare_resp)
+            server->spare_resp = resp;
+        else
+            free(resp);
+    } else {
+        if (resp->borrowed) { /* 推迟finish, 此时才拷贝body */
+            resp->request = malloc(head->body_len);
+            memcpy(resp->request, req, head->body_len);
+            resp->borrowed = 0;
+        }
+        if (!dstream->closed)
+            _sio_rpc_track(dstream, resp);
+        else /* 回调中连接被释放 */
+            resp->cancelled = 1;
+    }
+}
 
-	struct sio_rpc_method *method = value;
+static void _sio_rpc_dstream_handle_stream(struct sio_rpc_dstream *dstream, const struct shead *head, const char *body)
+{
+    struct sio_rpc_server *server = dstream->server;
 
-	struct sio_rpc_response *resp = malloc(sizeof(*resp));
-	resp->conn_id = dstream->id;
-	resp->server = dstream->server;
-	memcpy(&resp->req_head, head, sizeof(*head));
-	resp->request = malloc(head->body_len);
-	memcpy(resp->request, req, head->body_len);
+    void *value;
+    if (dstream->streams && shash_find(dstream->streams, (const char *)&head->id, sizeof(head->id), &value) == 0) {
+        _sio_rpc_stream_input(value, head, body);
+        return;
+    }
+    /* 流已经结束或被取消, 客户端在途的帧直接丢弃, 不能当作新流 */
+    if (!(head->reserved & SIO_RPC_FRAME_OPEN))
+        return;
+    struct sio_rpc_method *method = _sio_rpc_find_method(server, head->type);
+    if (!method || !method->stream_cb) { /* 没有对应的流式方法, 取消客户端的流 */
+        if (_sio_rpc_frame_write(server->rpc->sio, dstream->stream, dstream->compact, head->id, head->type,
+                    SIO_RPC_FRAME_STREAM | SIO_RPC_FRAME_CANCEL, NULL, 0) == -1)
+            _sio_rpc_dstream_free(dstream);
+        return;
+    }
 
-	method->cb(dstream->server, resp, method->arg);
+    struct sio_rpc_stream *stream = calloc(1, sizeof(*stream));
+    stream->id = head->id;
+    stream->type = head->type;
+    stream->rpc = server->rpc;
+    stream->dstream = dstream;
+    stream->send_credit = SIO_RPC_STREAM_WINDOW;
+    stream->cb = method->stream_cb;
+    stream->arg = method->arg;
+    if (!dstream->streams)
+        dstream->streams = shash_new();
+    assert(shash_insert(dstream->streams, (const char *)&stream->id, sizeof(stream->id), stream) == 0);
+
+    ++stream->busy;
+    _sio_rpc_stream_notify(stream, SIO_RPC_STREAM_OPEN, NULL, 0);
+    if (_sio_rpc_stream_leave(stream) == 0)
+        _sio_rpc_stream_input(stream, head, body); /* 打开流的帧也可能携带数据或结束 */
 }
 
 static int _sio_rpc_dstream_parse_request(struct sio_rpc_dstream *dstream)
@@ -444,26 +2335,85 @@ static int _sio_rpc_dstream_parse_request(struct sio_rpc_dstream *dstream)
     char *data= sio_buffer_data(input, &size);
 
     uint64_t used = 0;
-    while (used < size) {
-      uint64_t left = size - used;
-      if (left < SHEAD_ENCODE_SIZE)
-          break; /* header不完整 */
-      struct shead head;
-      if (shead_decode(&head, data + used, SHEAD_ENCODE_SIZE) == -1)
-          return -1; /* header不合法 */
-      if (left - SHEAD_ENCODE_SIZE < head.body_len)
-          break; /* body不完整 */
-      _sio_rpc_dstream_handle_request(dstream, &head, data + used + SHEAD_ENCODE_SIZE);
-      used += SHEAD_ENCODE_SIZE + head.body_len;
+    int err = 0;
+    struct shead_frame frames[SIO_RPC_SCAN_BATCH];
+    int count = 0, next = 0;
+    dstream->read_us = _sio_rpc_cur_time_us();
+    dstream->parsing = 1;
+    while (!dstream->closed) { /* 回调中连接被释放则停止解析 */
+      if (next == count) { /* 一批帧处理完, 扫描之后的完整帧 */
+          count = shead_scan(data + used, size - used, dstream->compact != SIO_RPC_COMPACT_OFF, frames, SIO_RPC_SCAN_BATCH, NULL);
+          next = 0;
+          if (count == -1) {
+              err = -1; /* header不合法 */
+              break;
+          }
+          if (!count)
+              break; /* header或body不完整 */
+      }
+      struct shead head = frames[next].head;
+      uint32_t head_len = frames[next++].head_len;
+      if (head.reserved & SIO_RPC_FRAME_COMPACT)
+          dstream->compact = SIO_RPC_COMPACT_ON; /* 接受客户端的提议, 之后的应答使用紧凑格式, 客户端收到后改用紧凑格式 */
+      uint64_t frame_len = head_len + head.body_len; /* 解压会修改head.body_len */
+      if (head.reserved & SIO_RPC_FRAME_STREAM) {
+          _sio_rpc_dstream_handle_stream(dstream, &head, data + used + head_len);
+      } else if (head.reserved & SIO_RPC_FRAME_CANCEL) {
+          _sio_rpc_dstream_cancel(dstream, &head);
+      } else if ((head.reserved >> SIO_RPC_CODEC_SHIFT) & SIO_RPC_CODEC_MASK) {
+          char *plain = _sio_rpc_decompress(dstream->server->rpc, &head, data + used + head_len);
+          if (!plain) {
+              err = -1; /* 未注册的压缩方式或数据不合法 */
+              break;
+          }
+          /* 解压缓冲区与输入缓冲区一样可以在回调中借用 */
+          _sio_rpc_dstream_handle_request(dstream, &head, plain);
+          free(plain);
+      } else {
+          _sio_rpc_dstream_handle_request(dstream, &head, data + used + head_len);
+      }
+      used += frame_len;
+    }
+    dstream->parsing = 0;
+    if (dstream->closed) { /* 解析期间连接被释放, 此时才能释放输入缓冲区 */
+        _sio_rpc_dstream_free(dstream);
+        return 0;
     }
     sio_buffer_erase(input, used);
-    return 0;
+    return err;
 }
 
 static void _sio_rpc_dstream_free(struct sio_rpc_dstream *dstream)
 {
 	struct sio_rpc_server *server = dstream->server;
-	assert(shash_erase(server->dstreams, (const char *)&dstream->id, sizeof(dstream->id)) == 0);
+    if (!dstream->closed) {
+        dstream->closed = 1;
+        _sio_rpc_erase_dstream(server, dstream);
+        if (dstream->pending) { /* 应答无法送达, 未finish的请求视为取消 */
+            void *value;
+            shash_begin_iterate(dstream->pending);
+            while (shash_iterate(dstream->pending, NULL, NULL, &value) != -1)
+                __sync_lock_test_and_set(&((struct sio_rpc_response *)value)->cancelled, 1);
+            shash_end_iterate(dstream->pending);
+            shash_free(dstream->pending);
+            dstream->pending = NULL;
+        }
+        if (dstream->deferred) { /* 延后的应答随连接丢弃 */
+            server->deferred_count -= sio_buffer_length(dstream->deferred_lens) / sizeof(uint64_t);
+            sio_buffer_free(dstream->deferred);
+            sio_buffer_free(dstream->deferred_lens);
+            dstream->deferred = NULL;
+            dstream->deferred_lens = NULL;
+        }
+        /* 连接上的流无法继续, 以ERROR通知用户 */
+        if (dstream->streams) {
+            struct shash *streams = dstream->streams;
+            dstream->streams = NULL;
+            _sio_rpc_stream_fail_all(streams);
+        }
+    }
+    if (dstream->parsing) /* 正在解析该连接的输入, 解析结束后再释放 */
+        return;
     sio_stream_close(server->rpc->sio, dstream->stream);
     sio_stop_timer(server->rpc->sio, &dstream->timer);
     free(dstream);
@@ -479,6 +2429,9 @@ static void _sio_rpc_dstream_callback(struct sio *sio, struct sio_stream *stream
     case SIO_STREAM_DATA:
         err = _sio_rpc_dstream_parse_request(arg);
         break;
+    case SIO_STREAM_DRAINED:
+        err = _sio_rpc_dstream_drain(arg);
+        break;
     case SIO_STREAM_ERROR:
     case SIO_STREAM_CLOSE:
         _sio_rpc_dstream_free(arg);
@@ -492,7 +2445,7 @@ static void _sio_rpc_dstream_callback(struct sio *sio, struct sio_stream *stream
 
 struct sio_rpc_server *sio_rpc_server_new(struct sio_rpc *rpc, const char *ip, uint16_t port)
 {
-    struct sio_stream *stream = sio_stream_listen(rpc->sio, ip, port, _sio_rpc_dstream_callback, NULL);
+    struct sio_stream *stream = sio_stream_listen_profile(rpc->sio, ip, port, &rpc->profile, _sio_rpc_dstream_callback, NULL);
     if (!stream)
         return NULL;
 
@@ -500,53 +2453,186 @@ struct sio_rpc_server *sio_rpc_server_new(struct sio_rpc *rpc, const char *ip, u
     server->conn_id = 0;
     server->rpc = rpc;
     server->stream = stream;
-    server->dstreams = shash_new();
+    server->dstream_slots = NULL;
+    server->slot_count = 0;
+    server->free_slots = NULL;
+    server->free_count = 0;
+    server->method_table = NULL;
+    server->method_table_size = 0;
     server->methods = shash_new();
+    server->borrow = 0;
+    server->spare_resp = NULL;
+    server->workers = NULL;
+    server->shed_count = 0;
+    server->small_resp = 0;
+    server->deferred_count = 0;
+    server->compress_min = 0;
     sio_stream_set(rpc->sio, stream, _sio_rpc_dstream_callback, server);
     return server;
 }
 
 void sio_rpc_server_free(struct sio_rpc_server *server)
 {
-    const char *key;
     void *value;
 
+    if (server->workers) /* 先停止工作线程, 已完成的应答尽量发出 */
+        _sio_rpc_workers_free(server->workers);
+
+    uint32_t i;
+    for (i = 0; i < server->method_table_size; ++i)
+        free(server->method_table[i]);
     shash_begin_iterate(server->methods);
-    while (shash_iterate(server->methods, &key, NULL, &value) != -1) {
+    while (shash_iterate(server->methods, NULL, NULL, &value) != -1) {
         struct sio_rpc_method *method = value;
         free(method);
     }
     shash_end_iterate(server->methods);
 
-    shash_begin_iterate(server->dstreams);
-    while (shash_iterate(server->dstreams, &key, NULL, &value) != -1) {
-        struct sio_rpc_dstream *dstream = value;
-        _sio_rpc_dstream_free(dstream);
+    for (i = 0; i < server->slot_count; ++i) {
+        if (server->dstream_slots[i])
+            _sio_rpc_dstream_free(server->dstream_slots[i]);
     }
-    shash_end_iterate(server->dstreams);
 
     shash_free(server->methods);
-    shash_free(server->dstreams);
+    free(server->method_table);
+    free(server->dstream_slots);
+    free(server->free_slots);
     sio_stream_close(server->rpc->sio, server->stream);
+    free(server->spare_resp);
     free(server);
 }
 
+void sio_rpc_server_set_borrow(struct sio_rpc_server *server, char enable)
+{
+    server->borrow = enable;
+}
+
+int sio_rpc_server_set_workers(struct sio_rpc_server *server, uint32_t threads, uint32_t queue_limit)
+{
+    if (server->workers || !threads)
+        return -1;
+
+    struct sio_rpc_workers *workers = calloc(1, sizeof(*workers));
+    workers->server = server;
+    workers->queue_limit = queue_limit;
+    if (pipe(workers->notify_pipe) == -1) {
+        free(workers);
+        return -1;
+    }
+    fcntl(workers->notify_pipe[0], F_SETFL, fcntl(workers->notify_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(workers->notify_pipe[1], F_SETFL, fcntl(workers->notify_pipe[1], F_GETFL) | O_NONBLOCK);
+    workers->notify_sfd = sio_add(server->rpc->sio, workers->notify_pipe[0], _sio_rpc_workers_notify, workers);
+    if (!workers->notify_sfd) {
+        close(workers->notify_pipe[0]);
+        close(workers->notify_pipe[1]);
+        free(workers);
+        return -1;
+    }
+    sio_watch_read(server->rpc->sio, workers->notify_sfd);
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->cond, NULL);
+
+    workers->threads = malloc(threads * sizeof(*workers->threads));
+    for (workers->thread_count = 0; workers->thread_count < threads; ++workers->thread_count) {
+        if (pthread_create(&workers->threads[workers->thread_count], NULL, _sio_rpc_worker_main, workers) != 0) {
+            _sio_rpc_workers_free(workers); /* 只回收已经创建的线程 */
+            return -1;
+        }
+    }
+    server->workers = workers;
+    return 0;
+}
+
+void sio_rpc_server_set_dispatch(struct sio_rpc_server *server, uint32_t type, enum sio_rpc_dispatch dispatch)
+{
+    struct sio_rpc_method *method = _sio_rpc_find_method(server, type);
+    if (method)
+        method->dispatch = dispatch;
+}
+
+void sio_rpc_server_set_concurrency(struct sio_rpc_server *server, uint32_t type, uint32_t max_inflight)
+{
+    struct sio_rpc_method *method = _sio_rpc_find_method(server, type);
+    if (method)
+        method->max_inflight = max_inflight;
+}
+
+void sio_rpc_server_set_priority(struct sio_rpc_server *server, uint32_t small_bytes)
+{
+    server->small_resp = small_bytes;
+}
+
+void sio_rpc_server_set_compress(struct sio_rpc_server *server, uint32_t min_bytes)
+{
+    server->compress_min = min_bytes;
+}
+
+void sio_rpc_server_set_urgent(struct sio_rpc_server *server, uint32_t type, char urgent)
+{
+    struct sio_rpc_method *method = _sio_rpc_find_method(server, type);
+    if (method)
+        method->urgent = urgent;
+}
+
+void sio_rpc_server_queue_depth(struct sio_rpc_server *server, uint32_t *jobs, uint32_t *deferred, uint64_t *bytes)
+{
+    if (jobs) {
+        *jobs = 0;
+        if (server->workers) {
+            pthread_mutex_lock(&server->workers->lock);
+            *jobs = server->workers->queue_len;
+            pthread_mutex_unlock(&server->workers->lock);
+        }
+    }
+    if (deferred)
+        *deferred = server->deferred_count;
+    if (bytes) {
+        *bytes = 0;
+        uint32_t i;
+        for (i = 0; i < server->slot_count; ++i) {
+            struct sio_rpc_dstream *dstream = server->dstream_slots[i];
+            if (!dstream)
+                continue;
+            *bytes += sio_stream_pending(dstream->stream);
+            if (dstream->deferred)
+                *bytes += sio_buffer_length(dstream->deferred);
+        }
+    }
+}
+
 void sio_rpc_server_add_method(struct sio_rpc_server *server, uint32_t type, sio_rpc_dstream_callback_t cb, void *arg)
 {
-    if (shash_find(server->methods, (const char *)&type, sizeof(type), NULL) == 0)
+    if (_sio_rpc_find_method(server, type))
         return;
 
     struct sio_rpc_method *method = malloc(sizeof(*method));
     method->cb = cb;
+    method->stream_cb = NULL;
     method->arg = arg;
-    assert(shash_insert(server->methods, (const char *)&type, sizeof(type), method) == 0);
+    method->dispatch = SIO_RPC_DISPATCH_INLINE;
+    method->max_inflight = 0;
+    method->inflight = 0;
+    method->urgent = 0;
+    assert(_sio_rpc_insert_method(server, type, method) == 0);
 }
 
-void sio_rpc_server_remove_method(struct sio_rpc_server *server, uint32_t type)
+void sio_rpc_server_add_stream_method(struct sio_rpc_server *server, uint32_t type, sio_rpc_stream_callback_t cb, void *arg)
 {
-    void *value;
-    if (shash_find(server->methods, (const char *)&type, sizeof(type), &value) == -1)
+    if (_sio_rpc_find_method(server, type))
         return;
-    struct sio_rpc_method *method = value;
-    free(method);
+
+    struct sio_rpc_method *method = malloc(sizeof(*method));
+    method->cb = NULL;
+    method->stream_cb = cb;
+    method->arg = arg;
+    method->dispatch = SIO_RPC_DISPATCH_INLINE;
+    method->max_inflight = 0;
+    method->inflight = 0;
+    method->urgent = 0;
+    assert(_sio_rpc_insert_method(server, type, method) == 0);
+}
+
+void sio_rpc_server_remove_method(struct sio_rpc_server *server, uint32_t type)
+{
+    free(_sio_rpc_erase_method(server, type));
 }
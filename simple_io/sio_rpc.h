@@ -3,7 +3,9 @@
 
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include "shead.h"
+#include "sio_sockopt.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,37 +13,238 @@ extern "C" {
 
 struct shash;
 struct sio_stream;
+struct sio_buffer;
 struct sio_rpc_upstream;
+struct sio_rpc_conn;
 struct sio_rpc_client;
 struct sio_rpc_dstream;
 struct sio_rpc_server;
 struct sio_rpc_response;
+struct sio_rpc_workers;
+struct sio_rpc_client_mt;
+struct sio_rpc_mt_call;
+struct sio_rpc_stream;
+struct sio_fd;
 
+/* rpc client应答回调的is_timeout取值, 0表示收到应答 */
+#define SIO_RPC_CALL_TIMEOUT 1 /* 超时或client释放 */
+#define SIO_RPC_CALL_OVERLOADED 2 /* 服务端过载拒绝了最后一次重试, 请求未被执行 */
 /* rpc client的应答回调 */
 typedef void (*sio_rpc_upstream_callback_t)(struct sio_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg);
+/* sio_rpc_call_nocopy的请求体释放回调, 请求结束(应答,超时或client释放)后调用 */
+typedef void (*sio_rpc_release_callback_t)(struct sio_rpc_client *client, const char *request, uint32_t size, void *arg);
+/* 多线程rpc client的应答回调, 在sio_run线程或executor中执行 */
+typedef void (*sio_rpc_mt_callback_t)(struct sio_rpc_client_mt *mt, char is_timeout, const char *response, uint32_t size, void *arg);
+/* 多线程rpc client的回调执行器, 在sio_run线程中调用, 负责在任意线程中对call执行sio_rpc_mt_run */
+typedef void (*sio_rpc_executor_t)(struct sio_rpc_mt_call *call, void *arg);
+/* 流式调用的事件 */
+enum sio_rpc_stream_event {
+    SIO_RPC_STREAM_OPEN = 0, /* 服务端: 客户端打开了流 */
+    SIO_RPC_STREAM_DATA = 1, /* 收到对端的一个数据片段, 只在回调期间有效 */
+    SIO_RPC_STREAM_END = 2, /* 对端发送结束, 若本端也已结束则回调后流被释放 */
+    SIO_RPC_STREAM_WRITABLE = 3, /* 对端归还了额度, 之前未写完的数据可以继续写 */
+    SIO_RPC_STREAM_ERROR = 4, /* 超时, 连接断开或对端取消, 回调后流被释放 */
+};
+/* 流式调用的事件回调, 客户端与服务端相同 */
+typedef void (*sio_rpc_stream_callback_t)(struct sio_rpc_stream *stream, enum sio_rpc_stream_event event,
+        const char *data, uint32_t size, void *arg);
+/* 压缩in到out, out_len为out的容量(不超过in_len), 返回压缩后的长度, 结果放不下或压缩失败返回-1.
+ * dict为该请求类型的字典, 没有设置时为NULL. 可能在多个工作线程中同时调用 */
+typedef int64_t (*sio_rpc_compress_t)(const char *in, uint32_t in_len, char *out, uint32_t out_len,
+        const char *dict, uint32_t dict_len, void *arg);
+/* 解压in到out, out_len为压缩前的长度, 必须恰好填满out, 成功返回0, 数据不合法返回-1 */
+typedef int (*sio_rpc_decompress_t)(const char *in, uint32_t in_len, char *out, uint32_t out_len,
+        const char *dict, uint32_t dict_len, void *arg);
 /* rpc server的请求回调 */
 typedef void (*sio_rpc_dstream_callback_t)(struct sio_rpc_server *server, struct sio_rpc_response *resp, void *arg);
 
+/* rpc方法的执行方式 */
+enum sio_rpc_dispatch {
+    SIO_RPC_DISPATCH_INLINE = 0, /* 在sio_run线程中回调(默认) */
+    SIO_RPC_DISPATCH_WORKER = 1, /* 在server的工作线程中回调, 线程池队列满时以过载拒绝 */
+};
+
+/* upstream负载均衡策略 */
+enum sio_rpc_balance {
+    SIO_RPC_BALANCE_LEAST_PENDING = 0, /* 轮转扫描所有upstream, 选择等待应答最少的(默认) */
+    SIO_RPC_BALANCE_P2C = 1, /* 随机选两个upstream, 选择等待应答较少的 */
+    SIO_RPC_BALANCE_EWMA = 2, /* 随机选两个upstream, 选择 延迟EWMA * (等待应答数 + 1) 较小的 */
+    SIO_RPC_BALANCE_WRR = 3, /* 按权重平滑加权轮转 */
+    SIO_RPC_BALANCE_HASH = 4, /* 按sio_rpc_call_hash的key一致性哈希, 其他调用退化为WRR */
+};
+
+/* 连接上header格式的协商状态 */
+enum sio_rpc_compact {
+    SIO_RPC_COMPACT_OFF = 0, /* 只使用定长header */
+    SIO_RPC_COMPACT_OFFER = 1, /* 客户端: 发送带SIO_RPC_FRAME_COMPACT的定长header, 等待服务端以紧凑格式应答 */
+    SIO_RPC_COMPACT_ON = 2, /* 双方已约定, 以紧凑格式发送, 接收时两种格式都接受 */
+};
+
+/* upstream的熔断状态 */
+enum sio_rpc_breaker {
+    SIO_RPC_BREAKER_CLOSED = 0, /* 正常接收请求 */
+    SIO_RPC_BREAKER_OPEN = 1, /* 被摘除, 到期后转为HALF_OPEN */
+    SIO_RPC_BREAKER_HALF_OPEN = 2, /* 只放行一个探测请求, 成功则恢复, 失败则再次摘除 */
+};
+
+/* shead.reserved的低8位为帧标志, 普通调用为0 */
+#define SIO_RPC_FRAME_MASK 0xff
+#define SIO_RPC_FRAME_STREAM 0x01 /* 流式调用的帧, shead.id为流ID */
+#define SIO_RPC_FRAME_END 0x02 /* 发送方向结束, 可以携带最后一个片段 */
+#define SIO_RPC_FRAME_CREDIT 0x04 /* 归还额度, body为4字节网络序的字节数 */
+#define SIO_RPC_FRAME_CANCEL 0x08 /* 取消流, 不带STREAM时为客户端放弃了shead.id的普通调用 */
+#define SIO_RPC_FRAME_OVERLOADED 0x10 /* 普通调用的应答: 服务端过载, 请求未被执行 */
+#define SIO_RPC_FRAME_OPEN 0x20 /* 流的第一帧, 服务端只为带OPEN的帧创建流, 其他未知流ID的帧被丢弃 */
+#define SIO_RPC_FRAME_COMPACT 0x40 /* 客户端提议使用紧凑格式, 只出现在定长header中, 服务端确认前客户端的每一帧都带此标志 */
+/* 普通调用的shead.reserved高16位为发送这一帧时客户端剩余的等待时间(毫秒, 至少1), 服务端超过该时间仍未执行则拒绝, 0表示不限(请求没有超时) */
+#define SIO_RPC_BUDGET_SHIFT 16
+#define SIO_RPC_BUDGET_MAX 0xffff
+/* 普通调用的shead.reserved 8~11位为本帧body的压缩方式, 12~15位为请求方能够解压的应答压缩方式, 0表示不压缩.
+ * 压缩的body以4字节网络序的原始长度开头, 之后是压缩数据 */
+#define SIO_RPC_CODEC_SHIFT 8
+#define SIO_RPC_ACCEPT_SHIFT 12
+#define SIO_RPC_CODEC_MASK 0xf
+/* 可注册的压缩方式编号为1~SIO_RPC_CODEC_MAX */
+#define SIO_RPC_CODEC_MAX 15
+/* sio_rpc_remaining_ms: 客户端没有携带截止时间 */
+#define SIO_RPC_NO_DEADLINE UINT64_MAX
+/* 流的接收窗口, 每个方向已发送而未被对端消费的数据不超过该值 */
+#define SIO_RPC_STREAM_WINDOW (256 * 1024)
+
+/* server直接下标索引的方法表大小上限, 更大的type存放在哈希表中 */
+#define SIO_RPC_METHOD_TABLE_MAX 4096
+/* 解析输入时一次扫描的最大帧数 */
+#define SIO_RPC_SCAN_BATCH 64
+/* 连接的写缓冲区清空时, 一次从延后队列移入的应答字节数(至少一个应答) */
+#define SIO_RPC_DEFER_BATCH (64 * 1024)
+
+/* 熔断统计的窗口(秒) */
+#define SIO_RPC_BREAKER_WINDOW 10
+
+/* 单个upstream的最大权重 */
+#define SIO_RPC_MAX_WEIGHT 100
+/* 一致性哈希中每单位权重的虚拟节点数 */
+#define SIO_RPC_HASH_VNODES 16
+
+/* 一致性哈希环上的虚拟节点 */
+struct sio_rpc_vnode {
+    uint64_t hash; /* 节点在环上的位置 */
+    struct sio_rpc_upstream *upstream; /* 所属upstream */
+};
+
+/* 注册的压缩方式 */
+struct sio_rpc_codec {
+    sio_rpc_compress_t compress; /* NULL表示未注册 */
+    sio_rpc_decompress_t decompress;
+    void *arg; /* 压缩与解压的参数 */
+};
+
+/* 按请求类型设置的压缩字典 */
+struct sio_rpc_dict {
+    char *data;
+    uint32_t len;
+};
+
 /* rpc框架, 需绑定到一个sio上 */
 struct sio_rpc {
     struct sio *sio; /* 事件驱动 */
     uint64_t max_pending; /* 限制读写缓冲区最大容量 */
+    uint64_t conn_timeout; /* upstream连接超时(毫秒), 0表示不限制 */
+    struct sio_sockopt_profile profile; /* upstream与server连接的socket选项 */
+    struct sio_rpc_codec codecs[SIO_RPC_CODEC_MAX + 1]; /* 以编号为下标, 客户端与服务端共用 */
+    struct shash *dicts; /* 压缩字典, key:请求类型, 延迟创建 */
 };
 
 /* rpc请求 */
 struct sio_rpc_request {
     uint64_t id; /* 请求在某个连接上的唯一ID */
+    uint64_t seq; /* 请求在client上的序号, 索引client->req_ring */
     uint32_t type; /* 请求的类型 */
-    char *body; /* 请求内容 */
+    const char *body; /* 请求内容 */
     uint32_t bodylen; /* 请求长度 */
+    sio_rpc_release_callback_t release; /* 请求体释放回调, NULL表示body由框架拷贝 */
+    char *packed; /* 压缩后的body, 发送时代替body, NULL表示未压缩 */
+    uint32_t packed_len; /* 压缩后的长度 */
+    uint32_t codec; /* packed的压缩方式 */
     uint32_t retry_count; /* 当前重试的次数 */
     uint32_t retry_times; /* 总共重试次数限制 */
     uint64_t timeout;   /* 每次重试的超时 */
+    uint64_t start_us; /* 本次发送的时间(微秒), 用于统计upstream延迟 */
+    uint64_t hash_key; /* 一致性哈希的key */
+    char has_key; /* 是否通过sio_rpc_call_hash发起 */
     struct sio_timer timer; /* 请求超时定时器 */
     struct sio_rpc_client *client; /* 请求所属客户端 */
-    struct sio_rpc_upstream *upstream; /* 请求所属连接 */
+    struct sio_rpc_upstream *upstream; /* 请求所属upstream */
+    struct sio_rpc_conn *conn; /* 请求所属连接 */
+    uint64_t hedge_id; /* 对冲请求在hedge_conn上的ID */
+    uint64_t hedge_start_us; /* 对冲请求的发送时间(微秒) */
+    struct sio_rpc_upstream *hedge_upstream; /* 对冲请求所属upstream, NULL表示没有对冲 */
+    struct sio_rpc_conn *hedge_conn; /* 对冲请求所属连接 */
+    struct sio_timer hedge_timer; /* 对冲定时器, 到期仍无应答则向另一个upstream发送副本 */
+    char hedge_on; /* hedge_timer是否在运行 */
     sio_rpc_upstream_callback_t cb; /* 应答回调 */
     void *arg; /* 应答回调参数 */
+    struct sio_rpc_request *next_free; /* 空闲链表 */
+};
+
+/* 延迟直方图的桶数, 每个2的幂区间分4个桶 */
+#define SIO_RPC_LATENCY_BUCKETS 256
+/* 对冲预算最多积攒的请求个数 */
+#define SIO_RPC_HEDGE_BURST 10
+
+/* 每次批量分配的请求个数 */
+#define SIO_RPC_REQUEST_SLAB 64
+
+/* upstream上等待应答的请求槽位 */
+struct sio_rpc_slot {
+    uint64_t id; /* 占用槽位的请求ID, 与应答ID比较, 防止误认同一槽位上的其他请求 */
+    struct sio_rpc_request *req; /* NULL表示槽位空闲 */
+};
+
+/* 流式调用, 客户端与服务端共用 */
+struct sio_rpc_stream {
+    uint64_t id; /* 流ID, 客户端与请求共用连接上的ID */
+    uint32_t type; /* 调用类型 */
+    struct sio_rpc *rpc; /* rpc框架 */
+    struct sio_rpc_conn *conn; /* 客户端流所在连接, NULL表示已脱离连接 */
+    struct sio_rpc_dstream *dstream; /* 服务端流所在连接, NULL表示已脱离连接 */
+    uint64_t timeout; /* 客户端的空闲超时(毫秒), 超时未收到任何帧则取消 */
+    struct sio_timer timer; /* 空闲超时定时器 */
+    char timer_on; /* timer是否在运行 */
+    uint64_t send_credit; /* 还可以发送的字节数 */
+    uint64_t recv_unacked; /* 已消费但尚未归还对端的字节数 */
+    char send_blocked; /* 曾因额度不足少写, 额度归还时回调WRITABLE */
+    char local_end; /* 本端已发送结束 */
+    char peer_end; /* 对端已发送结束 */
+    uint32_t busy; /* 正在回调用户或执行用户的操作, 期间的释放推迟到结束时 */
+    char failed; /* 出错, 空闲时以ERROR回调并释放 */
+    char closed; /* 不再回调, 空闲时释放 */
+    sio_rpc_stream_callback_t cb; /* 事件回调 */
+    void *arg; /* 回调参数, 服务端为方法参数, 可以在OPEN回调中替换为流自己的状态 */
+};
+
+/* 每条连接初始的槽位个数 */
+#define SIO_RPC_UPSTREAM_SLOTS 64
+/* 每个upstream的最大连接数 */
+#define SIO_RPC_MAX_CONNECTIONS 64
+/* 合并发送时单个请求超过该长度则不再拷贝到合并缓冲区, 直接发送 */
+#define SIO_RPC_COALESCE_LIMIT (64 * 1024)
+
+/* upstream的一条TCP连接 */
+struct sio_rpc_conn {
+    struct sio_stream *stream; /* TCP连接 */
+    uint64_t req_id; /* 自增请求ID */
+    uint64_t slot_mask; /* slots长度-1, 长度为2的幂 */
+    struct sio_rpc_slot *slots; /* 记录这条TCP连接上所有等待应答的请求, 下标为id & slot_mask */
+    uint64_t pending; /* 等待应答的请求个数 */
+    struct sio_rpc_upstream *upstream; /* 连接所属upstream */
+    struct shash *streams; /* 连接上的流, key:流ID, 延迟创建 */
+    char parsing; /* 正在解析应答, 期间断开的连接推迟到解析结束后关闭 */
+    struct sio_stream *closing; /* 解析期间断开的TCP连接 */
+    struct sio_buffer *batch; /* 合并发送缓冲区, 本轮sio_run中发起的请求, 延迟创建 */
+    enum sio_rpc_compact compact; /* header格式的协商状态, 建立连接时按client的设置从OFF或OFFER开始 */
+    time_t last_conn_time; /* 上次重连时间 */
+    time_t conn_delay; /* 重连间隔, 1~256秒, 连接5秒内断开则会*2, 否则重置 */
 };
 
 /* 代表client中的一个上游连接 */
@@ -49,21 +252,85 @@ struct sio_rpc_upstream {
     char *ip; /* 连接ip */
     uint16_t port; /* 连接port */
     struct sio_timer timer; /* 定时检查连接状况 */
-    struct sio_stream *stream; /* TCP连接 */
-    uint64_t req_id; /* 自增请求ID */
-    struct shash *req_status; /* 记录这条TCP连接上所有等待应答的请求 */
+    uint32_t conn_count; /* 连接个数 */
+    uint32_t connected; /* 已建立或正在建立的连接个数 */
+    struct sio_rpc_conn *conns; /* 连接数组, 请求发往等待应答最少的连接 */
+    uint64_t pending; /* 所有连接上等待应答的请求个数 */
     struct sio_rpc_client *client; /* 连接所属client */
-    time_t last_conn_time; /* 上次重连时间 */
-    time_t conn_delay; /* 重连间隔, 1~256秒, 连接5秒内断开则会*2, 否则重置 */
+    uint32_t weight; /* 权重, 1~SIO_RPC_MAX_WEIGHT */
+    uint64_t ewma_us; /* 应答延迟的指数加权平均(微秒), 超时按超时时间计入 */
+    enum sio_rpc_breaker breaker; /* 熔断状态 */
+    char probe_inflight; /* HALF_OPEN状态下是否已有探测请求 */
+    uint32_t win_requests; /* 当前窗口的请求结果数 */
+    uint32_t win_failures; /* 当前窗口的失败数(超时,连接断开) */
+    uint32_t consecutive_failures; /* 连续失败数 */
+    uint32_t eject_count; /* 连续摘除次数, 每次摘除时间翻倍 */
+    time_t win_start; /* 当前窗口的开始时间 */
+    time_t eject_until; /* 摘除到期时间 */
 };
 
 /* rpc客户端 */
 struct sio_rpc_client {
     struct sio_rpc *rpc; /* rpc框架 */
     uint32_t rr_stream; /* 轮转各个upstream,保证基本的公平性 */
+    enum sio_rpc_balance balance; /* 负载均衡策略 */
+    unsigned int rand_seed; /* P2C随机数种子 */
+    uint32_t wrr_len; /* wrr_schedule长度, 即权重之和 */
+    uint32_t *wrr_schedule; /* 预先计算的平滑加权轮转序列, 元素为upstreams下标 */
+    uint32_t vnode_count; /* hash_ring长度 */
+    struct sio_rpc_vnode *hash_ring; /* 按hash排序的一致性哈希环 */
+    uint32_t hedge_percentile; /* 以该百分位的应答延迟作为对冲延迟, 0表示不对冲 */
+    uint32_t hedge_budget; /* 每个请求积攒的对冲预算, 百分比 */
+    uint64_t hedge_min_delay; /* 对冲延迟下限(毫秒) */
+    uint64_t hedge_delay; /* 当前的对冲延迟(毫秒), 0表示样本不足 */
+    uint64_t hedge_tokens; /* 对冲预算, 每次对冲消耗100 */
+    uint64_t lat_total; /* 直方图的样本数 */
+    uint32_t lat_hist[SIO_RPC_LATENCY_BUCKETS]; /* 应答延迟直方图(微秒), 按对数分桶 */
+    uint32_t breaker_percent; /* 窗口内失败率达到该百分比则摘除 */
+    uint32_t breaker_min_requests; /* 窗口内请求数达到该值才按失败率判断 */
+    uint32_t breaker_consecutive; /* 连续失败达到该值立即摘除, 0表示不按连续失败判断 */
+    uint32_t breaker_eject; /* 首次摘除的时间(秒), 0表示关闭熔断(默认) */
+    uint32_t conn_per_upstream; /* 新增upstream的连接数 */
+    char coalesce; /* 是否合并发送 */
+    char send_cancel; /* 副本超时或对冲落败时通知服务端取消 */
+    uint32_t codec; /* 请求的压缩方式, 同时声明应答可以使用, 0表示不压缩 */
+    uint32_t compress_min; /* 不小于该长度的请求才压缩 */
+    char compact; /* 新建立的连接以紧凑格式的header发送 */
+    char flush_on; /* flush_timer是否已启动 */
+    struct sio_timer flush_timer; /* 0毫秒定时器, 在下一轮sio_run中统一发送各连接的合并缓冲区 */
     uint32_t upstream_count; /* upstream数组长度 */
     struct sio_rpc_upstream **upstreams; /* upstream数组, 每个元素地址各不相同 */
-    struct shash *req_record; /* 记录所有请求 */
+    uint64_t req_seq; /* 自增请求序号 */
+    uint64_t ring_mask; /* req_ring长度-1, 长度为2的幂 */
+    struct sio_rpc_request **req_ring; /* 记录所有请求, 下标为seq & ring_mask, 冲突时扩容 */
+    struct sio_rpc_request *free_reqs; /* 空闲请求链表 */
+    uint32_t slab_count; /* 已分配的请求块个数 */
+    struct sio_rpc_request **slabs; /* 请求块, 每块SIO_RPC_REQUEST_SLAB个请求 */
+};
+
+/* 多线程rpc client提交的一次调用 */
+struct sio_rpc_mt_call {
+    struct sio_rpc_mt_call *next; /* 提交队列链表 */
+    struct sio_rpc_client_mt *mt; /* 所属客户端 */
+    uint32_t type; /* 请求的类型 */
+    uint64_t timeout; /* 每次重试的超时 */
+    uint32_t retry_times; /* 重试次数 */
+    uint32_t size; /* 请求长度, 请求体紧随结构体之后 */
+    char is_timeout; /* 调用结果, 交给executor时有效 */
+    char *response; /* 应答的拷贝, 交给executor时有效 */
+    uint32_t response_len; /* 应答长度 */
+    sio_rpc_mt_callback_t cb; /* 应答回调 */
+    void *arg; /* 应答回调参数 */
+};
+
+/* 可在任意线程发起调用的rpc客户端, 调用经无锁队列提交到sio_run线程 */
+struct sio_rpc_client_mt {
+    struct sio_rpc_client *client; /* 实际发起调用的客户端, 只能在sio_run线程中使用 */
+    struct sio_rpc_mt_call *volatile submit; /* 无锁提交栈, 各线程CAS压入, sio_run线程整体取走 */
+    int notify_pipe[2]; /* 提交栈由空变为非空时通知sio_run线程 */
+    struct sio_fd *notify_sfd; /* 注册在sio上的notify_pipe[0] */
+    sio_rpc_executor_t executor; /* 回调执行器, NULL表示在sio_run线程中回调 */
+    void *executor_arg; /* 执行器参数 */
 };
 
 /* rpc应答 */
@@ -72,6 +339,22 @@ struct sio_rpc_response {
 	struct sio_rpc_server *server; /* 所属server */
 	struct shead req_head; /* 请求的header */
 	char *request; /* 请求的body */
+	char borrowed; /* request直接指向连接的输入缓冲区, 回调返回前有效 */
+	char in_callback; /* 正在方法回调中 */
+	char finished; /* 在方法回调中已经finish */
+	char offloaded; /* 交给了工作线程, finish经完成栈回到sio_run线程 */
+	char rejected; /* 排队超过预算, 以过载应答 */
+	char limited; /* 计入了方法的并发数, finish时归还 */
+	uint64_t deadline_us; /* 客户端的截止时间, 0表示不限 */
+	char cancelled; /* 客户端已取消或连接已断开, 应答不再发送, 跨线程以原子操作访问 */
+	char tracked; /* 记录在dstream->pending中 */
+	sio_rpc_dstream_callback_t cb; /* 工作线程中执行的方法, 入队时从sio_rpc_method取出 */
+	void *arg; /* 方法参数 */
+	char *reply; /* 工作线程finish的应答拷贝 */
+	uint32_t reply_len; /* 应答长度 */
+	uint32_t reply_codec; /* reply已在工作线程中按该方式压缩, 0表示未压缩 */
+	const struct sio_rpc_dict *dict; /* 入队时取出的应答压缩字典, 供工作线程使用 */
+	struct sio_rpc_response *next; /* 工作队列或完成栈中的下一个 */
 };
 
 /* rpc下游,server的一个连接 */
@@ -80,21 +363,63 @@ struct sio_rpc_dstream {
     struct sio_timer timer; /* 定时检查连接状况 */
     struct sio_stream *stream; /* TCP连接 */
     struct sio_rpc_server *server; /* 所属server */
+    struct shash *streams; /* 连接上的流, key:流ID, 延迟创建 */
+    char parsing; /* 正在解析请求, 期间的释放推迟到解析结束 */
+    char closed; /* 解析期间被释放 */
+    uint64_t read_us; /* 本次解析开始的时间, 作为请求的到达时间 */
+    struct shash *pending; /* 回调返回时尚未finish的请求, key:请求ID, 用于取消, 延迟创建 */
+    struct sio_buffer *deferred; /* 连接有积压时延后发送的大应答(已编码的帧), 延迟创建 */
+    struct sio_buffer *deferred_lens; /* deferred中各帧的长度(uint64_t), 与deferred同时创建, 按帧移出时不再解析已编码的数据 */
+    enum sio_rpc_compact compact; /* 收到带SIO_RPC_FRAME_COMPACT的帧后为ON, 之后接受紧凑格式的请求, 应答都以紧凑格式发送 */
 };
 
 /* 在server中注册的rpc方法 */
 struct sio_rpc_method {
     sio_rpc_dstream_callback_t cb; /* 本地rpc方法 */
+    sio_rpc_stream_callback_t stream_cb; /* 流式rpc方法, 与cb二选一 */
     void *arg; /* rpc参数 */
+    enum sio_rpc_dispatch dispatch; /* cb的执行方式 */
+    uint32_t max_inflight; /* 并发上限, 0表示不限 */
+    uint32_t inflight; /* 已开始处理而未finish的请求数 */
+    char urgent; /* 应答不论大小都优先发送 */
+};
+
+/* server的工作线程池, 执行DISPATCH_WORKER的方法 */
+struct sio_rpc_workers {
+    struct sio_rpc_server *server; /* 所属server */
+    pthread_t *threads; /* 工作线程 */
+    uint32_t thread_count; /* 线程个数 */
+    pthread_mutex_t lock; /* 保护工作队列 */
+    pthread_cond_t cond; /* 工作队列非空或退出 */
+    struct sio_rpc_response *queue_head; /* 待执行的请求, 先进先出 */
+    struct sio_rpc_response *queue_tail;
+    uint32_t queue_len; /* 队列长度 */
+    uint32_t queue_limit; /* 队列长度上限 */
+    char quit; /* 通知工作线程退出 */
+    struct sio_rpc_response *volatile done; /* 无锁完成栈, 工作线程CAS压入, sio_run线程整体取走 */
+    int notify_pipe[2]; /* 完成栈由空变为非空时通知sio_run线程 */
+    struct sio_fd *notify_sfd; /* 注册在sio上的notify_pipe[0] */
 };
 
 /* rpc服务端 */
 struct sio_rpc_server {
     struct sio_rpc *rpc; /* rpc框架 */
-    uint64_t conn_id; /* 自增连接ID */
+    uint64_t conn_id; /* 自增连接序号, 作为dstream->id的高32位 */
     struct sio_stream *stream; /* 监听套接字 */
-    struct shash *dstreams; /* 所有下游downstream */
-    struct shash *methods; /* 注册的rpc方法 */
+    struct sio_rpc_dstream **dstream_slots; /* 所有下游downstream, 以dstream->id的低32位为下标 */
+    uint32_t slot_count; /* dstream_slots大小 */
+    uint32_t *free_slots; /* 空闲的下标栈 */
+    uint32_t free_count; /* 空闲下标个数 */
+    struct sio_rpc_method **method_table; /* type小于SIO_RPC_METHOD_TABLE_MAX的方法, 以type为下标 */
+    uint32_t method_table_size; /* method_table大小, 按注册的type扩容 */
+    struct shash *methods; /* type较大的方法 */
+    char borrow; /* 方法回调中直接借用输入缓冲区中的请求body */
+    struct sio_rpc_response *spare_resp; /* 回调中finish的response留作复用 */
+    struct sio_rpc_workers *workers; /* 工作线程池, NULL表示未启用 */
+    uint64_t shed_count; /* 以过载应答拒绝的请求数 */
+    uint32_t small_resp; /* body不超过该值的应答优先发送, 0表示不区分 */
+    uint32_t deferred_count; /* 所有连接上延后发送的应答数 */
+    uint32_t compress_min; /* 不小于该长度的应答按客户端声明的方式压缩, 0表示不压缩 */
 };
 
 /**
@@ -120,6 +445,61 @@ struct sio_rpc *sio_rpc_new(struct sio *sio, uint64_t max_pending);
  * @date 2014/08/31 13:21:26
 **/
 void sio_rpc_free(struct sio_rpc *rpc);
+/**
+ * @brief 设置upstream的连接超时, 超时的upstream按连接失败处理, 等待重连
+ *
+ * @param [in] rpc   : struct sio_rpc*
+ * @param [in] timeout_ms   : uint64_t 毫秒, 0表示不限制(默认)
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/12 16:02:37
+**/
+void sio_rpc_set_connect_timeout(struct sio_rpc *rpc, uint64_t timeout_ms);
+/**
+ * @brief 设置rpc连接的socket选项模板, 只影响之后创建的连接和server
+ *
+ * @param [in] rpc   : struct sio_rpc*
+ * @param [in] profile   : const struct sio_sockopt_profile*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/15 11:20:05
+**/
+void sio_rpc_set_sockopt(struct sio_rpc *rpc, const struct sio_sockopt_profile *profile);
+/**
+ * @brief 注册一种压缩方式, 通信双方需要以相同的编号注册相同的算法.
+ *        框架不内置压缩算法, 由使用者接入lz4, zstd等实现
+ *
+ * @param [in] rpc   : struct sio_rpc*
+ * @param [in] codec   : uint32_t 编号, 1~SIO_RPC_CODEC_MAX
+ * @param [in] compress   : sio_rpc_compress_t
+ * @param [in] decompress   : sio_rpc_decompress_t
+ * @param [in] arg   : void*
+ * @return  int
+ * @retval   编号不合法返回-1, 成功返回0
+ * @see sio_rpc_client_set_compress sio_rpc_server_set_compress
+ * @author liangdong
+ * @date 2014/10/24 15:40:18
+**/
+int sio_rpc_add_codec(struct sio_rpc *rpc, uint32_t codec, sio_rpc_compress_t compress, sio_rpc_decompress_t decompress, void *arg);
+/**
+ * @brief 为一种请求类型设置压缩字典, 该类型的请求与应答压缩解压时传给codec.
+ *        通信双方需要设置相同的字典, 在发起调用或启动工作线程前设置
+ *
+ * @param [in] rpc   : struct sio_rpc*
+ * @param [in] type   : uint32_t
+ * @param [in] dict   : const char* 框架拷贝, NULL表示移除
+ * @param [in] len   : uint32_t
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/10/24 15:42:51
+**/
+void sio_rpc_set_dictionary(struct sio_rpc *rpc, uint32_t type, const char *dict, uint32_t len);
 /**
  * @brief 创建rpc客户端
  *
@@ -142,6 +522,73 @@ struct sio_rpc_client *sio_rpc_client_new(struct sio_rpc *rpc);
  * @date 2014/08/31 13:21:52
 **/
 void sio_rpc_client_free(struct sio_rpc_client *client);
+/**
+ * @brief 设置每个upstream的TCP连接数, 请求发往等待应答最少的连接, 减少大应答造成的队头阻塞
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] count   : uint32_t 1~SIO_RPC_MAX_CONNECTIONS, 默认1, 只影响之后添加的upstream
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/29 10:12:40
+**/
+void sio_rpc_client_set_connections(struct sio_rpc_client *client, uint32_t count);
+/**
+ * @brief 设置是否合并发送, 开启后同一轮sio_run中发往同一连接的请求编码到一块连续缓冲区,
+ *        在下一轮sio_run开始时以一次write发出, 以少量延迟换取更少的系统调用
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] enable   : int 非0开启, 默认关闭, 关闭时立即发送已合并的请求
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/30 11:05:18
+**/
+void sio_rpc_client_set_coalesce(struct sio_rpc_client *client, int enable);
+/**
+ * @brief 设置是否发送取消帧: 请求超时或对冲副本落败时通知服务端, 尚未执行的请求被丢弃,
+ *        执行中的请求可以通过sio_rpc_cancelled提前结束. 服务端需要支持取消帧才能开启
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] enable   : int 非0开启, 默认关闭
+ * @return  void
+ * @retval
+ * @see sio_rpc_cancelled
+ * @author liangdong
+ * @date 2014/10/23 15:20:44
+**/
+void sio_rpc_client_set_cancel(struct sio_rpc_client *client, int enable);
+/**
+ * @brief 设置请求的压缩: 不小于min_bytes的请求体以codec压缩(压缩后没有变小则原样发送),
+ *        同时告知服务端应答可以用codec压缩. 流式调用不压缩
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] codec   : uint32_t sio_rpc_add_codec注册的编号, 0表示关闭(默认)
+ * @param [in] min_bytes   : uint32_t
+ * @return  int
+ * @retval   codec没有先经sio_rpc_add_codec注册返回-1(设置不变), 成功返回0
+ * @see sio_rpc_add_codec
+ * @author liangdong
+ * @date 2014/10/24 15:45:30
+**/
+int sio_rpc_client_set_compress(struct sio_rpc_client *client, uint32_t codec, uint32_t min_bytes);
+/**
+ * @brief 设置之后建立的连接提议使用紧凑格式的header(varint编码, 小消息的header约7字节, 定长为24字节).
+ *        连接先以定长header发送, 每帧带SIO_RPC_FRAME_COMPACT; 支持紧凑格式的服务端收到后, 该连接的应答改用紧凑格式,
+ *        客户端收到第一个紧凑格式的应答后才改用紧凑格式发送. 不认识该标志的旧服务端忽略它并以定长格式应答,
+ *        连接一直使用定长格式, 因此可以对任意服务端开启
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] enable   : int 非0开启, 默认关闭
+ * @return  void
+ * @retval
+ * @see shead_encode_compact
+ * @author liangdong
+ * @date 2014/10/25 16:40:12
+**/
+void sio_rpc_client_set_compact(struct sio_rpc_client *client, int enable);
 /**
  * @brief 向客户端添加一个上游, 支持运行时动态添加
  *
@@ -155,6 +602,65 @@ void sio_rpc_client_free(struct sio_rpc_client *client);
  * @date 2014/08/31 13:22:02
 **/
 void sio_rpc_add_upstream(struct sio_rpc_client *client, const char *ip, uint16_t port);
+/**
+ * @brief 向客户端添加一个带权重的上游, 上游已存在则修改其权重
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] ip   : const char*
+ * @param [in] port   : uint16_t
+ * @param [in] weight   : uint32_t 1~SIO_RPC_MAX_WEIGHT, 只影响WRR与HASH策略
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/26 10:41:18
+**/
+void sio_rpc_add_upstream_weight(struct sio_rpc_client *client, const char *ip, uint16_t port, uint32_t weight);
+/**
+ * @brief 设置负载均衡策略, 默认SIO_RPC_BALANCE_LEAST_PENDING
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] balance   : enum sio_rpc_balance
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/26 10:42:07
+**/
+void sio_rpc_client_set_balance(struct sio_rpc_client *client, enum sio_rpc_balance balance);
+/**
+ * @brief 开启对冲请求: 请求发出后超过最近应答延迟的percentile分位仍无应答, 
+ *        则向另一个upstream发送副本, 采用先到的应答, 丢弃另一个
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] percentile   : uint32_t 1~99, 0表示关闭(默认)
+ * @param [in] min_delay_ms   : uint64_t 对冲延迟下限
+ * @param [in] budget_percent   : uint32_t 对冲请求最多占请求数的百分比
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/26 16:20:43
+**/
+void sio_rpc_client_set_hedge(struct sio_rpc_client *client, uint32_t percentile, uint64_t min_delay_ms, uint32_t budget_percent);
+/**
+ * @brief 开启熔断: upstream的请求超时或连接断开计为失败, 失败率或连续失败超过阈值则摘除该upstream,
+ *        摘除到期后放行一个探测请求, 成功则恢复, 失败则摘除时间翻倍(最多32倍). 
+ *        所有upstream都被摘除时忽略熔断状态.
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] failure_percent   : uint32_t 1~100, SIO_RPC_BREAKER_WINDOW秒内的失败率阈值
+ * @param [in] min_requests   : uint32_t 窗口内请求数不少于该值才按失败率判断
+ * @param [in] consecutive_failures   : uint32_t 连续失败阈值, 0表示不判断
+ * @param [in] eject_seconds   : uint32_t 首次摘除的时间, 0表示关闭(默认)
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/28 11:05:36
+**/
+void sio_rpc_client_set_breaker(struct sio_rpc_client *client, uint32_t failure_percent, uint32_t min_requests,
+        uint32_t consecutive_failures, uint32_t eject_seconds);
 /**
  * @brief 从客户端移除一个上游, 支持运行时动态删除(不要在回调中删除)
  *
@@ -173,7 +679,7 @@ void sio_rpc_remove_upstream(struct sio_rpc_client *client, const char *ip, uint
  *
  * @param [in] client   : struct sio_rpc_client*
  * @param [in] type   : uint32_t 请求的类型
- * @param [in] timeout_ms   : uint64_t 请求超时时间, 总耗费时间最大timeout_ms *retry_times
+ * @param [in] timeout_ms   : uint64_t 请求超时时间, 总耗费时间最大timeout_ms *retry_times, 同时作为服务端的排队预算
  * @param [in] retry_times   : uint32_t 请求重试次数
  * @param [in] request   : const char* 请求体,可以为NULL,则只发送header
  * @param [in] size   : uint32_t 请求体长度, 如果requet为NULL, 则size必须为0
@@ -187,6 +693,166 @@ void sio_rpc_remove_upstream(struct sio_rpc_client *client, const char *ip, uint
 **/
 void sio_rpc_call(struct sio_rpc_client *client, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
         const char *request, uint32_t size, sio_rpc_upstream_callback_t cb, void *arg);
+/**
+ * @brief 发起RPC远程调用, 在SIO_RPC_BALANCE_HASH策略下相同key的请求发往同一个上游
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] key   : uint64_t 一致性哈希的key, 重试时换到环上的其他上游
+ * @param [in] type   : uint32_t 请求的类型
+ * @param [in] timeout_ms   : uint64_t 请求超时时间, 总耗费时间最大timeout_ms *retry_times
+ * @param [in] retry_times   : uint32_t 请求重试次数
+ * @param [in] request   : const char* 请求体,可以为NULL,则只发送header
+ * @param [in] size   : uint32_t 请求体长度, 如果requet为NULL, 则size必须为0
+ * @param [in] cb   : sio_rpc_upstream_callback_t 应答处理回调
+ * @param [in] arg   : void* 用户参数
+ * @return  void 
+ * @retval   
+ * @see sio_rpc_call
+ * @author liangdong
+ * @date 2014/09/26 10:44:51
+**/
+void sio_rpc_call_hash(struct sio_rpc_client *client, uint64_t key, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_rpc_upstream_callback_t cb, void *arg);
+/**
+ * @brief 发起RPC远程调用, 不拷贝请求体, 请求结束前request必须保持有效
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] type   : uint32_t 请求的类型
+ * @param [in] timeout_ms   : uint64_t 请求超时时间, 总耗费时间最大timeout_ms *retry_times
+ * @param [in] retry_times   : uint32_t 请求重试次数
+ * @param [in] request   : const char* 请求体, 由调用者持有, 重试时复用
+ * @param [in] size   : uint32_t 请求体长度
+ * @param [in] release   : sio_rpc_release_callback_t 在cb之后调用, 归还request, 可以为NULL
+ * @param [in] cb   : sio_rpc_upstream_callback_t 应答处理回调
+ * @param [in] arg   : void* 用户参数, 同时传给cb与release
+ * @return  void 
+ * @retval   
+ * @see sio_rpc_call
+ * @author liangdong
+ * @date 2014/09/25 10:16:32
+**/
+void sio_rpc_call_nocopy(struct sio_rpc_client *client, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_rpc_release_callback_t release, sio_rpc_upstream_callback_t cb, void *arg);
+/**
+ * @brief 打开一个流式调用, 请求与应答都以片段传输, 不受内存与uint32长度的限制.
+ *        流绑定在一条连接上, 不重试, 不对冲
+ *
+ * @param [in] client   : struct sio_rpc_client*
+ * @param [in] type   : uint32_t 服务端以sio_rpc_server_add_stream_method注册的类型
+ * @param [in] idle_timeout_ms   : uint64_t 超过该时间未收到任何帧则以ERROR回调并取消
+ * @param [in] cb   : sio_rpc_stream_callback_t
+ * @param [in] arg   : void*
+ * @return  struct sio_rpc_stream* 
+ * @retval   没有可用的upstream返回NULL
+ * @see 
+ * @author liangdong
+ * @date 2014/10/09 10:30:15
+**/
+struct sio_rpc_stream *sio_rpc_stream_open(struct sio_rpc_client *client, uint32_t type, uint64_t idle_timeout_ms,
+        sio_rpc_stream_callback_t cb, void *arg);
+/**
+ * @brief 向流写入数据, 受对端窗口限制可能只写入一部分, 剩余部分等待WRITABLE后再写
+ *
+ * @param [in] stream   : struct sio_rpc_stream*
+ * @param [in] data   : const char*
+ * @param [in] size   : uint32_t
+ * @return  int 
+ * @retval   写入的字节数, 流已结束返回-1, 连接断开时先以ERROR回调再返回-1
+ * @see 
+ * @author liangdong
+ * @date 2014/10/09 10:31:40
+**/
+int sio_rpc_stream_write(struct sio_rpc_stream *stream, const char *data, uint32_t size);
+/**
+ * @brief 结束本端的发送, 若对端也已结束则释放流
+ *
+ * @param [in] stream   : struct sio_rpc_stream*
+ * @return  int 
+ * @retval   已经结束过或连接断开返回-1
+ * @see 
+ * @author liangdong
+ * @date 2014/10/09 10:32:22
+**/
+int sio_rpc_stream_end(struct sio_rpc_stream *stream);
+/**
+ * @brief 取消并释放流, 通知对端以ERROR结束, 本端不再回调
+ *
+ * @param [in] stream   : struct sio_rpc_stream*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/10/09 10:33:05
+**/
+void sio_rpc_stream_cancel(struct sio_rpc_stream *stream);
+/**
+ * @brief 创建多线程rpc客户端, 内部创建一个sio_rpc_client(mt->client), 
+ *        上游与各项策略在sio_run线程中通过mt->client设置
+ *
+ * @param [in] rpc   : struct sio_rpc*
+ * @return  struct sio_rpc_client_mt* 
+ * @retval   创建通知管道失败返回NULL
+ * @see 
+ * @author liangdong
+ * @date 2014/10/08 15:20:11
+**/
+struct sio_rpc_client_mt *sio_rpc_client_mt_new(struct sio_rpc *rpc);
+/**
+ * @brief 释放多线程rpc客户端, 在sio_run线程中调用, 调用前确保其他线程不再发起调用,
+ *        未完成及尚未发出的调用都以超时回调
+ *
+ * @param [in] mt   : struct sio_rpc_client_mt*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/10/08 15:21:02
+**/
+void sio_rpc_client_mt_free(struct sio_rpc_client_mt *mt);
+/**
+ * @brief 设置回调执行器, 在sio_run线程中且开始调用之前设置.
+ *        设置后应答被拷贝到call中交给executor, 由executor在任意线程执行sio_rpc_mt_run
+ *
+ * @param [in] mt   : struct sio_rpc_client_mt*
+ * @param [in] executor   : sio_rpc_executor_t NULL表示在sio_run线程中回调(默认)
+ * @param [in] arg   : void*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/10/08 15:22:40
+**/
+void sio_rpc_client_mt_set_executor(struct sio_rpc_client_mt *mt, sio_rpc_executor_t executor, void *arg);
+/**
+ * @brief 在任意线程发起远程调用, 参数同sio_rpc_call, 请求体在调用线程中拷贝
+ *
+ * @param [in] mt   : struct sio_rpc_client_mt*
+ * @param [in] type   : uint32_t
+ * @param [in] timeout_ms   : uint64_t
+ * @param [in] retry_times   : uint32_t
+ * @param [in] request   : const char* 可以为NULL
+ * @param [in] size   : uint32_t
+ * @param [in] cb   : sio_rpc_mt_callback_t
+ * @param [in] arg   : void*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/10/08 15:24:13
+**/
+void sio_rpc_call_mt(struct sio_rpc_client_mt *mt, uint32_t type, uint64_t timeout_ms, uint32_t retry_times,
+        const char *request, uint32_t size, sio_rpc_mt_callback_t cb, void *arg);
+/**
+ * @brief 在executor所在线程执行call的应答回调并释放call
+ *
+ * @param [in] call   : struct sio_rpc_mt_call*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/10/08 15:25:30
+**/
+void sio_rpc_mt_run(struct sio_rpc_mt_call *call);
 /**
  * @brief 创建RPC服务端
  *
@@ -211,6 +877,115 @@ struct sio_rpc_server *sio_rpc_server_new(struct sio_rpc *rpc, const char *ip, u
  * @date 2014/08/31 13:24:42
 **/
 void sio_rpc_server_free(struct sio_rpc_server *server);
+/**
+ * @brief 设置借用模式: 方法回调中sio_rpc_request直接返回输入缓冲区中的body, 不再拷贝.
+ *        回调中finish的请求没有任何拷贝; 回调返回时尚未finish的请求才拷贝body,
+ *        因此推迟finish的方法必须在回调返回后重新调用sio_rpc_request获取body.
+ *
+ * @param [in] server   : struct sio_rpc_server*
+ * @param [in] enable   : char 默认关闭
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/10/20 10:12:36
+**/
+void sio_rpc_server_set_borrow(struct sio_rpc_server *server, char enable);
+/**
+ * @brief 启动工作线程池, 执行通过sio_rpc_server_set_dispatch指定为DISPATCH_WORKER的方法.
+ *        方法在工作线程中回调, 可以在任意线程sio_rpc_finish, 应答经无锁完成栈交回sio_run线程发送.
+ *
+ * @param [in] server   : struct sio_rpc_server*
+ * @param [in] threads   : uint32_t 工作线程个数
+ * @param [in] queue_limit   : uint32_t 排队请求上限, 超出的请求以过载应答拒绝
+ * @return  int
+ * @retval   已经启动过或创建线程失败返回-1, 成功返回0
+ * @see
+ * @author liangdong
+ * @date 2014/10/21 14:05:18
+**/
+int sio_rpc_server_set_workers(struct sio_rpc_server *server, uint32_t threads, uint32_t queue_limit);
+/**
+ * @brief 设置一个RPC方法的执行方式, 未启动工作线程池时总是INLINE执行
+ *
+ * @param [in] server   : struct sio_rpc_server*
+ * @param [in] type   : uint32_t
+ * @param [in] dispatch   : enum sio_rpc_dispatch
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/10/21 14:06:40
+**/
+void sio_rpc_server_set_dispatch(struct sio_rpc_server *server, uint32_t type, enum sio_rpc_dispatch dispatch);
+/**
+ * @brief 限制一个RPC方法的并发数, 已开始处理而未finish的请求达到上限时, 新请求直接以过载应答拒绝.
+ *        客户端收到过载应答后立即换upstream重试, 重试用尽则以SIO_RPC_CALL_OVERLOADED回调
+ *
+ * @param [in] server   : struct sio_rpc_server*
+ * @param [in] type   : uint32_t
+ * @param [in] max_inflight   : uint32_t 0表示不限(默认)
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/10/22 16:31:05
+**/
+void sio_rpc_server_set_concurrency(struct sio_rpc_server *server, uint32_t type, uint32_t max_inflight);
+/**
+ * @brief 开启应答的优先级: body不超过small_bytes的应答直接写入连接, 更大的应答在连接有积压时
+ *        进入该连接的延后队列, 写缓冲区清空后才逐批发出, 使小应答不必排在大应答之后.
+ *        同一连接上的应答可能因此与finish的顺序不同, 客户端按请求ID匹配不受影响
+ *
+ * @param [in] server   : struct sio_rpc_server*
+ * @param [in] small_bytes   : uint32_t 0表示关闭(默认), 所有应答按finish的顺序发送
+ * @return  void
+ * @retval
+ * @see sio_rpc_server_set_urgent
+ * @author liangdong
+ * @date 2014/10/24 10:30:12
+**/
+void sio_rpc_server_set_priority(struct sio_rpc_server *server, uint32_t small_bytes);
+/**
+ * @brief 设置一个RPC方法的应答为紧急, 开启优先级后不论大小都直接写入连接
+ *
+ * @param [in] server   : struct sio_rpc_server*
+ * @param [in] type   : uint32_t
+ * @param [in] urgent   : char
+ * @return  void
+ * @retval
+ * @see sio_rpc_server_set_priority
+ * @author liangdong
+ * @date 2014/10/24 10:31:40
+**/
+void sio_rpc_server_set_urgent(struct sio_rpc_server *server, uint32_t type, char urgent);
+/**
+ * @brief 查询服务端的排队深度
+ *
+ * @param [in] server   : struct sio_rpc_server*
+ * @param [out] jobs   : uint32_t* 工作队列中等待执行的请求数, 可以为NULL
+ * @param [out] deferred   : uint32_t* 延后队列中等待发送的应答数, 可以为NULL
+ * @param [out] bytes   : uint64_t* 所有连接上尚未写入socket的应答字节数(含延后队列), 可以为NULL
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/10/24 10:33:05
+**/
+void sio_rpc_server_queue_depth(struct sio_rpc_server *server, uint32_t *jobs, uint32_t *deferred, uint64_t *bytes);
+/**
+ * @brief 设置应答的压缩: 不小于min_bytes的应答以客户端声明的方式压缩, 服务端未注册该方式则不压缩.
+ *        工作线程中finish的应答在工作线程中压缩
+ *
+ * @param [in] server   : struct sio_rpc_server*
+ * @param [in] min_bytes   : uint32_t 0表示不压缩(默认)
+ * @return  void
+ * @retval
+ * @see sio_rpc_client_set_compress
+ * @author liangdong
+ * @date 2014/10/24 15:47:02
+**/
+void sio_rpc_server_set_compress(struct sio_rpc_server *server, uint32_t min_bytes);
 /**
  * @brief 注册一个RPC方法, 支持动态添加
  *
@@ -238,7 +1013,22 @@ void sio_rpc_server_add_method(struct sio_rpc_server *server, uint32_t type, sio
 **/
 void sio_rpc_server_remove_method(struct sio_rpc_server *server, uint32_t type);
 /**
- * @brief 结束一个RPC调用, 返回应答
+ * @brief 注册一个流式RPC方法, 客户端打开流时创建服务端的流, 之后的请求片段与结束都通过cb通知,
+ *        应答通过sio_rpc_stream_write与sio_rpc_stream_end发送
+ *
+ * @param [in] server   : struct sio_rpc_server*
+ * @param [in] type   : uint32_t
+ * @param [in] cb   : sio_rpc_stream_callback_t
+ * @param [in] arg   : void*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/10/09 10:35:48
+**/
+void sio_rpc_server_add_stream_method(struct sio_rpc_server *server, uint32_t type, sio_rpc_stream_callback_t cb, void *arg);
+/**
+ * @brief 结束一个RPC调用, 返回应答. DISPATCH_WORKER的方法可以在任意线程调用
  *
  * @param [in] resp   : struct sio_rpc_response* 
  * @param [in] body   : const char* 可以为NULL,只应答header
@@ -256,12 +1046,35 @@ void sio_rpc_finish(struct sio_rpc_response *resp, const char *body, uint32_t le
  * @param [in] resp   : struct sio_rpc_response*
  * @param [in] len   : uint32_t* 可以为NULL
  * @return  char* 如果*len返回为0, 那么返回值是未定义的, 不要访问!
- * @retval   
- * @see 
+ * @retval   借用模式下回调中返回的指针在回调返回后失效
+ * @see sio_rpc_server_set_borrow
  * @author liangdong
  * @date 2014/08/31 13:27:10
 **/
 char *sio_rpc_request(struct sio_rpc_response *resp, uint32_t *len);
+/**
+ * @brief 客户端剩余的等待时间, 可以作为处理中再发起的下游调用的超时, 使截止时间逐级传递
+ *
+ * @param [in] resp   : const struct sio_rpc_response*
+ * @return  uint64_t 毫秒
+ * @retval   已超时返回0, 客户端没有携带截止时间返回SIO_RPC_NO_DEADLINE
+ * @see
+ * @author liangdong
+ * @date 2014/10/23 15:22:10
+**/
+uint64_t sio_rpc_remaining_ms(const struct sio_rpc_response *resp);
+/**
+ * @brief 请求是否已被客户端取消或连接已经断开, 此时仍需sio_rpc_finish, 但应答不会发送.
+ *        可以在任意线程调用, 耗时的处理可以据此提前结束
+ *
+ * @param [in] resp   : const struct sio_rpc_response*
+ * @return  char
+ * @retval   已取消返回1, 否则返回0
+ * @see sio_rpc_client_set_cancel
+ * @author liangdong
+ * @date 2014/10/23 15:23:31
+**/
+char sio_rpc_cancelled(const struct sio_rpc_response *resp);
 
 #ifdef __cplusplus
 }
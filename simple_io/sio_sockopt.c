@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "sio_sockopt.h"
+
+void sio_sockopt_profile_init(struct sio_sockopt_profile *profile)
+{
+    memset(profile, 0, sizeof(*profile));
+    profile->nodelay = 1;
+    profile->incoming_cpu = -1;
+}
+
+static int _sio_sockopt_set(int sock, int level, int name, int value)
+{
+    return setsockopt(sock, level, name, &value, sizeof(value));
+}
+
+int sio_sockopt_apply(int sock, const struct sio_sockopt_profile *profile)
+{
+    int ret = 0;
+
+    if (profile->nodelay)
+        ret |= _sio_sockopt_set(sock, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (profile->rcvbuf)
+        ret |= _sio_sockopt_set(sock, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf);
+    if (profile->sndbuf)
+        ret |= _sio_sockopt_set(sock, SOL_SOCKET, SO_SNDBUF, profile->sndbuf);
+    if (profile->keepalive) {
+        ret |= _sio_sockopt_set(sock, SOL_SOCKET, SO_KEEPALIVE, 1);
+#ifdef TCP_KEEPIDLE
+        if (profile->keepidle)
+            ret |= _sio_sockopt_set(sock, IPPROTO_TCP, TCP_KEEPIDLE, profile->keepidle);
+#endif
+#ifdef TCP_KEEPINTVL
+        if (profile->keepintvl)
+            ret |= _sio_sockopt_set(sock, IPPROTO_TCP, TCP_KEEPINTVL, profile->keepintvl);
+#endif
+#ifdef TCP_KEEPCNT
+        if (profile->keepcnt)
+            ret |= _sio_sockopt_set(sock, IPPROTO_TCP, TCP_KEEPCNT, profile->keepcnt);
+#endif
+    }
+#ifdef SO_BUSY_POLL
+    if (profile->busy_poll)
+        ret |= _sio_sockopt_set(sock, SOL_SOCKET, SO_BUSY_POLL, profile->busy_poll);
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+    if (profile->notsent_lowat)
+        ret |= _sio_sockopt_set(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile->notsent_lowat);
+#endif
+#ifdef SO_INCOMING_CPU
+    if (profile->incoming_cpu >= 0)
+        ret |= _sio_sockopt_set(sock, SOL_SOCKET, SO_INCOMING_CPU, profile->incoming_cpu);
+#endif
+    sio_sockopt_rearm(sock, profile);
+    return ret ? -1 : 0;
+}
+
+void sio_sockopt_rearm(int sock, const struct sio_sockopt_profile *profile)
+{
+#ifdef TCP_QUICKACK
+    if (profile->quickack)
+        _sio_sockopt_set(sock, IPPROTO_TCP, TCP_QUICKACK, 1);
+#endif
+}
+
+/* vim: set ts=4 sw=4 sts=4 tw=100 */
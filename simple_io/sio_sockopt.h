@@ -0,0 +1,70 @@
+#ifndef SIMPLE_IO_SIO_SOCKOPT_H
+#define SIMPLE_IO_SIO_SOCKOPT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 
+ * socket选项模板, 在listen/accept/connect时应用到socket上,
+ * 用于区分低延迟链路与大吞吐链路的调优, 字段为0(incoming_cpu为-1)表示保持系统默认.
+ * */
+struct sio_sockopt_profile {
+    int nodelay;          /**< TCP_NODELAY, 默认开启       */
+    int rcvbuf;           /**< SO_RCVBUF字节数, 需在connect/listen前设置才能影响窗口扩大因子       */
+    int sndbuf;           /**< SO_SNDBUF字节数       */
+    int keepalive;        /**< SO_KEEPALIVE开关       */
+    int keepidle;         /**< TCP_KEEPIDLE, 空闲多少秒后开始探测       */
+    int keepintvl;        /**< TCP_KEEPINTVL, 探测间隔秒数       */
+    int keepcnt;          /**< TCP_KEEPCNT, 探测失败多少次断开       */
+    int busy_poll;        /**< SO_BUSY_POLL, 阻塞读时忙轮询的微秒数       */
+    int quickack;         /**< TCP_QUICKACK, 非持久选项, stream每次读后重新设置       */
+    int notsent_lowat;    /**< TCP_NOTSENT_LOWAT, 内核未发送数据低于该值才通知可写       */
+    int incoming_cpu;     /**< SO_INCOMING_CPU, -1表示不设置       */
+};
+
+/**
+ * @brief 初始化为默认模板(仅开启TCP_NODELAY, 与原有行为一致)
+ *
+ * @param [in] profile   : struct sio_sockopt_profile*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/15 10:12:40
+**/
+void sio_sockopt_profile_init(struct sio_sockopt_profile *profile);
+/**
+ * @brief 将模板应用到socket上, 尽力而为, 单个选项失败不影响其他选项
+ *
+ * @param [in] sock   : int
+ * @param [in] profile   : const struct sio_sockopt_profile*
+ * @return  int 
+ * @retval   任一选项设置失败返回-1, 否则返回0
+ * @see 
+ * @author liangdong
+ * @date 2014/09/15 10:13:02
+**/
+int sio_sockopt_apply(int sock, const struct sio_sockopt_profile *profile);
+/**
+ * @brief 重新开启TCP_QUICKACK(内核会在延迟确认模式下自动清除该选项)
+ *
+ * @param [in] sock   : int
+ * @param [in] profile   : const struct sio_sockopt_profile*
+ * @return  void 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/15 10:13:31
+**/
+void sio_sockopt_rearm(int sock, const struct sio_sockopt_profile *profile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  //SIMPLE_IO_SIO_SOCKOPT_H
+
+/* vim: set ts=4 sw=4 sts=4 tw=100 */
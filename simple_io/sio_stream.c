@@ -20,7 +20,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <netinet/tcp.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -41,6 +41,8 @@ static int _sio_stream_read(struct sio *sio, struct sio_fd *sfd, int fd, struct
         return 2;
     } else {
         sio_buffer_seek(stream->inbuf, bytes);
+        if (stream->profile.quickack)
+            sio_sockopt_rearm(fd, &stream->profile);
         stream->user_callback(sio, stream, SIO_STREAM_DATA, stream->user_arg);
     }
     return 0;
@@ -56,8 +58,11 @@ static int _sio_stream_write(struct sio *sio, struct sio_fd *sfd, int fd, struct
             return 1;
     } else {
         sio_buffer_erase(stream->outbuf, bytes);
-        if (bytes == size)
+        if (bytes == size) {
             sio_unwatch_write(sio, sfd);
+            if (stream->drain_notify) /* 回调中可能关闭stream, 之后不能再访问 */
+                stream->user_callback(sio, stream, SIO_STREAM_DRAINED, stream->user_arg);
+        }
     }
     return 0;
 }
@@ -86,9 +91,121 @@ static void _sio_stream_callback(struct sio *sio, struct sio_fd *sfd, int fd, en
     }
 }
 
-static void _sio_connect_callback(struct sio *sio, struct sio_fd *sfd, int fd, enum sio_event event, void *arg)
+static uint64_t _sio_stream_cur_time_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void _sio_connect_callback(struct sio *sio, struct sio_fd *sfd, int fd, enum sio_event event, void *arg);
+
+static void _sio_stream_attempt_close(struct sio *sio, struct sio_stream_attempt *attempt)
+{
+    if (attempt->sfd) {
+        sio_del(sio, attempt->sfd);
+        attempt->sfd = NULL;
+    }
+    if (attempt->sock != -1) {
+        close(attempt->sock);
+        attempt->sock = -1;
+    }
+}
+
+static int _sio_stream_attempt_start(struct sio *sio, struct sio_stream_attempt *attempt)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    sio_sockopt_apply(sock, &attempt->stream->profile);
+
+    int ret = connect(sock, (struct sockaddr *)&attempt->addr, sizeof(attempt->addr));
+    if (ret == -1 && errno != EINPROGRESS) {
+        close(sock);
+        return -1;
+    }
+    attempt->sock = sock;
+    attempt->sfd = sio_add(sio, sock, _sio_connect_callback, attempt);
+    if (!attempt->sfd) {
+        _sio_stream_attempt_close(sio, attempt);
+        return -1;
+    }
+    /* 无论连接是否立即完成, 都推迟到异步通知 */
+    sio_watch_write(sio, attempt->sfd);
+    return 0;
+}
+
+/* 按顺序发起下一个候选地址的连接, 跳过无法发起的地址 */
+static int _sio_stream_attempt_next(struct sio *sio, struct sio_stream *stream)
+{
+    while (stream->addr_next < stream->addr_count) {
+        struct sio_stream_attempt *attempt = stream->attempts + stream->addr_next++;
+        if (_sio_stream_attempt_start(sio, attempt) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+static int _sio_stream_attempt_inflight(struct sio_stream *stream)
+{
+    uint32_t i;
+    for (i = 0; i < stream->addr_next; ++i) {
+        if (stream->attempts[i].sock != -1)
+            return 1;
+    }
+    return 0;
+}
+
+/* 结束连接阶段: 停止定时器, 关闭所有未胜出的连接尝试 */
+static void _sio_stream_connect_cleanup(struct sio *sio, struct sio_stream *stream)
+{
+    if (stream->conn_timer_on == 1)
+        sio_stop_timer(sio, &stream->conn_timer);
+    if (stream->stagger_timer_on == 1)
+        sio_stop_timer(sio, &stream->stagger_timer);
+    stream->conn_timer_on = 0;
+    stream->stagger_timer_on = 0;
+
+    uint32_t i;
+    for (i = 0; i < stream->addr_count; ++i)
+        _sio_stream_attempt_close(sio, stream->attempts + i);
+    free(stream->attempts);
+    stream->attempts = NULL;
+    stream->addr_count = 0;
+    stream->addr_next = 0;
+}
+
+static void _sio_stream_connect_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_stream *stream = arg;
+
+    stream->conn_timer_on = 0;
+    _sio_stream_connect_cleanup(sio, stream);
+    stream->user_callback(sio, stream, SIO_STREAM_CONNECT_TIMEOUT, stream->user_arg);
+}
+
+static void _sio_stream_stagger_timer(struct sio *sio, struct sio_timer *timer, void *arg)
 {
     struct sio_stream *stream = arg;
+
+    stream->stagger_timer_on = 0;
+    if (_sio_stream_attempt_next(sio, stream) == -1 && !_sio_stream_attempt_inflight(stream)) {
+        _sio_stream_connect_cleanup(sio, stream);
+        stream->user_callback(sio, stream, SIO_STREAM_ERROR, stream->user_arg);
+        return;
+    }
+    if (stream->addr_next < stream->addr_count) {
+        sio_start_timer(sio, &stream->stagger_timer, stream->conn_stagger, _sio_stream_stagger_timer, stream);
+        stream->stagger_timer_on = 1;
+    }
+}
+
+static void _sio_connect_callback(struct sio *sio, struct sio_fd *sfd, int fd, enum sio_event event, void *arg)
+{
+    struct sio_stream_attempt *attempt = arg;
+    struct sio_stream *stream = attempt->stream;
     
     int ret, error;
     socklen_t optlen = sizeof(error);
@@ -96,6 +213,13 @@ static void _sio_connect_callback(struct sio *sio, struct sio_fd *sfd, int fd, e
     case SIO_WRITE:
         ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &optlen);
         if (ret == 0 && error == 0) {
+            /* 胜出的连接接管stream, 其余尝试全部关闭 */
+            stream->sock = attempt->sock;
+            stream->sfd = attempt->sfd;
+            attempt->sock = -1;
+            attempt->sfd = NULL;
+            _sio_stream_connect_cleanup(sio, stream);
+
             stream->type = SIO_STREAM_NORMAL;
             sio_watch_read(sio, sfd);
             if (!sio_buffer_length(stream->outbuf))
@@ -105,7 +229,12 @@ static void _sio_connect_callback(struct sio *sio, struct sio_fd *sfd, int fd, e
             break;
         }
     case SIO_ERROR:
-        stream->user_callback(sio, stream, SIO_STREAM_ERROR, stream->user_arg);
+        /* 该地址失败, 立即尝试下一个候选地址, 全部失败才通知用户 */
+        _sio_stream_attempt_close(sio, attempt);
+        if (_sio_stream_attempt_next(sio, stream) == -1 && !_sio_stream_attempt_inflight(stream)) {
+            _sio_stream_connect_cleanup(sio, stream);
+            stream->user_callback(sio, stream, SIO_STREAM_ERROR, stream->user_arg);
+        }
         break;
     default:
         break;
@@ -122,6 +251,7 @@ static struct sio_stream *_sio_stream_new(int sock, enum sio_stream_type type,
     stream->user_arg = user_arg;
     stream->inbuf = sio_buffer_new();
     stream->outbuf = sio_buffer_new();
+    sio_sockopt_profile_init(&stream->profile);
     return stream;
 }
 
@@ -133,10 +263,10 @@ static void _sio_accept_callback(struct sio *sio, struct sio_fd *sfd, int fd, en
     if (sock == -1)
         return;
     fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
-    int nodelay = 1;
-    setsockopt(sock, SOL_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    sio_sockopt_apply(sock, &acceptor->profile);
 
     struct sio_stream *stream = _sio_stream_new(sock, SIO_STREAM_NORMAL, acceptor->user_callback, acceptor->user_arg);
+    stream->profile = acceptor->profile;
     stream->sfd = sio_add(sio, sock, _sio_stream_callback, stream);
     if (!stream->sfd) {
         return sio_stream_close(sio, stream);
@@ -147,15 +277,24 @@ static void _sio_accept_callback(struct sio *sio, struct sio_fd *sfd, int fd, en
 
 void sio_stream_close(struct sio *sio, struct sio_stream *stream)
 {
+    if (stream->type == SIO_STREAM_CONNECT)
+        _sio_stream_connect_cleanup(sio, stream);
     if (stream->sfd)
         sio_del(sio, stream->sfd);
-    close(stream->sock);
+    if (stream->sock != -1)
+        close(stream->sock);
     sio_buffer_free(stream->inbuf);
     sio_buffer_free(stream->outbuf);
     free(stream);
 }
 
 struct sio_stream *sio_stream_listen(struct sio *sio, const char *ipv4, uint16_t port, sio_stream_callback_t callback, void *arg)
+{
+    return sio_stream_listen_profile(sio, ipv4, port, NULL, callback, arg);
+}
+
+struct sio_stream *sio_stream_listen_profile(struct sio *sio, const char *ipv4, uint16_t port,
+        const struct sio_sockopt_profile *profile, sio_stream_callback_t callback, void *arg)
 {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) 
@@ -163,6 +302,9 @@ struct sio_stream *sio_stream_listen(struct sio *sio, const char *ipv4, uint16_t
     fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
     int on = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    /* 缓冲区大小需在listen前设置, 才能在握手时协商窗口扩大因子 */
+    if (profile)
+        sio_sockopt_apply(sock, profile);
 
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
@@ -175,6 +317,8 @@ struct sio_stream *sio_stream_listen(struct sio *sio, const char *ipv4, uint16_t
     listen(sock, 1024);
 
     struct sio_stream *stream = _sio_stream_new(sock, SIO_STREAM_LISTEN, callback, arg);
+    if (profile)
+        stream->profile = *profile;
     stream->sfd = sio_add(sio, sock, _sio_accept_callback, stream);
     if (!stream->sfd) {
         sio_stream_close(sio, stream);
@@ -186,39 +330,87 @@ struct sio_stream *sio_stream_listen(struct sio *sio, const char *ipv4, uint16_t
 
 struct sio_stream *sio_stream_connect(struct sio *sio, const char *ipv4, uint16_t port, sio_stream_callback_t callback, void *arg)
 {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1)
-        return NULL;
-    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
-    int nodelay = 1;
-    setsockopt(sock, SOL_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
-    
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = inet_addr(ipv4);
-    int ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-    if (ret == -1 && errno != EINPROGRESS) {
-        close(sock);
+    return sio_stream_connect_multi(sio, &ipv4, 1, port, 0, 0, NULL, callback, arg);
+}
+
+struct sio_stream *sio_stream_connect_multi(struct sio *sio, const char **ipv4s, uint32_t count, uint16_t port,
+        uint64_t timeout_ms, uint64_t stagger_ms, const struct sio_sockopt_profile *profile,
+        sio_stream_callback_t callback, void *arg)
+{
+    if (!count)
         return NULL;
+
+    struct sio_stream_attempt *attempts = calloc(count, sizeof(*attempts));
+    uint32_t i;
+    for (i = 0; i < count; ++i) {
+        attempts[i].sock = -1;
+        attempts[i].addr.sin_family = AF_INET;
+        attempts[i].addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, ipv4s[i], &attempts[i].addr.sin_addr) != 1) {
+            free(attempts);
+            return NULL;
+        }
     }
-    struct sio_stream *stream = _sio_stream_new(sock, SIO_STREAM_CONNECT, callback, arg);
-    stream->sfd = sio_add(sio, sock, _sio_connect_callback, stream);
-    if (!stream->sfd) {
+
+    struct sio_stream *stream = _sio_stream_new(-1, SIO_STREAM_CONNECT, callback, arg);
+    stream->addr_count = count;
+    stream->attempts = attempts;
+    stream->conn_stagger = stagger_ms;
+    if (profile)
+        stream->profile = *profile;
+    for (i = 0; i < count; ++i)
+        attempts[i].stream = stream;
+
+    if (_sio_stream_attempt_next(sio, stream) == -1) {
         sio_stream_close(sio, stream);
         return NULL;
     }
-    /* 无论连接是否立即完成, 都推迟到异步通知 */
-    sio_watch_write(sio, stream->sfd);
+    if (timeout_ms) {
+        sio_start_timer(sio, &stream->conn_timer, timeout_ms, _sio_stream_connect_timer, stream);
+        stream->conn_timer_on = 1;
+    }
+    if (stream->addr_next < stream->addr_count) {
+        sio_start_timer(sio, &stream->stagger_timer, stagger_ms, _sio_stream_stagger_timer, stream);
+        stream->stagger_timer_on = 1;
+    }
     return stream;
 }
 
 void sio_stream_detach(struct sio *sio, struct sio_stream *stream)
 {
+    if (stream->type == SIO_STREAM_CONNECT) {
+        /* 挂起连接阶段的定时器, attach时按剩余时间恢复 */
+        if (stream->conn_timer_on == 1) {
+            sio_stop_timer(sio, &stream->conn_timer);
+            stream->conn_timer_on = 2;
+        }
+        if (stream->stagger_timer_on == 1) {
+            sio_stop_timer(sio, &stream->stagger_timer);
+            stream->stagger_timer_on = 2;
+        }
+        uint32_t i;
+        for (i = 0; i < stream->addr_next; ++i) {
+            struct sio_stream_attempt *attempt = stream->attempts + i;
+            if (attempt->sfd) {
+                sio_del(sio, attempt->sfd);
+                attempt->sfd = NULL;
+            }
+        }
+        return;
+    }
     sio_del(sio, stream->sfd);
     stream->sfd = NULL;
 }
 
+static void _sio_stream_resume_timer(struct sio *sio, struct sio_timer *timer, char *timer_on, sio_timer_callback_t callback, void *arg)
+{
+    if (*timer_on != 2)
+        return;
+    uint64_t now = _sio_stream_cur_time_ms();
+    sio_start_timer(sio, timer, timer->expire > now ? timer->expire - now : 0, callback, arg);
+    *timer_on = 1;
+}
+
 int sio_stream_attach(struct sio *sio, struct sio_stream *stream)
 {
     switch (stream->type) {
@@ -229,10 +421,20 @@ int sio_stream_attach(struct sio *sio, struct sio_stream *stream)
         sio_watch_read(sio, stream->sfd);
         break;
     case SIO_STREAM_CONNECT:
-        stream->sfd = sio_add(sio, stream->sock, _sio_connect_callback, stream);
-        if (!stream->sfd)
-            return -1;
-        sio_watch_write(sio, stream->sfd);
+        {
+            uint32_t i;
+            for (i = 0; i < stream->addr_next; ++i) {
+                struct sio_stream_attempt *attempt = stream->attempts + i;
+                if (attempt->sock == -1)
+                    continue;
+                attempt->sfd = sio_add(sio, attempt->sock, _sio_connect_callback, attempt);
+                if (!attempt->sfd)
+                    return -1;
+                sio_watch_write(sio, attempt->sfd);
+            }
+            _sio_stream_resume_timer(sio, &stream->conn_timer, &stream->conn_timer_on, _sio_stream_connect_timer, stream);
+            _sio_stream_resume_timer(sio, &stream->stagger_timer, &stream->stagger_timer_on, _sio_stream_stagger_timer, stream);
+        }
         break;
     case SIO_STREAM_NORMAL:
         stream->sfd = sio_add(sio, stream->sock, _sio_stream_callback, stream);
@@ -284,6 +486,11 @@ uint64_t sio_stream_pending(struct sio_stream *stream)
     return sio_buffer_length(stream->outbuf);
 }
 
+void sio_stream_notify_drain(struct sio_stream *stream, char enable)
+{
+    stream->drain_notify = enable;
+}
+
 int sio_stream_peer_address(struct sio_stream *stream, char *address, uint32_t len, uint16_t *port)
 {
     struct sockaddr_in name;
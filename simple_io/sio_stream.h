@@ -2,7 +2,10 @@
 #define SIMPLE_IO_SIO_STREAM_H
 
 #include <stdint.h>
+#include <netinet/in.h>
 #include "sio_buffer.h"
+#include "sio_timer.h"
+#include "sio_sockopt.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +18,8 @@ enum sio_stream_event {
     SIO_STREAM_ERROR,         /**< 连接出现错误       */
     SIO_STREAM_CLOSE,         /**< 连接被关闭      */
 	SIO_STREAM_CONNECTED, /**< 连接建立成功 */
+    SIO_STREAM_CONNECT_TIMEOUT, /**< 连接超时, 所有候选地址均未在限定时间内建立连接 */
+    SIO_STREAM_DRAINED, /**< 写缓冲区已全部发出, 仅在sio_stream_notify_drain开启后回调 */
 };
 
 struct sio;
@@ -31,15 +36,33 @@ enum sio_stream_type {
     SIO_STREAM_NORMAL,
 };
 
+// 对某个候选地址发起的一次异步连接
+struct sio_stream_attempt {
+    int sock;         /**< socket描述符, -1表示尚未发起或已结束       */
+    struct sio_fd *sfd;       /**< 注册在sio上的socket       */
+    struct sockaddr_in addr;      /**< 候选地址       */
+    struct sio_stream *stream;        /**< 所属stream       */
+};
+
 // 封装TCP连接
 struct sio_stream {
     enum sio_stream_type type;        /**< socket类型       */
-    int sock;         /**<  socket描述符      */
+    int sock;         /**<  socket描述符, 连接建立前为-1      */
     struct sio_fd *sfd;       /**< 注册在sio上的socekt       */
     sio_stream_callback_t user_callback;          /**< 用户回调       */
     void *user_arg;       /**< 用户参数       */
     struct sio_buffer *inbuf;         /**< 读缓冲       */
     struct sio_buffer *outbuf;        /**< 写缓冲       */
+    struct sio_sockopt_profile profile;       /**< socket选项模板, 监听socket的模板被accept的连接继承       */
+    uint32_t addr_count;      /**< 候选地址个数, 只在连接阶段有效       */
+    uint32_t addr_next;       /**< 下一个待发起连接的候选地址       */
+    struct sio_stream_attempt *attempts;      /**< 每个候选地址的连接尝试       */
+    uint64_t conn_stagger;        /**< 相邻候选地址发起连接的间隔(毫秒)       */
+    struct sio_timer conn_timer;      /**< 连接超时定时器       */
+    struct sio_timer stagger_timer;       /**< 交错发起连接定时器       */
+    char conn_timer_on;       /**< 0:未启动, 1:运行中, 2:随detach挂起       */
+    char stagger_timer_on;        /**< 同上       */
+    char drain_notify;        /**< 写缓冲区清空时回调SIO_STREAM_DRAINED       */
 };
 
 /**
@@ -57,6 +80,23 @@ struct sio_stream {
  * @date 2014/03/30 16:12:30
 **/
 struct sio_stream *sio_stream_listen(struct sio *sio, const char *ipv4, uint16_t port, sio_stream_callback_t callback, void *arg);
+/**
+ * @brief 按socket选项模板启动TCP监听套接字, 模板同时应用到之后accept的每个连接
+ *
+ * @param [in] sio   : struct sio*
+ * @param [in] ipv4   : const char*
+ * @param [in] port   : uint16_t
+ * @param [in] profile   : const struct sio_sockopt_profile* 为NULL则使用默认模板
+ * @param [in] callback   : sio_stream_callback_t
+ * @param [in] arg   : void*
+ * @return  struct sio_stream* 
+ * @retval   
+ * @see 
+ * @author liangdong
+ * @date 2014/09/15 10:41:26
+**/
+struct sio_stream *sio_stream_listen_profile(struct sio *sio, const char *ipv4, uint16_t port,
+        const struct sio_sockopt_profile *profile, sio_stream_callback_t callback, void *arg);
 /**
  * @brief 发起TCP异步连接
  *
@@ -72,6 +112,29 @@ struct sio_stream *sio_stream_listen(struct sio *sio, const char *ipv4, uint16_t
  * @date 2014/03/30 16:12:47
 **/
 struct sio_stream *sio_stream_connect(struct sio *sio, const char *ipv4, uint16_t port, sio_stream_callback_t callback, void *arg);
+/**
+ * @brief 向多个候选地址交错发起TCP异步连接, 最先建立的连接胜出, 其余连接被关闭.
+ *        首个地址立即发起, 之后每隔stagger_ms或者在前一个尝试失败时发起下一个;
+ *        所有尝试均失败回调SIO_STREAM_ERROR, 超过timeout_ms回调SIO_STREAM_CONNECT_TIMEOUT.
+ *
+ * @param [in] sio   : struct sio*
+ * @param [in] ipv4s   : const char** 点分十进制IPV4地址数组, 不做域名解析
+ * @param [in] count   : uint32_t 地址个数, 必须>0
+ * @param [in] port   : uint16_t
+ * @param [in] timeout_ms   : uint64_t 连接超时, 0表示不限制
+ * @param [in] stagger_ms   : uint64_t 相邻候选地址的发起间隔
+ * @param [in] profile   : const struct sio_sockopt_profile* 在connect前应用, 为NULL则使用默认模板
+ * @param [in] callback   : sio_stream_callback_t
+ * @param [in] arg   : void*
+ * @return  struct sio_stream* 
+ * @retval   地址非法或所有地址都无法发起连接返回NULL
+ * @see 
+ * @author liangdong
+ * @date 2014/09/12 15:20:13
+**/
+struct sio_stream *sio_stream_connect_multi(struct sio *sio, const char **ipv4s, uint32_t count, uint16_t port,
+        uint64_t timeout_ms, uint64_t stagger_ms, const struct sio_sockopt_profile *profile,
+        sio_stream_callback_t callback, void *arg);
 /**
  * @brief 更新sio_stream的回调函数和用户参数
  *
@@ -158,6 +221,18 @@ struct sio_buffer *sio_stream_buffer(struct sio_stream *stream);
  * @date 2014/04/21 14:42:04
 **/
 uint64_t sio_stream_pending(struct sio_stream *stream);
+/**
+ * @brief 开启或关闭写缓冲区清空的通知, 开启后每次缓冲区中的数据全部发出时回调SIO_STREAM_DRAINED
+ *
+ * @param [in] stream   : struct sio_stream*
+ * @param [in] enable   : char
+ * @return  void
+ * @retval
+ * @see
+ * @author liangdong
+ * @date 2014/10/24 10:12:36
+**/
+void sio_stream_notify_drain(struct sio_stream *stream, char enable);
 /**
  * @brief 返回连接的对端地址
  *
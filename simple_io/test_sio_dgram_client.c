@@ -33,6 +33,23 @@ static void on_timer(struct sio *sio, struct sio_timer *timer, void *arg)
     if (sio_dgram_write(sio, sdgram, "127.0.0.1", 8990, "ping", 4) == -1) {
         printf("sio_dgram_write=-1\n");
     }
+
+    /* 一次调用发出4个ping, 由内核按4字节分段 */
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(8990);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int sent = sio_dgram_write_gso(sio, sdgram, &addr, "pingpingpingping", 16, 4);
+    if (sent != 4) {
+        printf("sio_dgram_write_gso=%d\n", sent);
+    }
+
+    /* 超过服务端接收槽位的datagram, 服务端截断并计数 */
+    char large[2048];
+    memset(large, 'x', sizeof(large));
+    if (sio_dgram_write(sio, sdgram, "127.0.0.1", 8990, large, sizeof(large)) == -1) {
+        printf("sio_dgram_write=-1\n");
+    }
     sio_start_timer(sio, timer, 1000, on_timer, sdgram);
 }
 
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include "sio.h"
+#include "sio_dgram.h"
+
+static volatile char server_quit = 0;
+
+/* 工作线程, 每个线程一个sio和一个SO_REUSEPORT socket */
+struct sio_dgram_work_thread {
+    uint32_t index; /* 第几个线程, 同时是绑定的CPU */
+    pthread_t tid; /* 线程ID */
+    struct sio *sio; /* 线程事件循环 */
+};
+
+static void on_dgram(struct sio *sio, struct sio_dgram *sdgram, struct sockaddr_in *source, char *data, uint64_t size, void *arg)
+{
+    struct sio_dgram_work_thread *thread = arg;
+
+    printf("[Thread-%u]on_dgram=%.*s\n", thread->index, (int)size, data);
+    if (sio_dgram_response(sio, sdgram, source, "pong", 4) == -1) {
+        printf("sio_dgram_response=-1\n");
+    }
+}
+
+static void *sio_dgram_work_thread_main(void *arg)
+{
+    struct sio_dgram_work_thread *thread = arg;
+
+    /* 线程绑定到与socket下标相同的CPU, 配合cBPF按收包CPU分发 */
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(thread->index, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    while (!server_quit)
+        sio_run(thread->sio);
+    return NULL;
+}
+
+static void sio_dgram_quit_handler(int signo)
+{
+    server_quit = 1;
+}
+
+static void sio_dgram_server_signal()
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sio_dgram_quit_handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    sio_dgram_server_signal();
+
+    uint32_t thread_count = 4;
+    struct sio_dgram_work_thread *threads = calloc(thread_count, sizeof(*threads));
+    struct sio **sios = calloc(thread_count, sizeof(*sios));
+
+    uint32_t i;
+    for (i = 0; i < thread_count; ++i) {
+        threads[i].index = i;
+        assert((threads[i].sio = sio_new()));
+        sios[i] = threads[i].sio;
+    }
+
+    /* 在事件循环启动前打开socket组 */
+    struct sio_dgram_group *group = sio_dgram_open_reuseport(sios, thread_count, "0.0.0.0", 8990, 1, on_dgram, NULL);
+    if (!group) {
+        printf("sio_dgram_open_reuseport=NULL\n");
+        return -1;
+    }
+    for (i = 0; i < thread_count; ++i) {
+        sio_dgram_set(sios[i], group->sdgrams[i], on_dgram, threads + i);
+        /* 合并同一来源的连续datagram, 逐个回调时仍拆回单个datagram */
+        if (sio_dgram_set_gro(sios[i], group->sdgrams[i], 1) == -1) {
+            printf("sio_dgram_set_gro=-1\n");
+        }
+    }
+
+    for (i = 0; i < thread_count; ++i)
+        assert(pthread_create(&threads[i].tid, NULL, sio_dgram_work_thread_main, threads + i) == 0);
+    for (i = 0; i < thread_count; ++i)
+        pthread_join(threads[i].tid, NULL);
+
+    sio_dgram_group_close(sios, group);
+    for (i = 0; i < thread_count; ++i)
+        sio_free(sios[i]);
+    free(sios);
+    free(threads);
+    printf("dgram_multi_server=quit\n");
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 sts=4 tw=100 */
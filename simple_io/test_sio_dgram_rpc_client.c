@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include "sio.h"
+#include "sio_rpc.h"
+#include "sio_dgram_rpc.h"
+
+static char client_quit = 0;
+
+static void sio_dgram_rpc_upstream_callback(struct sio_dgram_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg)
+{
+    if (is_timeout)
+        printf("rpc timeout\n");
+    else
+        printf("rpc resp:%.*s", size, response);
+
+    if (!client_quit)
+        sio_dgram_rpc_call(client, 0, 300, 3, "ping\n", 5, sio_dgram_rpc_upstream_callback, NULL);
+}
+
+static void sio_dgram_rpc_dump_callback(struct sio_dgram_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg)
+{
+    /* 服务端的应答超长, 以失败应答立即回调而不是等待1200ms */
+    if (is_timeout)
+        printf("rpc dump failed\n");
+    else
+        printf("rpc dump:%u bytes\n", size);
+
+    if (!client_quit)
+        sio_dgram_rpc_call(client, 1, 300, 3, NULL, 0, sio_dgram_rpc_dump_callback, NULL);
+}
+
+static void sio_dgram_rpc_quit_handler(int signo)
+{
+    client_quit = 1;
+}
+
+static void sio_dgram_rpc_client_signal()
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sio_dgram_rpc_quit_handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    sio_dgram_rpc_client_signal();
+
+    struct sio *sio = sio_new();
+    assert(sio);
+
+    struct sio_rpc *rpc = sio_rpc_new(sio, 10 * 1024 * 1024/*10MB read/write buffer limit*/);
+    assert(rpc);
+
+    struct sio_dgram_rpc_client *client = sio_dgram_rpc_client_new(rpc);
+    assert(client);
+    sio_dgram_rpc_add_upstream(client, "127.0.0.1", 8991);
+
+    /* 请求类型0, 请求超时300ms, 丢包后以相同请求ID重发3次, 总共最多花费300ms * 4 = 1200ms */
+    sio_dgram_rpc_call(client, 0, 300, 3, "ping\n", 5, sio_dgram_rpc_upstream_callback, NULL);
+    sio_dgram_rpc_call(client, 1, 300, 3, NULL, 0, sio_dgram_rpc_dump_callback, NULL);
+
+    while (!client_quit) {
+        sio_run(sio);
+    }
+
+    sio_dgram_rpc_client_free(client);
+
+    sio_rpc_free(rpc);
+    sio_free(sio);
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include "sio.h"
+#include "sio_rpc.h"
+#include "sio_dgram_rpc.h"
+
+static void sio_dgram_rpc_method_callback(struct sio_dgram_rpc_server *server, struct sio_dgram_rpc_response *resp, void *arg)
+{
+    uint32_t req_len;
+    const char *req = sio_dgram_rpc_request(resp, &req_len);
+
+    /* 同步处理, 应答被缓存, 客户端重发的同一请求不会再次执行 */
+    printf("rpc req:%.*s", req_len, req);
+    sio_dgram_rpc_finish(resp, "pong\n", 5);
+    printf("rpc resp:pong\n");
+}
+
+static void sio_dgram_rpc_dump_callback(struct sio_dgram_rpc_server *server, struct sio_dgram_rpc_response *resp, void *arg)
+{
+    /* 应答超过一个datagram的容量, 客户端收到失败应答后立即回调 */
+    static char dump[SIO_DGRAM_RPC_MAX_BODY + 1];
+    if (sio_dgram_rpc_finish(resp, dump, sizeof(dump)) == -1)
+        printf("rpc dump:too large\n");
+}
+
+static char server_quit = 0;
+
+static void sio_dgram_rpc_quit_handler(int signo)
+{
+    server_quit = 1;
+}
+
+static void sio_dgram_rpc_server_signal()
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sio_dgram_rpc_quit_handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    sio_dgram_rpc_server_signal();
+
+    struct sio *sio = sio_new();
+    assert(sio);
+
+    struct sio_rpc *rpc = sio_rpc_new(sio, 10 * 1024 * 1024/*10MB read/write buffer limit*/);
+    assert(rpc);
+
+    /* 应答缓存2秒, 覆盖客户端300ms * 3次的重发窗口 */
+    struct sio_dgram_rpc_server *server = sio_dgram_rpc_server_new(rpc, "0.0.0.0", 8991, 2000);
+    assert(server);
+
+    sio_dgram_rpc_server_add_method(server, 0, sio_dgram_rpc_method_callback, NULL);
+    sio_dgram_rpc_server_add_method(server, 1, sio_dgram_rpc_dump_callback, NULL);
+
+    while (!server_quit) {
+        sio_run(sio);
+    }
+
+    sio_dgram_rpc_server_free(server);
+
+    sio_rpc_free(rpc);
+    sio_free(sio);
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 sts=4 tw=100 */
@@ -34,6 +34,32 @@ static void on_dgram(struct sio *sio, struct sio_dgram *sdgram, struct sockaddr_
         printf("sio_dgram_response=-1\n");
     }
 }
+
+/* 上一批取走的接收槽位 */
+static char *last_taken = NULL;
+
+static void on_dgram_batch(struct sio *sio, struct sio_dgram *sdgram, struct sio_dgram_msg *msgs, uint32_t count, void *arg)
+{
+    /* 取走本批第一个请求的槽位留到下一批(模拟异步处理), 上一批取走的归还空闲池 */
+    char *taken = sio_dgram_take(sdgram, msgs[0].data);
+    if (last_taken)
+        sio_dgram_release(sdgram, last_taken);
+    last_taken = taken;
+
+    /* 原地把每个请求改写为应答, 一次系统调用全部发回 */
+    uint32_t i;
+    for (i = 0; i < count; ++i) {
+        if (msgs[i].truncated)
+            printf("on_dgram_batch truncated=%lu\n", (unsigned long)sio_dgram_truncated(sdgram));
+        else
+            printf("on_dgram_batch=%.*s index=%u count=%u\n", (int)msgs[i].size, msgs[i].data, i, count);
+        msgs[i].data = "pong";
+        msgs[i].size = 4;
+    }
+    if (sio_dgram_write_batch(sio, sdgram, msgs, count) != count) {
+        printf("sio_dgram_write_batch<%u\n", count);
+    }
+}
 static char server_quit = 0;
 
 static void sio_dgram_quit_handler(int signo)
@@ -66,10 +92,16 @@ int main(int argc, char **argv)
         sio_free(sio);
         return -1;
     }
+    /* 每次可读事件最多收取32个datagram */
+    assert(sio_dgram_set_batch(sio, sdgram, 32, on_dgram_batch, NULL) == 0);
+    /* 超过1KB的datagram被截断, 预留8个空闲槽位补充被取走的槽位 */
+    assert(sio_dgram_set_buffer(sio, sdgram, 1024, 8) == 0);
 
     while (!server_quit)
         sio_run(sio);
 
+    if (last_taken)
+        sio_dgram_release(sdgram, last_taken);
     sio_dgram_close(sio, sdgram);
     sio_free(sio);
     printf("dgram_server=quit\n");
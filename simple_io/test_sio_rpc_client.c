@@ -23,18 +23,51 @@
 #include <assert.h>
 #include "sio.h"
 #include "sio_rpc.h"
+#include "test_sio_rpc_rle.h"
 
 static char client_quit = 0;
 
 static void sio_rpc_upstream_callback(struct sio_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg)
 {
-    if (is_timeout)
+    if (is_timeout == SIO_RPC_CALL_OVERLOADED)
+        printf("rpc overloaded\n");
+    else if (is_timeout)
         printf("rpc timeout\n");
     else
         printf("rpc resp:%.*s", size, response);
     
+    /* 请求体是常量, 不需要框架拷贝, 也不需要释放 */
     if (!client_quit)    
-        sio_rpc_call(client, 0, 300, 3, "ping\n", 5, sio_rpc_upstream_callback,  NULL);
+        sio_rpc_call_nocopy(client, 0, 300, 3, "ping\n", 5, NULL, sio_rpc_upstream_callback,  NULL);
+}
+
+static uint32_t checksum_seq = 0;
+
+static void sio_rpc_checksum_callback(struct sio_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg)
+{
+    if (is_timeout)
+        printf("rpc checksum timeout\n");
+    else
+        printf("rpc checksum:%.*s", size, response);
+
+    /* 类型2的方法在服务端的工作线程中执行; 请求体在栈上, 由框架拷贝 */
+    if (!client_quit) {
+        char req[32];
+        int len = snprintf(req, sizeof(req), "ping %u\n", ++checksum_seq);
+        sio_rpc_call(client, 2, 300, 3, req, len, sio_rpc_checksum_callback, NULL);
+    }
+}
+
+static void sio_rpc_dump_callback(struct sio_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg)
+{
+    if (is_timeout)
+        printf("rpc dump timeout\n");
+    else
+        printf("rpc dump:%u bytes\n", size);
+
+    /* 大应答与类型0的小应答共享连接, 服务端优先发送小应答 */
+    if (!client_quit)
+        sio_rpc_call_nocopy(client, 3, 1000, 3, NULL, 0, NULL, sio_rpc_dump_callback, NULL);
 }
 
 static void sio_rpc_quit_handler(int signo)
@@ -60,12 +93,24 @@ int main(int argc, char **argv)
 
     struct sio_rpc *rpc = sio_rpc_new(sio, 10 * 1024 * 1024/*10MB read/write buffer limit*/);
     assert(rpc);
+    sio_rpc_set_connect_timeout(rpc, 500); /* 连接500ms未建立则放弃, 等待重连 */
 
     struct sio_rpc_client *client = sio_rpc_client_new(rpc);
+    sio_rpc_client_set_balance(client, SIO_RPC_BALANCE_EWMA); /* 优先选择延迟低, 排队少的upstream */
+    sio_rpc_client_set_hedge(client, 95, 10, 5); /* 超过p95延迟(至少10ms)无应答则对冲, 对冲请求不超过5% */
+    sio_rpc_client_set_breaker(client, 50, 20, 5, 5); /* 10秒内失败过半或连续失败5次, 摘除5秒后探测 */
+    sio_rpc_client_set_connections(client, 2); /* 每个upstream建立2条连接 */
+    sio_rpc_client_set_coalesce(client, 1); /* 合并同一轮sio_run中的请求 */
+    sio_rpc_client_set_cancel(client, 1); /* 超时或对冲落败的副本通知服务端取消 */
+    assert(sio_rpc_add_codec(rpc, 1, sio_rpc_rle_compress, sio_rpc_rle_decompress, NULL) == 0);
+    assert(sio_rpc_client_set_compress(client, 1, 1024) == 0); /* 超过1KB的请求压缩, 并接受压缩的应答 */
+    sio_rpc_client_set_compact(client, 1); /* 提议使用紧凑格式的header, 服务端确认后生效 */
     sio_rpc_add_upstream(client, "127.0.0.1", 8989);
     
     /* 请求类型0, 请求超时300ms, 重试3次, 总共最多花费300ms * 3 = 900ms */
     sio_rpc_call(client, 0, 300, 3, "ping\n", 5, sio_rpc_upstream_callback,  NULL);
+    sio_rpc_call(client, 2, 300, 3, "ping\n", 5, sio_rpc_checksum_callback,  NULL);
+    sio_rpc_call(client, 3, 1000, 3, NULL, 0, sio_rpc_dump_callback,  NULL);
 
     while (!client_quit) {
         sio_run(sio);
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sio.h"
+#include "sio_rpc.h"
+
+#define CALL_THREAD_COUNT 4
+
+static volatile char client_quit = 0;
+
+static void sio_rpc_mt_callback(struct sio_rpc_client_mt *mt, char is_timeout, const char *response, uint32_t size, void *arg)
+{
+    /* 未设置executor, 在sio_run线程中回调 */
+    if (is_timeout)
+        printf("rpc timeout\n");
+    else
+        printf("thread %ld rpc resp:%.*s", (long)arg, size, response);
+}
+
+/* 业务线程, 直接发起调用, 不需要自己实现到sio_run线程的队列 */
+static void *sio_rpc_call_thread_main(void *arg)
+{
+    struct sio_rpc_client_mt *mt = arg;
+    static long thread_index = 0;
+    long index = __sync_fetch_and_add(&thread_index, 1);
+
+    while (!client_quit) {
+        sio_rpc_call_mt(mt, 0, 300, 3, "ping\n", 5, sio_rpc_mt_callback, (void *)index);
+        usleep(100 * 1000);
+    }
+    return NULL;
+}
+
+static void sio_rpc_quit_handler(int signo)
+{
+    client_quit = 1;
+}
+
+static void sio_rpc_client_signal()
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sio_rpc_quit_handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    sio_rpc_client_signal();
+
+    struct sio *sio = sio_new();
+    assert(sio);
+
+    struct sio_rpc *rpc = sio_rpc_new(sio, 10 * 1024 * 1024/*10MB read/write buffer limit*/);
+    assert(rpc);
+
+    struct sio_rpc_client_mt *mt = sio_rpc_client_mt_new(rpc);
+    assert(mt);
+    /* 上游和策略在sio_run线程中设置 */
+    sio_rpc_client_set_coalesce(mt->client, 1);
+    sio_rpc_add_upstream(mt->client, "127.0.0.1", 8989);
+
+    pthread_t tids[CALL_THREAD_COUNT];
+    int i;
+    for (i = 0; i < CALL_THREAD_COUNT; ++i)
+        pthread_create(&tids[i], NULL, sio_rpc_call_thread_main, mt);
+
+    while (!client_quit) {
+        sio_run(sio);
+    }
+
+    /* 先停止业务线程, 再释放mt, 未完成的调用以超时回调 */
+    for (i = 0; i < CALL_THREAD_COUNT; ++i)
+        pthread_join(tids[i], NULL);
+    sio_rpc_client_mt_free(mt);
+
+    sio_rpc_free(rpc);
+    sio_free(sio);
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 sts=4 tw=100 */
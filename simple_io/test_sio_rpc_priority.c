@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "sio.h"
+#include "sio_rpc.h"
+#include "sio_sockopt.h"
+
+/*
+ * 应答优先级演示: 同一连接上先请求11个1MB的大应答, 再请求1个小应答,
+ * 分别在关闭和开启sio_rpc_server_set_priority时打印小应答是第几个到达的.
+ * 客户端使用很小的接收缓冲区, 使服务端的连接上产生积压.
+ */
+
+#define BIG_CALLS 11
+#define BIG_SIZE (1024 * 1024)
+
+static char big[BIG_SIZE];
+
+static uint32_t arrived = 0; /* 已到达的应答个数 */
+static uint32_t small_position = 0; /* 小应答是第几个到达的 */
+
+static void sio_rpc_big_method(struct sio_rpc_server *server, struct sio_rpc_response *resp, void *arg)
+{
+    sio_rpc_finish(resp, big, sizeof(big));
+}
+
+static void sio_rpc_small_method(struct sio_rpc_server *server, struct sio_rpc_response *resp, void *arg)
+{
+    sio_rpc_finish(resp, "pong\n", 5);
+}
+
+static void sio_rpc_big_callback(struct sio_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg)
+{
+    if (is_timeout)
+        printf("rpc big timeout\n");
+    ++arrived;
+}
+
+static void sio_rpc_small_callback(struct sio_rpc_client *client, char is_timeout, const char *response, uint32_t size, void *arg)
+{
+    if (is_timeout)
+        printf("rpc small timeout\n");
+    small_position = ++arrived;
+}
+
+static void sio_rpc_run_case(struct sio *sio, uint16_t port, uint32_t small_bytes)
+{
+    struct sio_rpc *server_rpc = sio_rpc_new(sio, 100 * 1024 * 1024);
+    assert(server_rpc);
+    struct sio_rpc_server *server = sio_rpc_server_new(server_rpc, "127.0.0.1", port);
+    assert(server);
+    sio_rpc_server_add_method(server, 0, sio_rpc_big_method, NULL);
+    sio_rpc_server_add_method(server, 1, sio_rpc_small_method, NULL);
+    sio_rpc_server_set_priority(server, small_bytes);
+
+    /* 客户端单独一个rpc, 只有它的连接使用小接收缓冲区 */
+    struct sio_rpc *client_rpc = sio_rpc_new(sio, 100 * 1024 * 1024);
+    assert(client_rpc);
+    struct sio_sockopt_profile profile;
+    sio_sockopt_profile_init(&profile);
+    profile.rcvbuf = 4096;
+    sio_rpc_set_sockopt(client_rpc, &profile);
+
+    struct sio_rpc_client *client = sio_rpc_client_new(client_rpc);
+    sio_rpc_client_set_connections(client, 1);
+    sio_rpc_client_set_coalesce(client, 1); /* 所有请求在同一轮sio_run中一次发出 */
+    sio_rpc_add_upstream(client, "127.0.0.1", port);
+    int i;
+    for (i = 0; i < 3; ++i)
+        sio_run(sio);
+
+    arrived = 0;
+    small_position = 0;
+    for (i = 0; i < BIG_CALLS; ++i)
+        sio_rpc_call_nocopy(client, 0, 10000, 0, NULL, 0, NULL, sio_rpc_big_callback, NULL);
+    sio_rpc_call_nocopy(client, 1, 10000, 0, NULL, 0, NULL, sio_rpc_small_callback, NULL);
+    while (arrived < BIG_CALLS + 1)
+        sio_run(sio);
+    printf("priority=%u small response arrived %u/%u\n", small_bytes, small_position, BIG_CALLS + 1);
+
+    sio_rpc_client_free(client);
+    sio_rpc_free(client_rpc);
+    sio_rpc_server_free(server);
+    sio_rpc_free(server_rpc);
+}
+
+int main(int argc, char **argv)
+{
+    struct sio *sio = sio_new();
+    assert(sio);
+
+    sio_rpc_run_case(sio, 8992, 0); /* 按finish的顺序, 小应答排在所有大应答之后 */
+    sio_rpc_run_case(sio, 8993, 4096); /* 大应答延后, 小应答先到达 */
+
+    sio_free(sio);
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 sts=4 tw=100 */
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef SIMPLE_IO_TEST_SIO_RPC_RLE_H
+#define SIMPLE_IO_TEST_SIO_RPC_RLE_H
+
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 演示用的游程编码, 以(重复次数, 字节)对表示输入, 通信双方以相同编号注册.
+ * 实际使用时接入lz4, zstd等算法, 并可以利用按请求类型设置的字典.
+ * test_sio_rpc_client与test_sio_rpc_server共用.
+ */
+static int64_t sio_rpc_rle_compress(const char *in, uint32_t in_len, char *out, uint32_t out_len,
+        const char *dict, uint32_t dict_len, void *arg)
+{
+    uint32_t i = 0, n = 0;
+    while (i < in_len) {
+        uint32_t run = 1;
+        while (i + run < in_len && run < 255 && in[i + run] == in[i])
+            ++run;
+        if (n + 2 > out_len)
+            return -1;
+        out[n++] = (char)run;
+        out[n++] = in[i];
+        i += run;
+    }
+    return n;
+}
+
+static int sio_rpc_rle_decompress(const char *in, uint32_t in_len, char *out, uint32_t out_len,
+        const char *dict, uint32_t dict_len, void *arg)
+{
+    uint32_t i, n = 0;
+    for (i = 0; i + 1 < in_len; i += 2) {
+        uint32_t run = (unsigned char)in[i];
+        if (n + run > out_len)
+            return -1;
+        memset(out + n, in[i + 1], run);
+        n += run;
+    }
+    return (i == in_len && n == out_len) ? 0 : -1;
+}
+
+#endif
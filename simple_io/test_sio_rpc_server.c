@@ -23,6 +23,7 @@
 #include <assert.h>
 #include "sio.h"
 #include "sio_rpc.h"
+#include "test_sio_rpc_rle.h"
 #include "shash.h"
 
 /* 
@@ -76,6 +77,86 @@ static void sio_rpc_dstream_callback(struct sio_rpc_server *server, struct sio_r
     assert(shash_insert(pending_response, (const char *)&resp, sizeof(resp), timer) == 0);
 }
 
+/* 在工作线程中执行的方法: 计算请求的校验和, 直接在工作线程中finish */
+static void sio_rpc_checksum_callback(struct sio_rpc_server *server, struct sio_rpc_response *resp, void *arg)
+{
+    uint32_t req_len;
+    const char *req = sio_rpc_request(resp, &req_len);
+
+    uint32_t sum = 0, i;
+    for (i = 0; i < req_len; ++i)
+        sum = sum * 31 + (unsigned char)req[i];
+
+    char reply[32];
+    int len = snprintf(reply, sizeof(reply), "%u\n", sum);
+    sio_rpc_finish(resp, reply, len);
+}
+
+/*
+ * 返回大块数据的方法, 开启优先级后不会阻塞同一连接上的小应答.
+ * 填充伪随机字节使游程编码无法压缩, 应答保持256KB, 远超优先级阈值
+ */
+#define DUMP_SIZE (256 * 1024)
+
+static void sio_rpc_dump_callback(struct sio_rpc_server *server, struct sio_rpc_response *resp, void *arg)
+{
+    static char dump[DUMP_SIZE];
+    static int filled = 0;
+    if (!filled) {
+        uint32_t seed = 1, i;
+        for (i = 0; i < sizeof(dump); ++i) {
+            seed = seed * 1103515245 + 12345;
+            dump[i] = (char)(seed >> 16);
+        }
+        filled = 1;
+    }
+    sio_rpc_finish(resp, dump, sizeof(dump));
+}
+
+/* 每秒打印一次排队深度 */
+static void sio_rpc_depth_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct sio_rpc_server *server = arg;
+    uint32_t jobs, deferred;
+    uint64_t bytes;
+    sio_rpc_server_queue_depth(server, &jobs, &deferred, &bytes);
+    printf("rpc queue depth: jobs=%u deferred=%u bytes=%lu\n", jobs, deferred, (unsigned long)bytes);
+    sio_start_timer(sio, timer, 1000, sio_rpc_depth_timer, server);
+}
+
+/* 流式方法: 统计客户端上传的字节数, 上传结束后应答统计结果 */
+static void sio_rpc_stream_callback(struct sio_rpc_stream *stream, enum sio_rpc_stream_event event,
+        const char *data, uint32_t size, void *arg)
+{
+    uint64_t *received = arg;
+    char reply[64];
+    int len;
+
+    switch (event) {
+    case SIO_RPC_STREAM_OPEN: /* 每个流单独计数 */
+        stream->arg = calloc(1, sizeof(uint64_t));
+        break;
+    case SIO_RPC_STREAM_DATA:
+        *received += size;
+        break;
+    case SIO_RPC_STREAM_END:
+        len = snprintf(reply, sizeof(reply), "received %lu bytes\n", (unsigned long)*received);
+        printf("rpc stream %s", reply);
+        /* 计数只在这里或ERROR中释放一次, 写失败时之后的ERROR回调拿到的是NULL */
+        free(received);
+        stream->arg = NULL;
+        /* 应答很短, 初始窗口足够一次写完 */
+        sio_rpc_stream_write(stream, reply, len);
+        sio_rpc_stream_end(stream);
+        break;
+    case SIO_RPC_STREAM_ERROR:
+        free(received);
+        break;
+    default:
+        break;
+    }
+}
+
 static char server_quit = 0;
 
 static void sio_rpc_quit_handler(int signo)
@@ -106,14 +187,33 @@ int main(int argc, char **argv)
 
     struct sio_rpc_server *server = sio_rpc_server_new(rpc, "0.0.0.0", 8989);
     assert(server);
+    /* 请求在定时器中才finish, 回调返回时拷贝body, 定时器中重新sio_rpc_request获取 */
+    sio_rpc_server_set_borrow(server, 1);
 
     sio_rpc_server_add_method(server, 0, sio_rpc_dstream_callback, sio);
+    /* 同时处理中的请求超过10000个时直接以过载拒绝, 客户端换upstream重试 */
+    sio_rpc_server_set_concurrency(server, 0, 10000);
+    sio_rpc_server_add_stream_method(server, 1, sio_rpc_stream_callback, NULL);
+    /* 计算型的方法交给2个工作线程, 最多排队1000个请求 */
+    assert(sio_rpc_server_set_workers(server, 2, 1000) == 0);
+    sio_rpc_server_add_method(server, 2, sio_rpc_checksum_callback, NULL);
+    sio_rpc_server_set_dispatch(server, 2, SIO_RPC_DISPATCH_WORKER);
+    /* 超过4KB的应答在连接有积压时延后, 小应答优先发送 */
+    sio_rpc_server_add_method(server, 3, sio_rpc_dump_callback, NULL);
+    sio_rpc_server_set_priority(server, 4096);
+    /* 超过1KB的应答按客户端声明的方式压缩 */
+    assert(sio_rpc_add_codec(rpc, 1, sio_rpc_rle_compress, sio_rpc_rle_decompress, NULL) == 0);
+    sio_rpc_server_set_compress(server, 1024);
+
+    struct sio_timer depth_timer;
+    sio_start_timer(sio, &depth_timer, 1000, sio_rpc_depth_timer, server);
 
     while (!server_quit) {
         sio_run(sio);
     }
     
     sio_rpc_finish_response_onexit(sio);
+    sio_stop_timer(sio, &depth_timer);
 
     sio_rpc_server_free(server);
 
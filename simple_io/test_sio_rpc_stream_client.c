@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2014-2015  liangdong <liangdong01@baidu.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include "sio.h"
+#include "sio_rpc.h"
+
+/* 每个流上传的总字节数, 远大于流控窗口 */
+#define UPLOAD_TOTAL (64 * 1024 * 1024)
+#define UPLOAD_CHUNK (64 * 1024)
+
+static char client_quit = 0;
+
+struct upload {
+    struct sio *sio;
+    struct sio_rpc_client *client;
+    struct sio_timer retry_timer; /* 连接不可用时定时重新打开流 */
+    char retry_on; /* retry_timer是否在运行 */
+    uint64_t sent; /* 已经写出的字节数 */
+    char chunk[UPLOAD_CHUNK];
+};
+
+static void sio_rpc_start_upload(struct upload *up);
+static void sio_rpc_retry_upload(struct upload *up);
+
+/* 在窗口允许的范围内尽量写, 写满后等待WRITABLE事件 */
+static void sio_rpc_pump(struct sio_rpc_stream *stream, struct upload *up)
+{
+    while (up->sent < UPLOAD_TOTAL) {
+        uint32_t size = UPLOAD_CHUNK;
+        if (UPLOAD_TOTAL - up->sent < size)
+            size = UPLOAD_TOTAL - up->sent;
+        int ret = sio_rpc_stream_write(stream, up->chunk, size);
+        if (ret == -1)
+            return; /* 流已失败, ERROR事件已经回调 */
+        up->sent += ret;
+        if (ret < size)
+            return;
+    }
+    sio_rpc_stream_end(stream);
+}
+
+static void sio_rpc_stream_callback(struct sio_rpc_stream *stream, enum sio_rpc_stream_event event,
+        const char *data, uint32_t size, void *arg)
+{
+    struct upload *up = arg;
+
+    switch (event) {
+    case SIO_RPC_STREAM_WRITABLE:
+        sio_rpc_pump(stream, up);
+        break;
+    case SIO_RPC_STREAM_DATA:
+        printf("rpc stream resp:%.*s", size, data);
+        break;
+    case SIO_RPC_STREAM_END: /* 服务端应答完毕, 开始下一次上传 */
+        sio_rpc_start_upload(up);
+        break;
+    case SIO_RPC_STREAM_ERROR: /* 连接可能已断开, 稍后重新打开 */
+        printf("rpc stream error, sent=%lu\n", (unsigned long)up->sent);
+        sio_rpc_retry_upload(up);
+        break;
+    default:
+        break;
+    }
+}
+
+static void sio_rpc_retry_timer(struct sio *sio, struct sio_timer *timer, void *arg)
+{
+    struct upload *up = arg;
+    up->retry_on = 0;
+    sio_rpc_start_upload(up);
+}
+
+static void sio_rpc_start_upload(struct upload *up)
+{
+    if (client_quit)
+        return;
+    up->sent = 0;
+    /* 5秒内没有任何数据往来则视为失败 */
+    struct sio_rpc_stream *stream = sio_rpc_stream_open(up->client, 1, 5000, sio_rpc_stream_callback, up);
+    if (stream)
+        sio_rpc_pump(stream, up);
+    else /* 连接断开, 等待重连后再打开 */
+        sio_rpc_retry_upload(up);
+}
+
+static void sio_rpc_retry_upload(struct upload *up)
+{
+    if (client_quit || up->retry_on)
+        return;
+    sio_start_timer(up->sio, &up->retry_timer, 1000, sio_rpc_retry_timer, up);
+    up->retry_on = 1;
+}
+
+static void sio_rpc_quit_handler(int signo)
+{
+    client_quit = 1;
+}
+
+static void sio_rpc_client_signal()
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sio_rpc_quit_handler;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    sio_rpc_client_signal();
+
+    struct sio *sio = sio_new();
+    assert(sio);
+
+    struct sio_rpc *rpc = sio_rpc_new(sio, 10 * 1024 * 1024/*10MB read/write buffer limit*/);
+    assert(rpc);
+
+    struct sio_rpc_client *client = sio_rpc_client_new(rpc);
+    assert(client);
+    sio_rpc_add_upstream(client, "127.0.0.1", 8989);
+
+    struct upload *up = calloc(1, sizeof(*up));
+    up->sio = sio;
+    up->client = client;
+    memset(up->chunk, 'x', sizeof(up->chunk));
+    sio_rpc_start_upload(up);
+
+    while (!client_quit) {
+        sio_run(sio);
+    }
+
+    /* 未结束的流在释放客户端时以ERROR回调, 不再发起新的上传 */
+    sio_rpc_client_free(client);
+    if (up->retry_on)
+        sio_stop_timer(sio, &up->retry_timer);
+    free(up);
+
+    sio_rpc_free(rpc);
+    sio_free(sio);
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 sts=4 tw=100 */
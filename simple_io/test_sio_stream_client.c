@@ -40,7 +40,8 @@ struct sio_stream_client {
     struct sio_stream_conn *conns;
 };
 
-static const char *ip = "127.0.0.1";
+/* 候选地址, 交错200ms发起连接, 1秒内未建立则超时 */
+static const char *ips[] = {"127.0.0.1", "127.0.0.2"};
 static uint16_t port = 8989;
 
 static void sio_stream_finish_conn(struct sio_stream_conn *conn, char end);
@@ -68,6 +69,10 @@ static void sio_stream_conn_callback(struct sio *sio, struct sio_stream *stream,
     case SIO_STREAM_DATA:
         sio_stream_conn_handle_data(conn);
         break;
+    case SIO_STREAM_CONNECT_TIMEOUT:
+        printf("sio_stream_conn_callback=SIO_STREAM_CONNECT_TIMEOUT\n");
+        sio_stream_finish_conn(conn, 0);
+        break;
     case SIO_STREAM_ERROR:
     case SIO_STREAM_CLOSE:
         sio_stream_finish_conn(conn, 0);
@@ -101,7 +106,8 @@ static void sio_stream_finish_conn(struct sio_stream_conn *conn, char end)
 static void sio_stream_conn_burst_ping(struct sio *sio, struct sio_stream_conn *conn)
 {
     if (!conn->stream)
-        conn->stream = sio_stream_connect(sio, ip, port, sio_stream_conn_callback, conn);
+        conn->stream = sio_stream_connect_multi(sio, ips, sizeof(ips) / sizeof(ips[0]), port, 1000, 200,
+                NULL, sio_stream_conn_callback, conn);
 
     if (conn->stream) {
         if (sio_stream_write(sio, conn->stream, "ping", 4) == -1)
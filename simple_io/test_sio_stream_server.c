@@ -104,7 +104,16 @@ static void sio_stream_conn_callback(struct sio *sio, struct sio_stream *stream,
 static void sio_stream_server_init(struct sio_stream_server *server)
 {
     assert(server->sio = sio_new());
-    assert(server->acceptor = sio_stream_listen(server->sio, "0.0.0.0", 8989, sio_stream_conn_callback, server));
+
+    /* 低延迟链路: 关闭Nagle和延迟确认, 空闲30秒开始保活探测 */
+    struct sio_sockopt_profile profile;
+    sio_sockopt_profile_init(&profile);
+    profile.quickack = 1;
+    profile.keepalive = 1;
+    profile.keepidle = 30;
+    profile.keepintvl = 5;
+    profile.keepcnt = 3;
+    assert(server->acceptor = sio_stream_listen_profile(server->sio, "0.0.0.0", 8989, &profile, sio_stream_conn_callback, server));
     server->conn_id = 0;
     assert(server->conn_hash = shash_new());
 }